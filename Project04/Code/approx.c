@@ -0,0 +1,350 @@
+/* approx.c : Constant-memory approximate redundancy (HyperLogLog, bottom-k)
+ *
+ * No payload is retained.  Each consumer hashes the payload and feeds two
+ * sketches of its own, so consumers take no locks:
+ *
+ *  - HyperLogLog over the fingerprints estimates the distinct payloads, and
+ *    the duplicate packets are every payload beyond those.
+ *  - A bottom-k sketch keeps the BOTTOMK_SIZE smallest fingerprints with the
+ *    size of their payload.  Since a fingerprint is uniform, the sizes in the
+ *    sample over the fraction of the hash space it covers estimate the bytes
+ *    of the distinct payloads, and the redundant bytes are everything else.
+ *
+ * Both sketches merge exactly (register max and smallest-k union) when the
+ * consumers finish.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "approx.h"
+#include "pcap-process.h"
+#include "spooky.h"
+#include "stages.h"
+
+struct ApproxSketch
+{
+    uint8_t     Registers[HLL_REGISTERS];
+
+    /* Max-heap of the smallest fingerprints and their sizes */
+    uint64_t    Hashes[BOTTOMK_SIZE];
+    uint32_t    Sizes[BOTTOMK_SIZE];
+    uint32_t    Count;
+
+    /* Open addressing set of the fingerprints in the heap (-1 is empty) */
+    int32_t     Index[BOTTOMK_SIZE * 2];
+
+    /* Exact totals */
+    uint64_t    SeenCount;
+    uint64_t    SeenBytes;
+    uint64_t    Payloads;
+    uint64_t    PayloadBytes;
+};
+
+char gApproximate = 0;
+
+static struct ApproxSketch *ApproxGlobal;
+static pthread_mutex_t LockApprox = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct ApproxSketch *ApproxLocal = NULL;
+
+static struct ApproxSketch *createSketch() {
+
+  struct ApproxSketch *pSketch =
+      (struct ApproxSketch *)calloc(1, sizeof(struct ApproxSketch));
+
+  if (pSketch == NULL) {
+    printf("* Error: Unable to create an approximate sketch\n");
+    return NULL;
+  }
+
+  memset(pSketch->Index, 0xff, sizeof(pSketch->Index));
+  return pSketch;
+}
+
+char initializeApproximate() {
+
+  ApproxGlobal = createSketch();
+
+  if (ApproxGlobal == NULL) {
+    return 0;
+  }
+
+  gApproximate = 1;
+  return 1;
+}
+
+static int32_t *findHash(struct ApproxSketch *pSketch, uint64_t Hash) {
+
+  uint32_t nSlot = (uint32_t)(Hash >> 20) & (BOTTOMK_SIZE * 2 - 1);
+
+  while (pSketch->Index[nSlot] >= 0 &&
+         pSketch->Hashes[pSketch->Index[nSlot]] != Hash) {
+    nSlot = (nSlot + 1) & (BOTTOMK_SIZE * 2 - 1);
+  }
+
+  return &pSketch->Index[nSlot];
+}
+
+static void removeHash(struct ApproxSketch *pSketch, uint64_t Hash) {
+
+  uint32_t nMask = BOTTOMK_SIZE * 2 - 1;
+  uint32_t nHole = findHash(pSketch, Hash) - pSketch->Index;
+  uint32_t nSlot = nHole;
+
+  pSketch->Index[nHole] = -1;
+
+  while (1) {
+    nSlot = (nSlot + 1) & nMask;
+
+    if (pSketch->Index[nSlot] < 0) {
+      return;
+    }
+
+    uint32_t nHome =
+        (uint32_t)(pSketch->Hashes[pSketch->Index[nSlot]] >> 20) & nMask;
+
+    if (((nSlot - nHome) & nMask) >= ((nSlot - nHole) & nMask)) {
+      pSketch->Index[nHole] = pSketch->Index[nSlot];
+      pSketch->Index[nSlot] = -1;
+      nHole = nSlot;
+    }
+  }
+}
+
+static void swapHashes(struct ApproxSketch *pSketch, uint32_t a, uint32_t b) {
+
+  int32_t *pSlotA = findHash(pSketch, pSketch->Hashes[a]);
+  int32_t *pSlotB = findHash(pSketch, pSketch->Hashes[b]);
+  uint64_t nHash = pSketch->Hashes[a];
+  uint32_t nSize = pSketch->Sizes[a];
+
+  pSketch->Hashes[a] = pSketch->Hashes[b];
+  pSketch->Sizes[a] = pSketch->Sizes[b];
+  pSketch->Hashes[b] = nHash;
+  pSketch->Sizes[b] = nSize;
+  *pSlotA = b;
+  *pSlotB = a;
+}
+
+static void siftDownHash(struct ApproxSketch *pSketch, uint32_t nPos) {
+
+  while (1) {
+    uint32_t nBig = nPos;
+    uint32_t nLeft = 2 * nPos + 1;
+    uint32_t nRight = 2 * nPos + 2;
+
+    if (nLeft < pSketch->Count &&
+        pSketch->Hashes[nLeft] > pSketch->Hashes[nBig]) {
+      nBig = nLeft;
+    }
+
+    if (nRight < pSketch->Count &&
+        pSketch->Hashes[nRight] > pSketch->Hashes[nBig]) {
+      nBig = nRight;
+    }
+
+    if (nBig == nPos) {
+      return;
+    }
+
+    swapHashes(pSketch, nPos, nBig);
+    nPos = nBig;
+  }
+}
+
+/* Offer a fingerprint to the bottom-k sample */
+static void addBottomK(struct ApproxSketch *pSketch, uint64_t Hash,
+                       uint32_t Size) {
+
+  int32_t *pSlot;
+  uint32_t nPos;
+
+  // Larger than everything kept in a full sample - not part of it
+  if (pSketch->Count == BOTTOMK_SIZE && Hash >= pSketch->Hashes[0]) {
+    return;
+  }
+
+  pSlot = findHash(pSketch, Hash);
+
+  if (*pSlot >= 0) {
+    return;
+  }
+
+  if (pSketch->Count < BOTTOMK_SIZE) {
+    nPos = pSketch->Count++;
+    *pSlot = nPos;
+    pSketch->Hashes[nPos] = Hash;
+    pSketch->Sizes[nPos] = Size;
+
+    while (nPos > 0 && pSketch->Hashes[(nPos - 1) / 2] < Hash) {
+      swapHashes(pSketch, nPos, (nPos - 1) / 2);
+      nPos = (nPos - 1) / 2;
+    }
+    return;
+  }
+
+  /* Replace the largest one kept */
+  removeHash(pSketch, pSketch->Hashes[0]);
+  pSketch->Hashes[0] = Hash;
+  pSketch->Sizes[0] = Size;
+  *findHash(pSketch, Hash) = 0;
+  siftDownHash(pSketch, 0);
+}
+
+static void addHyperLogLog(struct ApproxSketch *pSketch, uint64_t Hash) {
+
+  uint32_t nRegister = Hash >> (64 - HLL_BITS);
+  uint64_t nRest = (Hash << HLL_BITS) | (1ULL << (HLL_BITS - 1));
+  uint8_t nRank = __builtin_clzll(nRest) + 1;
+
+  if (nRank > pSketch->Registers[nRegister]) {
+    pSketch->Registers[nRegister] = nRank;
+  }
+}
+
+void processPacketApproximate(struct Packet *pPacket) {
+
+  struct PacketHeaders headers;
+  uint64_t nHash, nStart;
+
+  if (ApproxLocal == NULL) {
+    ApproxLocal = createSketch();
+
+    if (ApproxLocal == NULL) {
+      discardPacket(pPacket);
+      return;
+    }
+  }
+
+  ApproxLocal->SeenCount++;
+  ApproxLocal->SeenBytes += pPacket->LengthIncluded;
+
+  /* Same filter as processPacket */
+  if (pPacket->LengthIncluded <= MIN_PKT_SIZE ||
+      parsePacketHeaders(pPacket, &headers) != PARSE_OK ||
+      pPacket->PayloadSize == 0) {
+    discardPacket(pPacket);
+    return;
+  }
+
+  nStart = stageClock();
+  nHash = spooky_hash64(pPacket->Data + pPacket->PayloadOffset,
+                        pPacket->PayloadSize, FINGERPRINT_SEED);
+  recordStage(STAGE_HASH, nStart);
+
+  ApproxLocal->Payloads++;
+  ApproxLocal->PayloadBytes += pPacket->PayloadSize;
+  addHyperLogLog(ApproxLocal, nHash);
+  addBottomK(ApproxLocal, nHash, pPacket->PayloadSize);
+
+  discardPacket(pPacket);
+}
+
+void detachApproximate() {
+
+  if (ApproxLocal == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&LockApprox);
+
+  for (int j = 0; j < HLL_REGISTERS; j++) {
+    if (ApproxLocal->Registers[j] > ApproxGlobal->Registers[j]) {
+      ApproxGlobal->Registers[j] = ApproxLocal->Registers[j];
+    }
+  }
+
+  for (uint32_t j = 0; j < ApproxLocal->Count; j++) {
+    addBottomK(ApproxGlobal, ApproxLocal->Hashes[j], ApproxLocal->Sizes[j]);
+  }
+
+  ApproxGlobal->SeenCount += ApproxLocal->SeenCount;
+  ApproxGlobal->SeenBytes += ApproxLocal->SeenBytes;
+  ApproxGlobal->Payloads += ApproxLocal->Payloads;
+  ApproxGlobal->PayloadBytes += ApproxLocal->PayloadBytes;
+
+  pthread_mutex_unlock(&LockApprox);
+
+  free(ApproxLocal);
+  ApproxLocal = NULL;
+}
+
+/* The HyperLogLog estimate with the small range (linear counting) fix */
+static double estimateDistinct(struct ApproxSketch *pSketch) {
+
+  double nSum = 0;
+  int nZeros = 0;
+  double m = HLL_REGISTERS;
+  double nEstimate;
+
+  for (int j = 0; j < HLL_REGISTERS; j++) {
+    nSum += ldexp(1.0, -pSketch->Registers[j]);
+    nZeros += pSketch->Registers[j] == 0;
+  }
+
+  nEstimate = (0.7213 / (1 + 1.079 / m)) * m * m / nSum;
+
+  if (nEstimate <= 2.5 * m && nZeros > 0) {
+    nEstimate = m * log(m / nZeros);
+  }
+
+  return nEstimate;
+}
+
+void finishApproximate() {
+
+  struct ApproxSketch *pSketch = ApproxGlobal;
+  double nDistinct, nDistinctBytes, nBytesError, nSampleBytes = 0;
+  double nSampleSquares = 0, nCountError;
+
+  detachApproximate();
+
+  nDistinct = estimateDistinct(pSketch);
+  nCountError = 1.04 / sqrt(HLL_REGISTERS) * nDistinct;
+
+  if (nDistinct > pSketch->Payloads) {
+    nDistinct = pSketch->Payloads;
+  }
+
+  for (uint32_t j = 0; j < pSketch->Count; j++) {
+    nSampleBytes += pSketch->Sizes[j];
+    nSampleSquares += (double)pSketch->Sizes[j] * pSketch->Sizes[j];
+  }
+
+  if (pSketch->Count < BOTTOMK_SIZE) {
+    /* Every distinct payload is in the sample, so this is exact */
+    nDistinctBytes = nSampleBytes;
+    nBytesError = 0;
+  } else {
+    /* The k-1 smallest over the fraction of hash space below the k-th, with
+     * the variance of a subset sum sampled at that rate */
+    double nFraction = ldexp((double)pSketch->Hashes[0], -64);
+    double nSquares = nSampleSquares -
+                      (double)pSketch->Sizes[0] * pSketch->Sizes[0];
+
+    nDistinctBytes = (nSampleBytes - pSketch->Sizes[0]) / nFraction;
+    nBytesError = sqrt(nSquares * (1 - nFraction)) / nFraction;
+  }
+
+  if (nDistinctBytes > pSketch->PayloadBytes) {
+    nDistinctBytes = pSketch->PayloadBytes;
+  }
+
+  gPacketSeenCount = pSketch->SeenCount;
+  gPacketSeenBytes = pSketch->SeenBytes;
+  gPacketHitCount = (uint64_t)(pSketch->Payloads - nDistinct + 0.5);
+  gPacketHitBytes = (uint64_t)(pSketch->PayloadBytes - nDistinctBytes + 0.5);
+
+  printf("Approximate redundancy (unbounded history, +/- two standard "
+         "errors)\n");
+  printf("  Distinct Payloads:       %.0f +/- %.0f (of %lu)\n", nDistinct,
+         2 * nCountError, (unsigned long)pSketch->Payloads);
+  printf("  Distinct Payload Bytes:  %.0f +/- %.0f (of %lu)\n", nDistinctBytes,
+         2 * nBytesError, (unsigned long)pSketch->PayloadBytes);
+  printf("  Bytes Duplicate Range:   %.0f to %.0f\n",
+         fmax(0, gPacketHitBytes - 2 * nBytesError),
+         fmin(pSketch->PayloadBytes, gPacketHitBytes + 2 * nBytesError));
+}
@@ -0,0 +1,35 @@
+/* approx.h : Constant-memory approximate redundancy (HyperLogLog, bottom-k) */
+
+#ifndef __APPROX_H
+#define __APPROX_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/* HyperLogLog with 2^HLL_BITS registers (standard error 1.04 / 2^(BITS/2)) */
+#define HLL_BITS            14
+#define HLL_REGISTERS       (1 << HLL_BITS)
+
+/* Fingerprints kept by the byte-weighted bottom-k sketch */
+#define BOTTOMK_SIZE        4096
+
+/* Non-zero if payloads are sketched instead of kept (-approximate) */
+extern char gApproximate;
+
+/** Set up the global sketches that the per-thread sketches merge into
+ * @returns 1 if successful, 0 otherwise
+ */
+char initializeApproximate ();
+
+/* Parse, hash and sketch one packet on the calling thread's sketches, then
+ * discard it.  Writes nothing shared, so no lock is needed. */
+void processPacketApproximate (struct Packet * pPacket);
+
+/* Merge the calling thread's sketches into the global ones */
+void detachApproximate ();
+
+/* Fill the global counters with the estimates and print the error bounds */
+void finishApproximate ();
+
+#endif
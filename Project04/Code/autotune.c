@@ -0,0 +1,132 @@
+/* autotune.c : Consumer pool sizing for -threads auto
+ *
+ * The reader of a pcap file has to go through it in order, so there is one
+ * reader per file and the tuning is over the consumers.  Each step samples
+ * how full the queue is and how many packets were taken off it:
+ *
+ *  - a queue that stays mostly full means the consumers are behind, so one
+ *    is added as long as the last one added paid for itself;
+ *  - a consumer that did not raise the rate by AUTO_MIN_GAIN is retired
+ *    again and the size is fixed there (the knee);
+ *  - a queue that stays mostly empty means the reader is the limit, and
+ *    more consumers will not help, so the size is fixed.
+ *
+ * After AUTO_TUNE_MS the size is fixed regardless, and later files keep it.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "autotune.h"
+
+// Max number of packets in the queue (see main.c)
+#define MAX_SIZE 100
+
+extern int StackNum;
+extern char ReaderDone;
+extern pthread_mutex_t LockStack;
+
+int availableCores() {
+
+  cpu_set_t cpus;
+
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+    return CPU_COUNT(&cpus);
+  }
+
+  long nOnline = sysconf(_SC_NPROCESSORS_ONLN);
+  return nOnline > 0 ? (int)nOnline : 1;
+}
+
+void initializeAutoThreads(struct AutoThreads *pAuto) {
+
+  int nCores = availableCores();
+
+  pAuto->Consumers = 1;
+  pAuto->MaxConsumers = nCores > 1 ? nCores - 1 : 1;
+  pAuto->Settled = 0;
+  pAuto->Grew = 0;
+  pAuto->TunedMs = 0;
+  pAuto->LastPopped = 0;
+  pAuto->LastRate = 0;
+  pAuto->LastOccupancy = 0;
+}
+
+int stepAutoThreads(struct AutoThreads *pAuto, uint64_t *Popped) {
+
+  struct timespec nap = {0, AUTO_SAMPLE_MS * 1000000L};
+  uint64_t nDepth = 0;
+  uint64_t nPopped;
+  int nSamples = AUTO_STEP_MS / AUTO_SAMPLE_MS;
+  double nRate, nOccupancy;
+
+  for (int j = 0; j < nSamples; j++) {
+    char bDone;
+
+    nanosleep(&nap, NULL);
+
+    pthread_mutex_lock(&LockStack);
+    nDepth += StackNum;
+    bDone = ReaderDone;
+    pthread_mutex_unlock(&LockStack);
+
+    /* A partial step says nothing about the rate */
+    if (bDone) {
+      return 0;
+    }
+  }
+
+  pthread_mutex_lock(&LockStack);
+  nPopped = *Popped;
+  pthread_mutex_unlock(&LockStack);
+
+  nRate = (nPopped - pAuto->LastPopped) * 1000.0 / AUTO_STEP_MS;
+  nOccupancy = (double)nDepth / nSamples / MAX_SIZE;
+  pAuto->LastPopped = nPopped;
+
+  if (pAuto->Settled) {
+    pAuto->LastRate = nRate;
+    pAuto->LastOccupancy = nOccupancy;
+    return 0;
+  }
+
+  pAuto->TunedMs += AUTO_STEP_MS;
+
+  /* The consumer added last step did not pay for itself */
+  if (pAuto->Grew && nRate < pAuto->LastRate * (1 + AUTO_MIN_GAIN)) {
+    pAuto->Settled = 1;
+    pAuto->Grew = 0;
+    pAuto->Consumers--;
+    return -1;
+  }
+
+  pAuto->Grew = 0;
+  pAuto->LastRate = nRate;
+  pAuto->LastOccupancy = nOccupancy;
+
+  if (pAuto->TunedMs >= AUTO_TUNE_MS || nOccupancy < 0.1) {
+    pAuto->Settled = 1;
+    return 0;
+  }
+
+  if (nOccupancy > 0.5 && pAuto->Consumers < pAuto->MaxConsumers) {
+    pAuto->Grew = 1;
+    pAuto->Consumers++;
+    return 1;
+  }
+
+  return 0;
+}
+
+void reportAutoThreads(struct AutoThreads *pAuto) {
+
+  printf("MAIN: -threads auto: %d consumer%s of at most %d (queue %.0f%% "
+         "full, %.0f packets/s)\n",
+         pAuto->Consumers, pAuto->Consumers == 1 ? "" : "s",
+         pAuto->MaxConsumers, pAuto->LastOccupancy * 100, pAuto->LastRate);
+}
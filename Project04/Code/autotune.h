@@ -0,0 +1,50 @@
+/* autotune.h : Consumer pool sizing for -threads auto */
+
+#ifndef __AUTOTUNE_H
+#define __AUTOTUNE_H
+
+#include <stdint.h>
+
+/* How long a step lasts, how often the queue is sampled in it, and how long
+ * the tuning goes on for before the pool size is fixed */
+#define AUTO_STEP_MS        200
+#define AUTO_SAMPLE_MS      10
+#define AUTO_TUNE_MS        3000
+
+/* A step has to beat the one before by this much to keep a new consumer */
+#define AUTO_MIN_GAIN       0.05
+
+struct AutoThreads
+{
+    /* Consumers running now and the most there may be */
+    int         Consumers;
+    int         MaxConsumers;
+
+    /* Non-zero once the size is fixed */
+    char        Settled;
+    char        Grew;
+
+    uint64_t    TunedMs;
+    uint64_t    LastPopped;
+    double      LastRate;
+    double      LastOccupancy;
+};
+
+/* Cores this process may run on */
+int availableCores ();
+
+/* Start with one consumer and allow one per available core past the reader */
+void initializeAutoThreads (struct AutoThreads * pAuto);
+
+/** Watch the queue for one step (or until the reader is done) and decide
+ * how the pool should change
+ * @param pAuto   The tuner
+ * @param Popped  Packets taken off the queue so far (read under LockStack)
+ * @returns +1 to start a consumer, -1 to retire one, 0 to leave it
+ */
+int stepAutoThreads (struct AutoThreads * pAuto, uint64_t * Popped);
+
+/* Print what the tuner settled on */
+void reportAutoThreads (struct AutoThreads * pAuto);
+
+#endif
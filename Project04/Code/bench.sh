@@ -0,0 +1,85 @@
+#!/bin/sh
+# bench.sh : Throughput and speedup sweep for redextract
+#
+# Generates a synthetic capture with pcapgen (unless one is given), then runs
+# redextract over every combination of thread count, table size and file
+# count, keeping the best of REPEATS runs.  Writes one CSV row per run:
+#
+#   files,table,threads,seconds,mbytes_per_s,speedup,duplicate_pct
+#
+# where speedup is against the first thread count of the same files and
+# table.  Compare the CSV of two builds to see a regression in the reader or
+# in processPacket as a drop in mbytes_per_s.
+#
+# Settings come from the environment:
+#   THREADS   thread counts          (default "2 3 4 6 8")
+#   TABLES    table sizes            (default "40000 400000")
+#   FILES     file counts per run    (default "1 4")
+#   REPEATS   runs per point         (default 3)
+#   CAPTURE   pcap to use            (default: generated BENCH_BYTES of it)
+#   GENFLAGS  extra pcapgen options  (default "-exact 0.3 -partial 0.1")
+#   OUT       CSV to write           (default stdout)
+
+THREADS=${THREADS:-"2 3 4 6 8"}
+TABLES=${TABLES:-"40000 400000"}
+FILES=${FILES:-"1 4"}
+REPEATS=${REPEATS:-3}
+BENCH_BYTES=${BENCH_BYTES:-134217728}
+GENFLAGS=${GENFLAGS:-"-exact 0.3 -partial 0.1"}
+WORK=${TMPDIR:-/tmp}/redextract-bench.$$
+
+cd "$(dirname "$0")" || exit 1
+make -s redextract pcapgen || exit 1
+mkdir -p "$WORK" || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+if [ -z "$CAPTURE" ]; then
+    CAPTURE=$WORK/bench.pcap
+    ./pcapgen "$CAPTURE" -bytes "$BENCH_BYTES" $GENFLAGS >&2 || exit 1
+fi
+
+exec 3>&1
+if [ -n "$OUT" ]; then
+    exec 3>"$OUT"
+fi
+
+echo "files,table,threads,seconds,mbytes_per_s,speedup,duplicate_pct" >&3
+
+for files in $FILES; do
+    list=$WORK/list.$files.txt
+    : > "$list"
+    n=0
+    while [ $n -lt "$files" ]; do
+        echo "$CAPTURE" >> "$list"
+        n=$((n + 1))
+    done
+
+    for table in $TABLES; do
+        base=""
+
+        for threads in $THREADS; do
+            best=""
+            r=0
+
+            while [ $r -lt "$REPEATS" ]; do
+                ./redextract "$list" -threads "$threads" -table "$table" \
+                    > "$WORK/run.txt" || exit 1
+                secs=$(sed -n 's/^Total Runtime (in seconds): //p' "$WORK/run.txt")
+
+                best=$(awk -v s="$secs" -v b="$best" \
+                    'BEGIN { print (b == "" || s < b) ? s : b }')
+                r=$((r + 1))
+            done
+
+            bytes=$(sed -n 's/^  Total Bytes   Parsed: *//p' "$WORK/run.txt")
+            pct=$(sed -n 's/^  Total Duplicate Percent: *\([0-9.]*\)%/\1/p' \
+                "$WORK/run.txt")
+            [ -z "$base" ] && base=$best
+
+            awk -v f="$files" -v t="$table" -v n="$threads" -v s="$best" \
+                -v b="$bytes" -v base="$base" -v p="$pct" \
+                'BEGIN { printf "%s,%s,%s,%s,%.2f,%.2f,%s\n",
+                         f, t, n, s, b / s / 1e6, base / s, p }' >&3
+        done
+    done
+done
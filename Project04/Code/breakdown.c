@@ -0,0 +1,216 @@
+/* breakdown.c : Redundancy by protocol, service port and size (-breakdown)
+ *
+ * Every thread counts into a table of its own, allocated on its first
+ * payload and linked into a list so that it outlives the thread.  Counting
+ * is a few plain adds to memory no other thread touches; the lock is only
+ * taken to link a new table.  tallyProcessing sums the tables.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "breakdown.h"
+
+struct BreakdownCell
+{
+    uint64_t    Packets;
+    uint64_t    Bytes;
+    uint64_t    Hits;
+    uint64_t    RedundantBytes;
+};
+
+struct BreakdownTable
+{
+    struct BreakdownCell        Cells[BREAKDOWN_CELLS];
+    struct BreakdownTable *     Next;
+};
+
+/* Ports of the named services (the last four buckets are by port range) */
+#define BREAKDOWN_NAMED     12
+
+static const uint16_t ServicePorts[BREAKDOWN_NAMED][2] = {
+    {80, 8080},   {443, 8443}, {53, 5353}, {22, 22},     {25, 587},
+    {123, 123},   {445, 139},  {2049, 111}, {3306, 5432}, {6379, 11211},
+    {9092, 2181}, {873, 873}};
+
+static const char *ServiceNames[BREAKDOWN_SERVICES] = {
+    "http",        "https",      "dns",       "ssh",
+    "smtp",        "ntp",        "smb",       "nfs",
+    "sql",         "cache",      "kafka",     "rsync",
+    "other <1024", "registered", "ephemeral", "none"};
+
+static const char *SizeNames[BREAKDOWN_SIZES] = {"<128", "128-511", "512-1023",
+                                                 "1024-1499", "1500+"};
+
+static const char *ProtoNames[BREAKDOWN_PROTOS] = {"tcp", "udp", "other"};
+
+char gBreakdown = 0;
+
+static struct BreakdownTable *BreakdownTables = NULL;
+static struct BreakdownCell BreakdownTotals[BREAKDOWN_CELLS];
+static pthread_mutex_t LockBreakdown = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct BreakdownTable *BreakdownLocal = NULL;
+
+void initializeBreakdown() {
+
+  memset(BreakdownTotals, 0, sizeof(BreakdownTotals));
+  gBreakdown = 1;
+}
+
+static int serviceOf(uint16_t Port) {
+
+  for (int j = 0; j < BREAKDOWN_NAMED; j++) {
+    if (Port == ServicePorts[j][0] || Port == ServicePorts[j][1]) {
+      return j;
+    }
+  }
+
+  return -1;
+}
+
+/* The service of a packet: a named port on either side, else the range of
+ * the lower port */
+static int classifyService(struct Packet *pPacket) {
+
+  uint16_t nLow;
+  int nService = serviceOf(pPacket->DstPort);
+
+  if (nService < 0) {
+    nService = serviceOf(pPacket->SrcPort);
+  }
+
+  if (nService >= 0) {
+    return nService;
+  }
+
+  nLow = pPacket->SrcPort < pPacket->DstPort ? pPacket->SrcPort
+                                              : pPacket->DstPort;
+
+  if (pPacket->SrcPort == 0 && pPacket->DstPort == 0) {
+    return BREAKDOWN_NAMED + 3;
+  }
+
+  return nLow < 1024 ? BREAKDOWN_NAMED : nLow < 49152 ? BREAKDOWN_NAMED + 1
+                                                      : BREAKDOWN_NAMED + 2;
+}
+
+static int classifySize(uint32_t Size) {
+
+  return Size < 128 ? 0 : Size < 512 ? 1 : Size < 1024 ? 2 : Size < 1500 ? 3
+                                                                         : 4;
+}
+
+void countBreakdown(struct Packet *pPacket, char Hit) {
+
+  struct BreakdownCell *pCell;
+  int nProto;
+
+  if (BreakdownLocal == NULL) {
+    BreakdownLocal =
+        (struct BreakdownTable *)calloc(1, sizeof(struct BreakdownTable));
+
+    if (BreakdownLocal == NULL) {
+      return;
+    }
+
+    pthread_mutex_lock(&LockBreakdown);
+    BreakdownLocal->Next = BreakdownTables;
+    BreakdownTables = BreakdownLocal;
+    pthread_mutex_unlock(&LockBreakdown);
+  }
+
+  nProto = pPacket->Protocol == 6 ? 0 : pPacket->Protocol == 17 ? 1 : 2;
+  pCell = &BreakdownLocal->Cells[(nProto * BREAKDOWN_SERVICES +
+                                  classifyService(pPacket)) *
+                                     BREAKDOWN_SIZES +
+                                 classifySize(pPacket->PayloadSize)];
+
+  pCell->Packets++;
+  pCell->Bytes += pPacket->PayloadSize;
+
+  if (Hit) {
+    pCell->Hits++;
+    pCell->RedundantBytes += pPacket->PayloadSize;
+  }
+}
+
+void tallyBreakdown() {
+
+  pthread_mutex_lock(&LockBreakdown);
+
+  while (BreakdownTables != NULL) {
+    struct BreakdownTable *pTable = BreakdownTables;
+
+    for (int j = 0; j < BREAKDOWN_CELLS; j++) {
+      BreakdownTotals[j].Packets += pTable->Cells[j].Packets;
+      BreakdownTotals[j].Bytes += pTable->Cells[j].Bytes;
+      BreakdownTotals[j].Hits += pTable->Cells[j].Hits;
+      BreakdownTotals[j].RedundantBytes += pTable->Cells[j].RedundantBytes;
+    }
+
+    /* A live thread keeps its table (only the main thread tallies) */
+    BreakdownTables = pTable->Next;
+
+    if (pTable == BreakdownLocal) {
+      BreakdownLocal = NULL;
+    }
+
+    free(pTable);
+  }
+
+  pthread_mutex_unlock(&LockBreakdown);
+}
+
+static int compareCells(const void *a, const void *b) {
+
+  int nCellA = *(const int *)a;
+  int nCellB = *(const int *)b;
+  struct BreakdownCell *pA = &BreakdownTotals[nCellA];
+  struct BreakdownCell *pB = &BreakdownTotals[nCellB];
+
+  if (pA->RedundantBytes != pB->RedundantBytes) {
+    return pA->RedundantBytes < pB->RedundantBytes ? 1 : -1;
+  }
+
+  if (pA->Bytes != pB->Bytes) {
+    return pA->Bytes < pB->Bytes ? 1 : -1;
+  }
+
+  return nCellA < nCellB ? -1 : nCellA > nCellB;
+}
+
+void printBreakdown() {
+
+  int pOrder[BREAKDOWN_CELLS];
+  int nUsed = 0;
+  uint64_t nRedundant = 0;
+
+  for (int j = 0; j < BREAKDOWN_CELLS; j++) {
+    if (BreakdownTotals[j].Packets > 0) {
+      pOrder[nUsed++] = j;
+      nRedundant += BreakdownTotals[j].RedundantBytes;
+    }
+  }
+
+  qsort(pOrder, nUsed, sizeof(int), compareCells);
+
+  printf("Redundancy by protocol, service and payload size\n");
+  printf("  Proto Service      Size        Payloads  Payload Bytes       Hits "
+         "Redundant Bytes  Dup%%  Share\n");
+
+  for (int j = 0; j < nUsed; j++) {
+    struct BreakdownCell *pCell = &BreakdownTotals[pOrder[j]];
+    int nSize = pOrder[j] % BREAKDOWN_SIZES;
+    int nService = pOrder[j] / BREAKDOWN_SIZES % BREAKDOWN_SERVICES;
+    int nProto = pOrder[j] / BREAKDOWN_SIZES / BREAKDOWN_SERVICES;
+
+    printf("  %-5s %-12s %-9s %10lu %14lu %10lu %15lu %5.1f %5.1f%%\n",
+           ProtoNames[nProto], ServiceNames[nService], SizeNames[nSize],
+           (unsigned long)pCell->Packets, (unsigned long)pCell->Bytes,
+           (unsigned long)pCell->Hits, (unsigned long)pCell->RedundantBytes,
+           pCell->Bytes ? pCell->RedundantBytes * 100.0 / pCell->Bytes : 0.0,
+           nRedundant ? pCell->RedundantBytes * 100.0 / nRedundant : 0.0);
+  }
+}
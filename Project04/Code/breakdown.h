@@ -0,0 +1,38 @@
+/* breakdown.h : Redundancy by protocol, service port and size (-breakdown) */
+
+#ifndef __BREAKDOWN_H
+#define __BREAKDOWN_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/* Protocols: TCP, UDP and anything else */
+#define BREAKDOWN_PROTOS    3
+
+/* Service buckets by port (see breakdown.c) and payload size classes */
+#define BREAKDOWN_SERVICES  16
+#define BREAKDOWN_SIZES     5
+
+#define BREAKDOWN_CELLS     (BREAKDOWN_PROTOS * BREAKDOWN_SERVICES * BREAKDOWN_SIZES)
+
+/* Non-zero if the breakdown is being kept */
+extern char gBreakdown;
+
+/* Start keeping the breakdown */
+void initializeBreakdown ();
+
+/** Count a payload against the calling thread's own table
+ * @param pPacket  The packet or chunk (protocol, ports and size set)
+ * @param Hit      Non-zero if the payload was a duplicate
+ */
+void countBreakdown (struct Packet * pPacket, char Hit);
+
+/* Sum the tables of every thread into the breakdown (called by
+ * tallyProcessing once the consumers are done) */
+void tallyBreakdown ();
+
+/* Print the cells with payloads, most redundant bytes first */
+void printBreakdown ();
+
+#endif
@@ -0,0 +1,680 @@
+/* decompress.c : Reading gzip and zstd compressed captures
+ *
+ * A compressed capture is mapped and decompressed by its own threads into a
+ * ring of slots that the reader drains in order through a stdio stream
+ * (fopencookie), so the pcap parser is unchanged.  Frame N always lands in
+ * slot N % slots and a thread only starts a frame once its slot is free, so
+ * at most slots frames are held decompressed at a time.
+ *
+ * Inputs whose frames can be found and sized up front - BGZF gzip, where
+ * each block names its compressed size and ends with its length, and zstd
+ * with several frames that record their content size - are decompressed a
+ * frame per thread.  Anything else (a single gzip member, a single zstd
+ * frame, frames of unknown size) is streamed by one thread in chunks of
+ * DECOMPRESS_CHUNK, which still overlaps decompression with parsing.
+ *
+ * zlib is linked; libzstd is loaded when first needed so that the build
+ * does not depend on its headers.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "autotune.h"
+#include "decompress.h"
+
+#define FORMAT_GZIP     1
+#define FORMAT_ZSTD     2
+
+/* ZSTD_CONTENTSIZE_UNKNOWN and ZSTD_CONTENTSIZE_ERROR */
+#define ZSTD_SIZE_UNKNOWN   (0ULL - 1)
+#define ZSTD_SIZE_ERROR     (0ULL - 2)
+
+/* Buffers as in zstd.h */
+struct ZstdInBuffer
+{
+    const void *    Src;
+    size_t          Size;
+    size_t          Pos;
+};
+
+struct ZstdOutBuffer
+{
+    void *          Dst;
+    size_t          Size;
+    size_t          Pos;
+};
+
+/* The entry points of libzstd that are used */
+struct ZstdApi
+{
+    void *      Library;
+    unsigned    (*IsError) (size_t);
+    size_t      (*FindFrameCompressedSize) (const void *, size_t);
+    unsigned long long (*GetFrameContentSize) (const void *, size_t);
+    void *      (*CreateDCtx) (void);
+    size_t      (*FreeDCtx) (void *);
+    size_t      (*DecompressDCtx) (void *, void *, size_t, const void *, size_t);
+    size_t      (*DecompressStream) (void *, struct ZstdOutBuffer *,
+                                     struct ZstdInBuffer *);
+};
+
+/* A frame that can be decompressed on its own */
+struct Frame
+{
+    uint64_t    Offset;
+    uint64_t    Size;
+    uint64_t    OutSize;
+};
+
+struct DecompressSlot
+{
+    uint8_t *   Data;
+    size_t      Capacity;
+    size_t      Length;
+    size_t      Pos;
+    char        Ready;
+};
+
+struct Decompressor
+{
+    const char *            FileName;
+    int                     Format;
+
+    /* The mapped compressed file */
+    const uint8_t *         In;
+    size_t                  InSize;
+
+    /* Frames if decompressed in parallel, NULL if streamed */
+    struct Frame *          Frames;
+    int                     FrameCount;
+
+    pthread_t *             Workers;
+    int                     WorkerCount;
+
+    struct DecompressSlot * Slots;
+    int                     SlotCount;
+
+    /* Next frame or chunk to start, next one the reader wants, and how many
+     * there are (only known once Done when streaming) */
+    int                     NextJob;
+    int                     NextRead;
+    int                     JobCount;
+    char                    Done;
+    char                    Stop;
+
+    pthread_mutex_t         Lock;
+    pthread_cond_t          SlotFree;
+    pthread_cond_t          SlotReady;
+};
+
+int gDecompressThreads = 0;
+
+static struct ZstdApi Zstd;
+static pthread_once_t ZstdOnce = PTHREAD_ONCE_INIT;
+
+static void loadZstd() {
+
+  void *pLib = dlopen("libzstd.so.1", RTLD_NOW);
+
+  if (pLib == NULL) {
+    pLib = dlopen("libzstd.so", RTLD_NOW);
+  }
+
+  if (pLib == NULL) {
+    return;
+  }
+
+  Zstd.IsError = (unsigned (*)(size_t))dlsym(pLib, "ZSTD_isError");
+  Zstd.FindFrameCompressedSize = (size_t (*)(const void *, size_t))dlsym(
+      pLib, "ZSTD_findFrameCompressedSize");
+  Zstd.GetFrameContentSize = (unsigned long long (*)(const void *, size_t))dlsym(
+      pLib, "ZSTD_getFrameContentSize");
+  Zstd.CreateDCtx = (void *(*)(void))dlsym(pLib, "ZSTD_createDCtx");
+  Zstd.FreeDCtx = (size_t (*)(void *))dlsym(pLib, "ZSTD_freeDCtx");
+  Zstd.DecompressDCtx =
+      (size_t (*)(void *, void *, size_t, const void *, size_t))dlsym(
+          pLib, "ZSTD_decompressDCtx");
+  Zstd.DecompressStream = (size_t (*)(void *, struct ZstdOutBuffer *,
+                                      struct ZstdInBuffer *))dlsym(
+      pLib, "ZSTD_decompressStream");
+
+  if (Zstd.IsError == NULL || Zstd.FindFrameCompressedSize == NULL ||
+      Zstd.GetFrameContentSize == NULL || Zstd.CreateDCtx == NULL ||
+      Zstd.FreeDCtx == NULL || Zstd.DecompressDCtx == NULL ||
+      Zstd.DecompressStream == NULL) {
+    dlclose(pLib);
+    return;
+  }
+
+  Zstd.Library = pLib;
+}
+
+/* Split BGZF gzip into its blocks; 0 if it is some other gzip */
+static int findGzipFrames(struct Decompressor *pDec) {
+
+  uint64_t nOffset = 0;
+  int nMax = 0;
+
+  while (nOffset < pDec->InSize) {
+    const uint8_t *p = pDec->In + nOffset;
+    uint64_t nLeft = pDec->InSize - nOffset;
+    uint64_t nBlock = 0;
+    uint32_t nExtra;
+    uint32_t nOut;
+
+    /* ID1 ID2 CM FLG(FEXTRA) MTIME XFL OS XLEN, then the BC subfield */
+    if (nLeft < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 ||
+        !(p[3] & 4)) {
+      return 0;
+    }
+
+    nExtra = p[10] | p[11] << 8;
+
+    for (uint32_t j = 12; j + 4 <= 12 + nExtra && j + 4 <= nLeft;) {
+      uint32_t nLength = p[j + 2] | p[j + 3] << 8;
+
+      if (p[j] == 'B' && p[j + 1] == 'C' && nLength == 2 && j + 6 <= nLeft) {
+        nBlock = (uint64_t)(p[j + 4] | p[j + 5] << 8) + 1;
+        break;
+      }
+
+      j += 4 + nLength;
+    }
+
+    if (nBlock < 18 + 8 || nBlock > nLeft) {
+      return 0;
+    }
+
+    /* ISIZE closes the block; past the limit it is streamed instead */
+    nOut = (uint32_t)(p[nBlock - 4] | p[nBlock - 3] << 8 | p[nBlock - 2] << 16 |
+                      (uint32_t)p[nBlock - 1] << 24);
+
+    if (nOut > DECOMPRESS_MAX_FRAME) {
+      return 0;
+    }
+
+    if (pDec->FrameCount == nMax) {
+      struct Frame *pFrames;
+
+      nMax = nMax ? nMax * 2 : 1024;
+      pFrames =
+          (struct Frame *)realloc(pDec->Frames, sizeof(struct Frame) * nMax);
+
+      if (pFrames == NULL) {
+        return 0;
+      }
+
+      pDec->Frames = pFrames;
+    }
+
+    pDec->Frames[pDec->FrameCount].Offset = nOffset;
+    pDec->Frames[pDec->FrameCount].Size = nBlock;
+    pDec->Frames[pDec->FrameCount].OutSize = nOut;
+    pDec->FrameCount++;
+
+    nOffset += nBlock;
+  }
+
+  return 1;
+}
+
+/* Split zstd into frames of known size; 0 if any size is unknown */
+static int findZstdFrames(struct Decompressor *pDec) {
+
+  uint64_t nOffset = 0;
+  int nMax = 0;
+
+  while (nOffset < pDec->InSize) {
+    size_t nLeft = pDec->InSize - nOffset;
+    size_t nSize = Zstd.FindFrameCompressedSize(pDec->In + nOffset, nLeft);
+    unsigned long long nOut =
+        Zstd.GetFrameContentSize(pDec->In + nOffset, nLeft);
+
+    if (Zstd.IsError(nSize) || nOut == ZSTD_SIZE_UNKNOWN ||
+        nOut == ZSTD_SIZE_ERROR || nOut > DECOMPRESS_MAX_FRAME) {
+      return 0;
+    }
+
+    if (pDec->FrameCount == nMax) {
+      struct Frame *pFrames;
+
+      nMax = nMax ? nMax * 2 : 1024;
+      pFrames =
+          (struct Frame *)realloc(pDec->Frames, sizeof(struct Frame) * nMax);
+
+      if (pFrames == NULL) {
+        return 0;
+      }
+
+      pDec->Frames = pFrames;
+    }
+
+    pDec->Frames[pDec->FrameCount].Offset = nOffset;
+    pDec->Frames[pDec->FrameCount].Size = nSize;
+    pDec->Frames[pDec->FrameCount].OutSize = nOut;
+    pDec->FrameCount++;
+
+    nOffset += nSize;
+  }
+
+  return 1;
+}
+
+/* Wait for the slot of the next job and claim it; -1 if there is none */
+static int claimJob(struct Decompressor *pDec) {
+
+  int nJob;
+
+  pthread_mutex_lock(&pDec->Lock);
+
+  while (!pDec->Stop && pDec->NextJob < pDec->JobCount &&
+         pDec->NextJob - pDec->NextRead >= pDec->SlotCount) {
+    pthread_cond_wait(&pDec->SlotFree, &pDec->Lock);
+  }
+
+  nJob = pDec->Stop || pDec->NextJob >= pDec->JobCount ? -1 : pDec->NextJob++;
+
+  pthread_mutex_unlock(&pDec->Lock);
+
+  return nJob;
+}
+
+/* Hand a finished job to the reader */
+static void finishJob(struct Decompressor *pDec, int nJob, size_t nLength) {
+
+  pthread_mutex_lock(&pDec->Lock);
+  pDec->Slots[nJob % pDec->SlotCount].Length = nLength;
+  pDec->Slots[nJob % pDec->SlotCount].Pos = 0;
+  pDec->Slots[nJob % pDec->SlotCount].Ready = 1;
+  pthread_cond_broadcast(&pDec->SlotReady);
+  pthread_mutex_unlock(&pDec->Lock);
+}
+
+/* End the output at a job: the last one when streaming, or a bad frame */
+static void endJobs(struct Decompressor *pDec, int nJob) {
+
+  pthread_mutex_lock(&pDec->Lock);
+
+  if (nJob < pDec->JobCount) {
+    pDec->JobCount = nJob;
+  }
+
+  pDec->Done = 1;
+  pthread_cond_broadcast(&pDec->SlotReady);
+  pthread_cond_broadcast(&pDec->SlotFree);
+  pthread_mutex_unlock(&pDec->Lock);
+}
+
+static char inflateFrame(const uint8_t *pIn, struct Frame *pFrame,
+                         uint8_t *pOut) {
+
+  z_stream stream;
+  int nResult;
+
+  memset(&stream, 0, sizeof(stream));
+
+  if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+    return 0;
+  }
+
+  stream.next_in = (Bytef *)(pIn + pFrame->Offset);
+  stream.avail_in = pFrame->Size;
+  stream.next_out = pOut;
+  stream.avail_out = pFrame->OutSize;
+
+  nResult = inflate(&stream, Z_FINISH);
+  inflateEnd(&stream);
+
+  return nResult == Z_STREAM_END && stream.total_out == pFrame->OutSize;
+}
+
+/* Decompress whole frames, one per job, into their slots */
+static void *decompressFrames(void *pArg) {
+
+  struct Decompressor *pDec = (struct Decompressor *)pArg;
+  void *pContext = NULL;
+  int nJob;
+
+  if (pDec->Format == FORMAT_ZSTD) {
+    pContext = Zstd.CreateDCtx();
+  }
+
+  while ((nJob = claimJob(pDec)) >= 0) {
+    struct Frame *pFrame = &pDec->Frames[nJob];
+    struct DecompressSlot *pSlot = &pDec->Slots[nJob % pDec->SlotCount];
+    char bGood;
+
+    /* A slot grows to the largest frame it has held */
+    if (pSlot->Capacity < pFrame->OutSize || pSlot->Data == NULL) {
+      free(pSlot->Data);
+      pSlot->Capacity = pFrame->OutSize;
+      pSlot->Data = (uint8_t *)malloc(pFrame->OutSize ? pFrame->OutSize : 1);
+    }
+
+    if (pSlot->Data == NULL) {
+      bGood = 0;
+    } else if (pDec->Format == FORMAT_GZIP) {
+      bGood = inflateFrame(pDec->In, pFrame, pSlot->Data);
+    } else {
+      size_t nSize =
+          pContext == NULL
+              ? 1
+              : Zstd.DecompressDCtx(pContext, pSlot->Data, pFrame->OutSize,
+                                    pDec->In + pFrame->Offset, pFrame->Size);
+      bGood = pContext != NULL && !Zstd.IsError(nSize) &&
+              nSize == pFrame->OutSize;
+    }
+
+    if (!bGood) {
+      printf("* Error: Frame %d of %s is corrupt\n", nJob, pDec->FileName);
+      endJobs(pDec, nJob);
+      break;
+    }
+
+    finishJob(pDec, nJob, pFrame->OutSize);
+  }
+
+  if (pContext != NULL) {
+    Zstd.FreeDCtx(pContext);
+  }
+
+  return NULL;
+}
+
+/* Stream the whole input through one decoder in DECOMPRESS_CHUNK pieces */
+static void *decompressStream(void *pArg) {
+
+  struct Decompressor *pDec = (struct Decompressor *)pArg;
+  struct ZstdInBuffer zin = {pDec->In, pDec->InSize, 0};
+  void *pContext = NULL;
+  z_stream stream;
+  char bEnd = 0;
+  char bGood = 1;
+  int nJob = 0;
+
+  if (pDec->Format == FORMAT_GZIP) {
+    memset(&stream, 0, sizeof(stream));
+    bGood = inflateInit2(&stream, 15 + 32) == Z_OK;
+    stream.next_in = (Bytef *)pDec->In;
+  } else {
+    pContext = Zstd.CreateDCtx();
+    bGood = pContext != NULL;
+  }
+
+  while (bGood && !bEnd && (nJob = claimJob(pDec)) >= 0) {
+    struct DecompressSlot *pSlot = &pDec->Slots[nJob % pDec->SlotCount];
+    size_t nOut = 0;
+
+    if (pSlot->Data == NULL) {
+      pSlot->Data = (uint8_t *)malloc(DECOMPRESS_CHUNK);
+      bGood = pSlot->Data != NULL;
+    }
+
+    while (bGood && !bEnd && nOut < DECOMPRESS_CHUNK) {
+      if (pDec->Format == FORMAT_GZIP) {
+        size_t nUsed = (const uint8_t *)stream.next_in - pDec->In;
+        int nResult;
+
+        /* avail_in is only 32 bits wide */
+        if (stream.avail_in == 0) {
+          stream.avail_in = pDec->InSize - nUsed > (1u << 30)
+                                ? 1u << 30
+                                : pDec->InSize - nUsed;
+        }
+
+        stream.next_out = pSlot->Data + nOut;
+        stream.avail_out = DECOMPRESS_CHUNK - nOut;
+        nResult = inflate(&stream, Z_NO_FLUSH);
+        nOut = DECOMPRESS_CHUNK - stream.avail_out;
+        nUsed = (const uint8_t *)stream.next_in - pDec->In;
+
+        if (nResult == Z_STREAM_END) {
+          /* Members may simply be concatenated */
+          if (nUsed < pDec->InSize) {
+            inflateReset(&stream);
+          } else {
+            bEnd = 1;
+          }
+        } else if (nResult != Z_OK) {
+          bGood = 0;
+        }
+      } else {
+        struct ZstdOutBuffer zout = {pSlot->Data, DECOMPRESS_CHUNK, nOut};
+        size_t nResult = Zstd.DecompressStream(pContext, &zout, &zin);
+
+        if (Zstd.IsError(nResult)) {
+          bGood = 0;
+        } else if (zin.Pos == zin.Size && zout.Pos < zout.Size) {
+          /* All input taken and room to spare, so nothing is pending; a
+           * frame left open is a truncated file */
+          bGood = nResult == 0;
+          bEnd = 1;
+        }
+
+        nOut = zout.Pos;
+      }
+    }
+
+    if (!bGood) {
+      printf("* Error: %s is corrupt or truncated\n", pDec->FileName);
+    }
+
+    finishJob(pDec, nJob, nOut);
+    nJob++;
+  }
+
+  endJobs(pDec, nJob);
+
+  if (pDec->Format == FORMAT_GZIP) {
+    inflateEnd(&stream);
+  } else if (pContext != NULL) {
+    Zstd.FreeDCtx(pContext);
+  }
+
+  return NULL;
+}
+
+/* The reader's side of the stream: drain the slots in order */
+static ssize_t readCapture(void *pCookie, char *pBuffer, size_t Size) {
+
+  struct Decompressor *pDec = (struct Decompressor *)pCookie;
+  size_t nCopied = 0;
+
+  while (nCopied < Size) {
+    struct DecompressSlot *pSlot =
+        &pDec->Slots[pDec->NextRead % pDec->SlotCount];
+    size_t nTake;
+    char bReady;
+
+    pthread_mutex_lock(&pDec->Lock);
+
+    while (!pSlot->Ready &&
+           !(pDec->Done && pDec->NextRead >= pDec->JobCount)) {
+      pthread_cond_wait(&pDec->SlotReady, &pDec->Lock);
+    }
+
+    bReady = pSlot->Ready;
+    pthread_mutex_unlock(&pDec->Lock);
+
+    if (!bReady) {
+      break;
+    }
+
+    /* A ready slot is the reader's until it is handed back */
+    nTake = pSlot->Length - pSlot->Pos;
+    nTake = nTake < Size - nCopied ? nTake : Size - nCopied;
+    memcpy(pBuffer + nCopied, pSlot->Data + pSlot->Pos, nTake);
+    pSlot->Pos += nTake;
+    nCopied += nTake;
+
+    if (pSlot->Pos == pSlot->Length) {
+      pthread_mutex_lock(&pDec->Lock);
+      pSlot->Ready = 0;
+      pDec->NextRead++;
+      pthread_cond_broadcast(&pDec->SlotFree);
+      pthread_mutex_unlock(&pDec->Lock);
+    }
+  }
+
+  return nCopied;
+}
+
+static int closeCapture(void *pCookie) {
+
+  struct Decompressor *pDec = (struct Decompressor *)pCookie;
+
+  pthread_mutex_lock(&pDec->Lock);
+  pDec->Stop = 1;
+  pthread_cond_broadcast(&pDec->SlotFree);
+  pthread_mutex_unlock(&pDec->Lock);
+
+  for (int j = 0; j < pDec->WorkerCount; j++) {
+    pthread_join(pDec->Workers[j], NULL);
+  }
+
+  for (int j = 0; j < pDec->SlotCount; j++) {
+    free(pDec->Slots[j].Data);
+  }
+
+  munmap((void *)pDec->In, pDec->InSize);
+  pthread_mutex_destroy(&pDec->Lock);
+  pthread_cond_destroy(&pDec->SlotFree);
+  pthread_cond_destroy(&pDec->SlotReady);
+  free(pDec->Slots);
+  free(pDec->Workers);
+  free(pDec->Frames);
+  free(pDec);
+
+  return 0;
+}
+
+FILE *openCapture(const char *pFileName) {
+
+  cookie_io_functions_t functions = {readCapture, NULL, NULL, closeCapture};
+  struct Decompressor *pDec;
+  struct stat fileStat;
+  uint8_t nMagic[4] = {0, 0, 0, 0};
+  int nFormat = 0;
+  int nThreads;
+  FILE *pFile;
+  int fd;
+
+  pFile = fopen(pFileName, "r");
+
+  if (pFile == NULL) {
+    return NULL;
+  }
+
+  if (fread(nMagic, 1, 4, pFile) == 4) {
+    if (nMagic[0] == 0x1f && nMagic[1] == 0x8b) {
+      nFormat = FORMAT_GZIP;
+    } else if (nMagic[0] == 0x28 && nMagic[1] == 0xb5 && nMagic[2] == 0x2f &&
+               nMagic[3] == 0xfd) {
+      nFormat = FORMAT_ZSTD;
+    }
+  }
+
+  if (nFormat == 0) {
+    rewind(pFile);
+    return pFile;
+  }
+
+  fd = dup(fileno(pFile));
+  fclose(pFile);
+
+  if (nFormat == FORMAT_ZSTD) {
+    pthread_once(&ZstdOnce, loadZstd);
+
+    if (Zstd.Library == NULL) {
+      printf("* Error: %s is zstd compressed but libzstd is not available\n",
+             pFileName);
+      close(fd);
+      return NULL;
+    }
+  }
+
+  pDec = (struct Decompressor *)calloc(1, sizeof(struct Decompressor));
+
+  if (pDec == NULL || fd < 0 || fstat(fd, &fileStat) != 0) {
+    free(pDec);
+    close(fd);
+    return NULL;
+  }
+
+  pDec->FileName = pFileName;
+  pDec->Format = nFormat;
+  pDec->InSize = fileStat.st_size;
+  pDec->In = (const uint8_t *)mmap(NULL, pDec->InSize, PROT_READ, MAP_PRIVATE,
+                                   fd, 0);
+  close(fd);
+
+  if (pDec->In == MAP_FAILED) {
+    printf("* Error: Unable to map %s\n", pFileName);
+    free(pDec);
+    return NULL;
+  }
+
+  madvise((void *)pDec->In, pDec->InSize, MADV_SEQUENTIAL);
+
+  /* Only inputs of several frames of known size go in parallel */
+  if (!(nFormat == FORMAT_GZIP ? findGzipFrames(pDec) : findZstdFrames(pDec)) ||
+      pDec->FrameCount < 2) {
+    free(pDec->Frames);
+    pDec->Frames = NULL;
+    pDec->FrameCount = 0;
+  }
+
+  nThreads = gDecompressThreads > 0 ? gDecompressThreads : availableCores();
+
+  if (pDec->Frames == NULL || nThreads < 1) {
+    nThreads = 1;
+  } else if (nThreads > pDec->FrameCount) {
+    nThreads = pDec->FrameCount;
+  }
+
+  pDec->WorkerCount = nThreads;
+  pDec->SlotCount = nThreads * DECOMPRESS_SLOTS;
+  pDec->JobCount = pDec->Frames != NULL ? pDec->FrameCount : 1 << 30;
+  pDec->Done = pDec->Frames != NULL;
+  pDec->Slots = (struct DecompressSlot *)calloc(pDec->SlotCount,
+                                                sizeof(struct DecompressSlot));
+  pDec->Workers = (pthread_t *)malloc(sizeof(pthread_t) * nThreads);
+  pthread_mutex_init(&pDec->Lock, NULL);
+  pthread_cond_init(&pDec->SlotFree, NULL);
+  pthread_cond_init(&pDec->SlotReady, NULL);
+
+  pFile = pDec->Slots != NULL && pDec->Workers != NULL
+              ? fopencookie(pDec, "r", functions)
+              : NULL;
+
+  if (pFile == NULL) {
+    pDec->WorkerCount = 0;
+    closeCapture(pDec);
+    return NULL;
+  }
+
+  printf("Decompressing %s (%s, %s on %d thread%s)\n", pFileName,
+         nFormat == FORMAT_GZIP ? "gzip" : "zstd",
+         pDec->Frames != NULL ? "frames in parallel" : "streamed", nThreads,
+         nThreads == 1 ? "" : "s");
+
+  for (int j = 0; j < nThreads; j++) {
+    pthread_create(&pDec->Workers[j], NULL,
+                   pDec->Frames != NULL ? decompressFrames : decompressStream,
+                   pDec);
+  }
+
+  return pFile;
+}
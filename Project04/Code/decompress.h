@@ -0,0 +1,29 @@
+/* decompress.h : Reading gzip and zstd compressed captures */
+
+#ifndef __DECOMPRESS_H
+#define __DECOMPRESS_H
+
+#include <stdio.h>
+
+/* Decompressed output handed to the reader per slot when streaming */
+#define DECOMPRESS_CHUNK        (1 << 20)
+
+/* Frames are only spread over threads if none decompresses to more */
+#define DECOMPRESS_MAX_FRAME    (16 << 20)
+
+/* Decompressed frames or chunks waiting for the reader, per thread */
+#define DECOMPRESS_SLOTS        2
+
+/* Threads for multi-frame inputs (-decompress-threads), 0 for one per core */
+extern int gDecompressThreads;
+
+/** Open a capture for reading whether it is plain, gzip (.pcap.gz, with
+ * BGZF blocks decompressed in parallel) or zstd (.pcap.zst, with multiple
+ * frames decompressed in parallel).  The format is told by the first bytes
+ * of the file, not its name.  fclose joins the decompression threads.
+ * @param pFileName  The capture to open
+ * @returns A stream of the decompressed capture, NULL on failure
+ */
+FILE * openCapture (const char * pFileName);
+
+#endif
@@ -0,0 +1,268 @@
+/* engine.c : Reentrant redundancy engine (libredextract)
+ *
+ * The table lookup (spooky fingerprint, one slot per fingerprint, the older
+ * payload evicted on a collision) with all of the state in the engine.
+ * redextract looks its payloads up here too, through processPayload.  Hits
+ * are counted as they happen so that a snapshot does not have to walk the
+ * table.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "spooky.h"
+
+/* Packets handled per acquisition of the table lock */
+#define ENGINE_BATCH        64
+
+struct RedEngine
+{
+    struct PacketEntry *    Table;
+    int                     TableSize;
+
+    /* Non-zero if destroyEngine frees the table (createEngine) */
+    char                    OwnsTable;
+
+    /* Guards the table and the counters */
+    pthread_mutex_t         Lock;
+    struct RedStats         Stats;
+
+    /* Set by an embedder with more state per entry (setEngineHooks) */
+    struct RedHooks         Hooks;
+};
+
+struct RedEngine *createEngineOn(struct PacketEntry *pTable, int TableSize) {
+
+  struct RedEngine *pEngine;
+
+  if (pTable == NULL || TableSize <= 0) {
+    return NULL;
+  }
+
+  pEngine = (struct RedEngine *)calloc(1, sizeof(struct RedEngine));
+
+  if (pEngine == NULL) {
+    return NULL;
+  }
+
+  pEngine->Table = pTable;
+  pEngine->TableSize = TableSize;
+  pEngine->Stats.TableSize = TableSize;
+  pthread_mutex_init(&pEngine->Lock, NULL);
+
+  for (int j = 0; j < TableSize; j++) {
+    if (pTable[j].PayloadSize != 0) {
+      pEngine->Stats.EntriesUsed++;
+    }
+  }
+
+  return pEngine;
+}
+
+struct RedEngine *createEngine(int TableSize) {
+
+  struct RedEngine *pEngine;
+  struct PacketEntry *pTable;
+
+  if (TableSize <= 0) {
+    return NULL;
+  }
+
+  pTable = (struct PacketEntry *)calloc(TableSize, sizeof(struct PacketEntry));
+  pEngine = createEngineOn(pTable, TableSize);
+
+  if (pEngine == NULL) {
+    free(pTable);
+    return NULL;
+  }
+
+  pEngine->OwnsTable = 1;
+  return pEngine;
+}
+
+void setEngineHooks(struct RedEngine *pEngine, const struct RedHooks *pHooks) {
+
+  pEngine->Hooks = *pHooks;
+}
+
+static uint8_t *getPayload(struct RedEngine *pEngine,
+                           struct PacketEntry *pEntry) {
+
+  if (pEntry->ThePacket != NULL) {
+    return pEntry->ThePacket->Data + pEntry->ThePacket->PayloadOffset;
+  }
+
+  return pEngine->Hooks.EntryPayload(pEngine, pEntry, pEngine->Hooks.UserData);
+}
+
+void emptyEngineEntry(struct RedEngine *pEngine, int nEntry) {
+
+  struct PacketEntry *pEntry = &pEngine->Table[nEntry];
+
+  if (pEntry->PayloadSize == 0) {
+    return;
+  }
+
+  if (pEntry->ThePacket != NULL) {
+    discardPacket(pEntry->ThePacket);
+  }
+
+  pEntry->ThePacket = NULL;
+  pEntry->HitCount = 0;
+  pEntry->RedundantBytes = 0;
+  pEntry->PayloadSize = 0;
+  pEngine->Stats.EntriesUsed--;
+}
+
+void lookupEngine(struct RedEngine *pEngine, struct Packet *pPacket,
+                  uint64_t Hash, struct RedLookup *pLookup) {
+
+  int j = Hash % pEngine->TableSize;
+  struct PacketEntry *pEntry = &pEngine->Table[j];
+  uint8_t *pPayload = pPacket->Data + pPacket->PayloadOffset;
+
+  pEngine->Stats.Payloads++;
+  pEngine->Stats.PayloadBytes += pPacket->PayloadSize;
+  memset(pLookup, 0, sizeof(*pLookup));
+  pLookup->Entry = j;
+
+  if (pEntry->PayloadSize != 0) {
+
+    /* Same fingerprint and size, then do the bytes match up? */
+    if (pEntry->Fingerprint == Hash &&
+        pEntry->PayloadSize == pPacket->PayloadSize) {
+      uint8_t *pOld = getPayload(pEngine, pEntry);
+      int nCompare;
+
+      if (pEngine->Hooks.Clock != NULL) {
+        pLookup->CompareStart = pEngine->Hooks.Clock();
+      }
+
+      nCompare = memcmp(pOld, pPayload, pPacket->PayloadSize);
+
+      if (pEngine->Hooks.Clock != NULL) {
+        pLookup->CompareEnd = pEngine->Hooks.Clock();
+      }
+
+      if (nCompare == 0) {
+        pEntry->HitCount++;
+        pEntry->RedundantBytes += pPacket->PayloadSize;
+        pEngine->Stats.Hits++;
+        pEngine->Stats.HitBytes += pPacket->PayloadSize;
+        pLookup->Hit = 1;
+        pLookup->Drop = pPacket;
+        return;
+      }
+    }
+
+    /* Collision with a different payload - kick out the older entry */
+    if (pEngine->Hooks.EvictEntry != NULL) {
+      pEngine->Hooks.EvictEntry(pEngine, j, pEngine->Hooks.UserData);
+    } else {
+      // Freed by the caller once the lock is dropped
+      pLookup->Drop = pEntry->ThePacket;
+      pEntry->ThePacket = NULL;
+      emptyEngineEntry(pEngine, j);
+    }
+  }
+
+  pEntry->ThePacket = pPacket;
+  pEntry->HitCount = 0;
+  pEntry->RedundantBytes = 0;
+  pEntry->Fingerprint = Hash;
+  pEntry->PayloadSize = pPacket->PayloadSize;
+  pEngine->Stats.EntriesUsed++;
+}
+
+int processEngineBatch(struct RedEngine *pEngine, struct Packet **ppPackets,
+                       int Count) {
+
+  struct Packet *pKeep[ENGINE_BATCH];
+  struct Packet *pDrop[ENGINE_BATCH];
+  uint64_t nHash[ENGINE_BATCH];
+  struct PacketHeaders headers;
+  int nHits = 0;
+
+  for (int nStart = 0; nStart < Count; nStart += ENGINE_BATCH) {
+    int nEnd = nStart + ENGINE_BATCH < Count ? nStart + ENGINE_BATCH : Count;
+    int nKeep = 0;
+    int nDrop = 0;
+    uint64_t nSeenBytes = 0;
+
+    /* Parse and fingerprint without the lock */
+    for (int j = nStart; j < nEnd; j++) {
+      struct Packet *pPacket = ppPackets[j];
+
+      nSeenBytes += pPacket->LengthIncluded;
+
+      if (pPacket->LengthIncluded <= MIN_PKT_SIZE ||
+          parsePacketHeaders(pPacket, &headers) != PARSE_OK ||
+          pPacket->PayloadSize == 0) {
+        pDrop[nDrop++] = pPacket;
+        continue;
+      }
+
+      nHash[nKeep] = spooky_hash64(pPacket->Data + pPacket->PayloadOffset,
+                                   pPacket->PayloadSize, FINGERPRINT_SEED);
+      pKeep[nKeep++] = pPacket;
+    }
+
+    pthread_mutex_lock(&pEngine->Lock);
+
+    pEngine->Stats.PacketsSeen += nEnd - nStart;
+    pEngine->Stats.BytesSeen += nSeenBytes;
+
+    for (int j = 0; j < nKeep; j++) {
+      struct RedLookup lookup;
+
+      lookupEngine(pEngine, pKeep[j], nHash[j], &lookup);
+
+      if (lookup.Drop != NULL) {
+        pDrop[nDrop++] = lookup.Drop;
+      }
+
+      nHits += lookup.Hit;
+    }
+
+    pthread_mutex_unlock(&pEngine->Lock);
+
+    /* Free outside the lock */
+    for (int j = 0; j < nDrop; j++) {
+      discardPacket(pDrop[j]);
+    }
+  }
+
+  return nHits;
+}
+
+void snapshotEngineStats(struct RedEngine *pEngine, struct RedStats *pStats) {
+
+  pthread_mutex_lock(&pEngine->Lock);
+  *pStats = pEngine->Stats;
+  pthread_mutex_unlock(&pEngine->Lock);
+}
+
+void destroyEngine(struct RedEngine *pEngine) {
+
+  if (pEngine == NULL) {
+    return;
+  }
+
+  for (int j = 0; j < pEngine->TableSize; j++) {
+    if (pEngine->Table[j].ThePacket != NULL) {
+      discardPacket(pEngine->Table[j].ThePacket);
+      pEngine->Table[j].ThePacket = NULL;
+    }
+  }
+
+  pthread_mutex_destroy(&pEngine->Lock);
+
+  if (pEngine->OwnsTable) {
+    free(pEngine->Table);
+  }
+
+  free(pEngine);
+}
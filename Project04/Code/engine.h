@@ -0,0 +1,182 @@
+/* engine.h : Reentrant redundancy engine (libredextract)
+ *
+ *  Each engine owns its table, counters and lock, so any number of engines
+ *  can run side by side in one process, e.g. one per link.  Several threads
+ *  may feed the same engine.  Only packet.h, spooky.h and this file are
+ *  needed to embed it.
+ *
+ *  redextract drives its own engine through lookupEngine, with hooks that
+ *  find payloads it keeps outside the packets and fold the counters of the
+ *  entries it evicts.
+ */
+
+#ifndef __ENGINE_H
+#define __ENGINE_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/* Packets this small are not worth comparing */
+#define MIN_PKT_SIZE        128
+
+/* Seed for the payload fingerprint (spooky hash) */
+#define FINGERPRINT_SEED    0
+
+/* An entry of an engine's table
+ *
+ *  An entry is in use when PayloadSize is non-zero.  The payload bytes live
+ *  in ThePacket, or for redextract in Compressed (seen during this run with
+ *  -compress-history) or, when both are NULL, in the arena of a warm-started
+ *  snapshot at ArenaOffset.  The engine itself leaves the fields after
+ *  PayloadSize alone.
+ */
+struct PacketEntry
+{
+    struct Packet * ThePacket;
+
+    /* How many times has this been a hit? */
+    uint32_t        HitCount;
+
+    /* How much data would we have saved? */
+    uint32_t        RedundantBytes;
+
+    /* Fingerprint of the payload */
+    uint64_t        Fingerprint;
+
+    /* Size of the retained payload, zero if the entry is empty */
+    uint32_t        PayloadSize;
+
+    /* File the payload was retained from (see overlap.h) */
+    uint16_t        OriginFile;
+
+    /* Location of the payload in the snapshot arena if ThePacket is NULL */
+    uint64_t        ArenaOffset;
+
+    /* The payload as an LZ4 block instead of ThePacket (see history.h);
+     * stored as is if CompressedSize equals PayloadSize */
+    uint8_t *       Compressed;
+    uint32_t        CompressedSize;
+};
+
+/* An engine is only ever handled through a pointer */
+struct RedEngine;
+
+/* Counters of an engine as of the snapshot */
+struct RedStats
+{
+    /* Every packet handed to the engine */
+    uint64_t    PacketsSeen;
+    uint64_t    BytesSeen;
+
+    /* TCP and UDP payloads looked up in the table */
+    uint64_t    Payloads;
+    uint64_t    PayloadBytes;
+
+    /* Payloads that matched one already in the table */
+    uint64_t    Hits;
+    uint64_t    HitBytes;
+
+    /* Entries holding a payload */
+    uint32_t    EntriesUsed;
+    uint32_t    TableSize;
+};
+
+/** Create an engine with an empty table
+ * @param TableSize  Number of entries in the table
+ * @returns The engine, or NULL if out of memory or TableSize is not positive
+ */
+struct RedEngine * createEngine (int TableSize);
+
+/** Create an engine over a table the caller allocated and keeps, e.g. one
+ * mapped from a file.  destroyEngine leaves the table itself alone.
+ * @param pTable     The table, with every entry empty or holding a payload
+ * @param TableSize  Number of entries in the table
+ * @returns The engine, or NULL if out of memory or TableSize is not positive
+ */
+struct RedEngine * createEngineOn (struct PacketEntry * pTable, int TableSize);
+
+/* Callbacks for an embedder that keeps more state per entry.  Each gets the
+ * engine and UserData, so engines with hooks need not share any state. */
+struct RedHooks
+{
+    /* Returns the payload bytes of an entry whose packet is gone (NULL if
+     * entries always keep their packet) */
+    uint8_t *   (*EntryPayload) (struct RedEngine * pEngine, struct PacketEntry * pEntry,
+                                 void * UserData);
+
+    /* Empties an entry a new payload is about to take, calling
+     * emptyEngineEntry (NULL just to discard it) */
+    void        (*EvictEntry) (struct RedEngine * pEngine, int nEntry, void * UserData);
+
+    /* A timestamp to time the byte compare of lookupEngine with (NULL not
+     * to) */
+    uint64_t    (*Clock) ();
+
+    void *      UserData;
+};
+
+/* What lookupEngine found */
+struct RedLookup
+{
+    /* The entry that was hit or that now holds the packet */
+    int             Entry;
+    char            Hit;
+
+    /* The packet to discard once the lock is dropped: the one looked up on
+     * a hit, an evicted one with no evict hook, NULL otherwise */
+    struct Packet * Drop;
+
+    /* Clock readings around the byte compare, zero if there was none */
+    uint64_t        CompareStart;
+    uint64_t        CompareEnd;
+};
+
+/** Hook the engine up to an embedder that keeps more state per entry
+ * @param pEngine  The engine
+ * @param pHooks   The callbacks (copied)
+ */
+void setEngineHooks (struct RedEngine * pEngine, const struct RedHooks * pHooks);
+
+/** Look up one parsed payload.  The engine's own lock is not taken: the
+ * caller must hold its own lock around every lookupEngine and
+ * emptyEngineEntry call on an engine, and must not feed the same engine
+ * through processEngineBatch.  A hit is counted against the entry, a miss
+ * evicts the entry and retains the packet in it.
+ * @param pEngine  The engine
+ * @param pPacket  A packet with PayloadOffset and PayloadSize set
+ * @param Hash     The fingerprint of the payload (FINGERPRINT_SEED)
+ * @param pLookup  Filled in with what was found
+ */
+void lookupEngine (struct RedEngine * pEngine, struct Packet * pPacket, uint64_t Hash,
+                   struct RedLookup * pLookup);
+
+/** Empty an entry, discarding its packet (with the caller's lock held, as
+ * for lookupEngine)
+ * @param pEngine  The engine
+ * @param nEntry   The entry
+ */
+void emptyEngineEntry (struct RedEngine * pEngine, int nEntry);
+
+/** Look up a batch of packets.  The engine takes ownership of the packets
+ * (they are kept in the table or discarded).  The table lock is taken once
+ * for every ENGINE_BATCH packets; parsing and hashing happen outside it.
+ * @param pEngine    The engine
+ * @param ppPackets  The packets as read, starting at the Ethernet header
+ * @param Count      How many packets
+ * @returns How many of them were duplicates
+ */
+int processEngineBatch (struct RedEngine * pEngine, struct Packet ** ppPackets, int Count);
+
+/** Copy out the counters without disturbing the table
+ * @param pEngine  The engine
+ * @param pStats   Filled in with the counters
+ */
+void snapshotEngineStats (struct RedEngine * pEngine, struct RedStats * pStats);
+
+/** Free the engine and every packet its table still holds
+ * @param pEngine  The engine (may be NULL)
+ */
+void destroyEngine (struct RedEngine * pEngine);
+
+#endif
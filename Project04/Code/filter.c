@@ -0,0 +1,493 @@
+/* filter.c : Packet filter expressions compiled to a flat program (-filter)
+ *
+ * The expression is parsed once into a small tree and compiled, in the
+ * manner of BPF, into an array of tests that each jump to the next test or
+ * to accept or reject.  "and", "or" and "not" turn into jump targets rather
+ * than instructions, so a packet runs only the tests that decide it.  The
+ * reader runs the program on the parsed header fields, and packets that are
+ * rejected are dropped before they are queued.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "pcap-process.h"
+
+/* Kinds of tree nodes */
+#define NODE_TEST           0
+#define NODE_AND            1
+#define NODE_OR             2
+#define NODE_NOT            3
+
+#define FILTER_MAX_NODES    256
+#define FILTER_MAX_TOKEN    64
+
+struct FilterNode
+{
+    int                 Kind;
+    struct FilterInsn   Test;
+    int                 Left;
+    int                 Right;
+};
+
+char gFilterOn = 0;
+
+static struct FilterInsn FilterProgram[FILTER_MAX_INSNS];
+static int FilterLength = 0;
+static int FilterEntry = 0;
+static const char *FilterText;
+
+/* Reader side counts (one reader at a time, so no lock) */
+static uint64_t FilterPassed = 0;
+static uint64_t FilterDropped = 0;
+
+/* State of the parser */
+static struct FilterNode Nodes[FILTER_MAX_NODES];
+static int NodeCount;
+static const char *ParseAt;
+static char Token[FILTER_MAX_TOKEN];
+static char ParseFailed;
+
+static void parseError(const char *Message) {
+
+  if (!ParseFailed) {
+    printf("* Error: Bad filter (%s) at \"%s\"\n", Message,
+           Token[0] ? Token : "end");
+  }
+
+  ParseFailed = 1;
+}
+
+/* Move Token on to the next word, number, address or operator */
+static void nextToken() {
+
+  int n = 0;
+
+  while (isspace((unsigned char)*ParseAt)) {
+    ParseAt++;
+  }
+
+  if (*ParseAt == '\0') {
+    Token[0] = '\0';
+    return;
+  }
+
+  if (isalnum((unsigned char)*ParseAt)) {
+    while ((isalnum((unsigned char)*ParseAt) || *ParseAt == '.' ||
+            *ParseAt == '/') &&
+           n < FILTER_MAX_TOKEN - 1) {
+      Token[n++] = *ParseAt++;
+    }
+  } else if (strchr("<>=!&|", *ParseAt) != NULL) {
+    Token[n++] = *ParseAt++;
+
+    if (strchr("=&|", *ParseAt) != NULL) {
+      Token[n++] = *ParseAt++;
+    }
+  } else {
+    Token[n++] = *ParseAt++;
+  }
+
+  Token[n] = '\0';
+}
+
+static char tokenIs(const char *pWord) {
+
+  return strcmp(Token, pWord) == 0;
+}
+
+static int newNode(int Kind, int Left, int Right) {
+
+  if (NodeCount >= FILTER_MAX_NODES) {
+    parseError("too long");
+    return 0;
+  }
+
+  memset(&Nodes[NodeCount], 0, sizeof(struct FilterNode));
+  Nodes[NodeCount].Kind = Kind;
+  Nodes[NodeCount].Left = Left;
+  Nodes[NodeCount].Right = Right;
+  return NodeCount++;
+}
+
+static int newTest(int Field, int Op, uint32_t Mask, uint32_t Value) {
+
+  int nNode = newNode(NODE_TEST, 0, 0);
+
+  Nodes[nNode].Test.Field = Field;
+  Nodes[nNode].Test.Op = Op;
+  Nodes[nNode].Test.Mask = Mask;
+  Nodes[nNode].Test.Value = Value;
+  return nNode;
+}
+
+static uint32_t parseNumber(uint32_t Max) {
+
+  char *pEnd;
+  unsigned long nValue = strtoul(Token, &pEnd, 10);
+
+  if (Token[0] == '\0' || *pEnd != '\0' || nValue > Max) {
+    parseError("expected a number");
+    return 0;
+  }
+
+  nextToken();
+  return (uint32_t)nValue;
+}
+
+/* Parse A.B.C.D, or A.B.C.D/BITS if pBits is not NULL */
+static uint32_t parseAddress(int *pBits) {
+
+  unsigned int a, b, c, d, nBits = 32;
+  char cExtra;
+  int nFields;
+
+  if (pBits != NULL && strchr(Token, '/') != NULL) {
+    nFields = sscanf(Token, "%u.%u.%u.%u/%u%c", &a, &b, &c, &d, &nBits,
+                     &cExtra) == 5 ? 4 : 0;
+  } else {
+    nFields = sscanf(Token, "%u.%u.%u.%u%c", &a, &b, &c, &d, &cExtra);
+  }
+
+  if (nFields != 4 || a > 255 || b > 255 || c > 255 || d > 255 ||
+      nBits > 32) {
+    parseError("expected an IPv4 address");
+    return 0;
+  }
+
+  if (pBits != NULL) {
+    *pBits = nBits;
+  }
+
+  nextToken();
+  return a << 24 | b << 16 | c << 8 | d;
+}
+
+/* Either direction unless src or dst was given */
+static int directed(int Direction, int SrcField, int DstField, uint32_t Mask,
+                    uint32_t Value) {
+
+  if (Direction == 1) {
+    return newTest(SrcField, FILTER_EQ, Mask, Value);
+  }
+
+  if (Direction == 2) {
+    return newTest(DstField, FILTER_EQ, Mask, Value);
+  }
+
+  return newNode(NODE_OR, newTest(SrcField, FILTER_EQ, Mask, Value),
+                 newTest(DstField, FILTER_EQ, Mask, Value));
+}
+
+static int parseExpression();
+
+static int parsePrimitive() {
+
+  int nDirection = 0;
+
+  if (tokenIs("tcp") || tokenIs("udp")) {
+    int nProto = tokenIs("tcp") ? 6 : 17;
+
+    nextToken();
+    return newTest(FILTER_PROTO, FILTER_EQ, 0xffffffff, nProto);
+  }
+
+  if (tokenIs("proto")) {
+    nextToken();
+    return newTest(FILTER_PROTO, FILTER_EQ, 0xffffffff, parseNumber(255));
+  }
+
+  if (tokenIs("len") || tokenIs("payload")) {
+    int nField = tokenIs("len") ? FILTER_LENGTH : FILTER_PAYLOAD;
+    int nOp;
+
+    nextToken();
+
+    if (tokenIs("=") || tokenIs("==")) {
+      nOp = FILTER_EQ;
+    } else if (tokenIs("!=")) {
+      nOp = FILTER_NE;
+    } else if (tokenIs("<")) {
+      nOp = FILTER_LT;
+    } else if (tokenIs("<=")) {
+      nOp = FILTER_LE;
+    } else if (tokenIs(">")) {
+      nOp = FILTER_GT;
+    } else if (tokenIs(">=")) {
+      nOp = FILTER_GE;
+    } else {
+      parseError("expected a comparison");
+      return 0;
+    }
+
+    nextToken();
+    return newTest(nField, nOp, 0xffffffff, parseNumber(0xffffffff));
+  }
+
+  if (tokenIs("src") || tokenIs("dst")) {
+    nDirection = tokenIs("src") ? 1 : 2;
+    nextToken();
+  }
+
+  if (tokenIs("port")) {
+    nextToken();
+    return directed(nDirection, FILTER_SRC_PORT, FILTER_DST_PORT, 0xffffffff,
+                    parseNumber(65535));
+  }
+
+  if (tokenIs("host")) {
+    nextToken();
+    return directed(nDirection, FILTER_SRC_HOST, FILTER_DST_HOST, 0xffffffff,
+                    parseAddress(NULL));
+  }
+
+  if (tokenIs("net")) {
+    int nBits;
+    uint32_t nAddress;
+    uint32_t nMask;
+
+    nextToken();
+    nAddress = parseAddress(&nBits);
+    nMask = nBits == 0 ? 0 : 0xffffffff << (32 - nBits);
+    return directed(nDirection, FILTER_SRC_HOST, FILTER_DST_HOST, nMask,
+                    nAddress & nMask);
+  }
+
+  parseError(nDirection ? "expected port, host or net" : "unknown term");
+  return 0;
+}
+
+static int parseFactor() {
+
+  if (tokenIs("not") || tokenIs("!")) {
+    nextToken();
+    return newNode(NODE_NOT, parseFactor(), 0);
+  }
+
+  if (tokenIs("(")) {
+    int nNode;
+
+    nextToken();
+    nNode = parseExpression();
+
+    if (!tokenIs(")")) {
+      parseError("expected )");
+    }
+
+    nextToken();
+    return nNode;
+  }
+
+  return parsePrimitive();
+}
+
+static int parseTerm() {
+
+  int nNode = parseFactor();
+
+  while (!ParseFailed && (tokenIs("and") || tokenIs("&&"))) {
+    nextToken();
+    nNode = newNode(NODE_AND, nNode, parseFactor());
+  }
+
+  return nNode;
+}
+
+static int parseExpression() {
+
+  int nNode = parseTerm();
+
+  while (!ParseFailed && (tokenIs("or") || tokenIs("||"))) {
+    nextToken();
+    nNode = newNode(NODE_OR, nNode, parseTerm());
+  }
+
+  return nNode;
+}
+
+/** Emit the code for a node given where true and false go.  The right side
+ * of "and" and "or" is emitted first so the left side can jump to it.
+ * @returns The instruction the node starts at
+ */
+static int emitNode(int Node, int True, int False) {
+
+  struct FilterNode *pNode = &Nodes[Node];
+
+  switch (pNode->Kind) {
+  case NODE_AND:
+    return emitNode(pNode->Left, emitNode(pNode->Right, True, False), False);
+
+  case NODE_OR:
+    return emitNode(pNode->Left, True, emitNode(pNode->Right, True, False));
+
+  case NODE_NOT:
+    return emitNode(pNode->Left, False, True);
+
+  default:
+    if (FilterLength >= FILTER_MAX_INSNS) {
+      parseError("too long");
+      return FILTER_REJECT;
+    }
+
+    FilterProgram[FilterLength] = pNode->Test;
+    FilterProgram[FilterLength].JumpTrue = True;
+    FilterProgram[FilterLength].JumpFalse = False;
+    return FilterLength++;
+  }
+}
+
+char compileFilter(const char *Expression) {
+
+  int nRoot;
+
+  FilterText = Expression;
+  ParseAt = Expression;
+  NodeCount = 0;
+  FilterLength = 0;
+  ParseFailed = 0;
+
+  nextToken();
+  nRoot = parseExpression();
+
+  if (!ParseFailed && Token[0] != '\0') {
+    parseError("unexpected text");
+  }
+
+  if (!ParseFailed) {
+    FilterEntry = emitNode(nRoot, FILTER_ACCEPT, FILTER_REJECT);
+  }
+
+  if (ParseFailed) {
+    return 0;
+  }
+
+  gFilterOn = 1;
+  return 1;
+}
+
+static uint32_t readAddress(uint8_t *pData) {
+
+  return (uint32_t)pData[0] << 24 | pData[1] << 16 | pData[2] << 8 | pData[3];
+}
+
+char filterPacket(struct Packet *pPacket) {
+
+  struct PacketHeaders headers;
+  int nAt = FilterEntry;
+
+  if (parsePacketHeaders(pPacket, &headers) != PARSE_OK) {
+    FilterDropped++;
+    return 0;
+  }
+
+  while (nAt >= 0) {
+    struct FilterInsn *pInsn = &FilterProgram[nAt];
+    uint32_t nField;
+    char bResult;
+
+    // An IPv6 packet has no IPv4 address to match a host or net against
+    if ((pInsn->Field == FILTER_SRC_HOST || pInsn->Field == FILTER_DST_HOST) &&
+        headers.IPVersion != 4) {
+      nAt = pInsn->JumpFalse;
+      continue;
+    }
+
+    switch (pInsn->Field) {
+    case FILTER_PROTO:
+      nField = pPacket->Protocol;
+      break;
+    case FILTER_SRC_PORT:
+      nField = pPacket->SrcPort;
+      break;
+    case FILTER_DST_PORT:
+      nField = pPacket->DstPort;
+      break;
+    case FILTER_SRC_HOST:
+      nField = readAddress(pPacket->Data + headers.IPOffset + 12);
+      break;
+    case FILTER_DST_HOST:
+      nField = readAddress(pPacket->Data + headers.IPOffset + 16);
+      break;
+    case FILTER_LENGTH:
+      nField = pPacket->LengthIncluded;
+      break;
+    default:
+      nField = pPacket->PayloadSize;
+      break;
+    }
+
+    nField &= pInsn->Mask;
+
+    switch (pInsn->Op) {
+    case FILTER_EQ:
+      bResult = nField == pInsn->Value;
+      break;
+    case FILTER_NE:
+      bResult = nField != pInsn->Value;
+      break;
+    case FILTER_LT:
+      bResult = nField < pInsn->Value;
+      break;
+    case FILTER_LE:
+      bResult = nField <= pInsn->Value;
+      break;
+    case FILTER_GT:
+      bResult = nField > pInsn->Value;
+      break;
+    default:
+      bResult = nField >= pInsn->Value;
+      break;
+    }
+
+    nAt = bResult ? pInsn->JumpTrue : pInsn->JumpFalse;
+  }
+
+  if (nAt == FILTER_ACCEPT) {
+    FilterPassed++;
+    return 1;
+  }
+
+  FilterDropped++;
+  return 0;
+}
+
+static const char *jumpName(int Target, char *pBuffer, int Size) {
+
+  if (Target == FILTER_ACCEPT) {
+    return "accept";
+  }
+
+  if (Target == FILTER_REJECT) {
+    return "reject";
+  }
+
+  snprintf(pBuffer, Size, "%d", Target);
+  return pBuffer;
+}
+
+void printFilterStats() {
+
+  static const char *FieldNames[] = {"proto",    "src port", "dst port",
+                                     "src host", "dst host", "len",
+                                     "payload"};
+  static const char *OpNames[] = {"==", "!=", "<", "<=", ">", ">="};
+
+  printf("Filter \"%s\" (%d tests, starting at %d)\n", FilterText,
+         FilterLength, FilterEntry);
+
+  for (int j = 0; j < FilterLength; j++) {
+    struct FilterInsn *pInsn = &FilterProgram[j];
+    char sTrue[16], sFalse[16];
+
+    printf("  %3d: %-8s & 0x%08x %-2s %-10u  true -> %-6s false -> %s\n", j,
+           FieldNames[pInsn->Field], pInsn->Mask, OpNames[pInsn->Op],
+           pInsn->Value, jumpName(pInsn->JumpTrue, sTrue, sizeof(sTrue)),
+           jumpName(pInsn->JumpFalse, sFalse, sizeof(sFalse)));
+  }
+
+  printf("  Packets Passed:          %lu\n", (unsigned long)FilterPassed);
+  printf("  Packets Dropped:         %lu\n", (unsigned long)FilterDropped);
+}
@@ -0,0 +1,77 @@
+/* filter.h : Packet filter expressions compiled to a flat program (-filter) */
+
+#ifndef __FILTER_H
+#define __FILTER_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/* Most instructions a compiled filter may have */
+#define FILTER_MAX_INSNS    256
+
+/* Fields an instruction can test */
+#define FILTER_PROTO        0
+#define FILTER_SRC_PORT     1
+#define FILTER_DST_PORT     2
+#define FILTER_SRC_HOST     3
+#define FILTER_DST_HOST     4
+#define FILTER_LENGTH       5
+#define FILTER_PAYLOAD      6
+
+/* Comparisons ((field & Mask) against Value) */
+#define FILTER_EQ           0
+#define FILTER_NE           1
+#define FILTER_LT           2
+#define FILTER_LE           3
+#define FILTER_GT           4
+#define FILTER_GE           5
+
+/* Jump targets that end the program */
+#define FILTER_ACCEPT       -1
+#define FILTER_REJECT       -2
+
+/* One test with where to go on true and on false */
+struct FilterInsn
+{
+    uint8_t     Field;
+    uint8_t     Op;
+    uint32_t    Mask;
+    uint32_t    Value;
+    int16_t     JumpTrue;
+    int16_t     JumpFalse;
+};
+
+/* Non-zero if a filter is in place */
+extern char gFilterOn;
+
+/** Compile an expression such as "udp and (port 53 or port 5353)" or
+ * "tcp and dst net 10.0.0.0/8 and payload > 200".  The grammar is
+ *
+ *   expr      := term { ("or" | "||") term }
+ *   term      := factor { ("and" | "&&") factor }
+ *   factor    := ("not" | "!") factor | "(" expr ")" | primitive
+ *   primitive := "tcp" | "udp" | "proto" N
+ *              | ["src" | "dst"] "port" N
+ *              | ["src" | "dst"] "host" A.B.C.D
+ *              | ["src" | "dst"] "net" A.B.C.D/BITS
+ *              | ("len" | "payload") OP N     with OP one of = != < <= > >=
+ *
+ * where a port, host or net without src or dst matches either.  Hosts and
+ * nets are IPv4, so they never match an IPv6 packet.
+ * @param Expression  The filter text
+ * @returns 1 if it compiled, 0 (after printing why) otherwise
+ */
+char compileFilter (const char * Expression);
+
+/** Run the filter on a packet as the reader gets it (only packets that are
+ * Ethernet / IPv4 / TCP or UDP can match)
+ * @param pPacket  The packet just read
+ * @returns 1 if the packet passes, 0 if it is to be dropped
+ */
+char filterPacket (struct Packet * pPacket);
+
+/* Print the program and how many packets it let through */
+void printFilterStats ();
+
+#endif
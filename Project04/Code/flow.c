@@ -0,0 +1,620 @@
+/* flow.c : TCP flow reassembly and content-defined chunking
+ *
+ * Per-packet dedup cannot see identical content that was cut at different
+ * TCP segment boundaries.  This stage keys flows by their 5-tuple, puts the
+ * segments back in sequence order and runs the contiguous byte stream through
+ * a FastCDC style chunker.  The chunks, rather than the packets, are what get
+ * looked up in BigTable.
+ *
+ * Memory is bounded by a fixed pool of flows (least recently used flow is
+ * evicted when full), by the chunker buffer of CDC_MAX_SIZE per flow and by
+ * FLOW_MAX_OOO_BYTES of out of order data per flow.  Flows idle for more than
+ * FLOW_IDLE_SECONDS of capture time are flushed and released.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flow.h"
+#include "hugepage.h"
+#include "pcap-process.h"
+#include "progress.h"
+
+/* TCP flags that we care about */
+#define TCP_FLAG_FIN    0x01
+#define TCP_FLAG_SYN    0x02
+#define TCP_FLAG_RST    0x04
+
+/* Normalized chunking: harder to cut before the average, easier after */
+#define CDC_MASK_SMALL  (((1ULL << (CDC_AVG_BITS + 2)) - 1) << (62 - CDC_AVG_BITS))
+#define CDC_MASK_LARGE  (((1ULL << (CDC_AVG_BITS - 2)) - 1) << (66 - CDC_AVG_BITS))
+#define CDC_AVG_SIZE    (1 << CDC_AVG_BITS)
+
+/* Prefix of an IPv4 address mapped into IPv6 */
+#define IPV4_MAPPED     "\0\0\0\0\0\0\0\0\0\0\xff\xff"
+
+/* Out of order segment waiting for the gap in front of it to fill */
+struct FlowSegment
+{
+    uint32_t                Seq;
+    uint32_t                Length;
+    struct FlowSegment *    Next;
+    uint8_t                 Data[];
+};
+
+struct Flow
+{
+    /* The 5-tuple (the protocol is always TCP), IPv4 addresses mapped into
+     * IPv6 (::ffff:a.b.c.d) so one key fits both */
+    uint8_t         SrcAddr[16];
+    uint8_t         DstAddr[16];
+    uint16_t        SrcPort;
+    uint16_t        DstPort;
+
+    /* Next in-order sequence number we expect */
+    uint32_t        NextSeq;
+
+    /* The last gap given up on, from GapStart up to GapEnd (equal if none);
+     * bytes arriving for it later were never seen, so are no retransmit */
+    uint32_t        GapStart;
+    uint32_t        GapEnd;
+
+    /* Capture time of the last segment */
+    struct timeval  LastSeen;
+
+    /* Stream bytes not yet cut into a chunk and the chunker position */
+    uint8_t *       Stream;
+    uint32_t        StreamLen;
+    uint32_t        ScanPos;
+    uint64_t        Gear;
+
+    /* Sorted list of segments ahead of NextSeq */
+    struct FlowSegment * OutOfOrder;
+    uint32_t        OutOfOrderBytes;
+
+    /* Hash chain, and least recently used list (Older is towards eviction) */
+    struct Flow *   HashNext;
+    struct Flow *   Newer;
+    struct Flow *   Older;
+};
+
+char gFlowReassembly = 0;
+struct FlowStats gFlowStats;
+
+static struct Flow *FlowPool;
+static struct Flow *FlowFree;
+static struct Flow *FlowBuckets[FLOW_HASH_BUCKETS];
+static struct Flow *FlowNewest;
+static struct Flow *FlowOldest;
+static uint32_t FlowsActive;
+
+/* Random values per byte for the gear rolling hash (fixed seed so that chunk
+ * boundaries are the same run to run and across snapshots) */
+static uint64_t GearTable[256];
+
+static uint64_t splitmix64(uint64_t *pState) {
+  uint64_t z = (*pState += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+char initializeFlows() {
+
+  uint64_t seed = 0x5eed;
+
+  for (int j = 0; j < 256; j++) {
+    GearTable[j] = splitmix64(&seed);
+  }
+
+  FlowPool = (struct Flow *)allocateLarge(sizeof(struct Flow) * FLOW_MAX_FLOWS);
+
+  if (FlowPool == NULL) {
+    printf("* Error: Unable to create the flow table\n");
+    return 0;
+  }
+
+  // Thread all of the flows onto the free list
+  FlowFree = NULL;
+
+  for (int j = FLOW_MAX_FLOWS - 1; j >= 0; j--) {
+    FlowPool[j].HashNext = FlowFree;
+    FlowFree = &FlowPool[j];
+  }
+
+  memset(FlowBuckets, 0, sizeof(FlowBuckets));
+  memset(&gFlowStats, 0, sizeof(gFlowStats));
+  FlowNewest = NULL;
+  FlowOldest = NULL;
+  FlowsActive = 0;
+  return 1;
+}
+
+static uint32_t hashFlowKey(const uint8_t *SrcAddr, const uint8_t *DstAddr,
+                            uint16_t SrcPort, uint16_t DstPort) {
+  uint64_t key = ((uint64_t)SrcPort << 16 | DstPort) * 0x9e3779b97f4a7c15ULL;
+
+  for (int j = 0; j < 16; j += 8) {
+    uint64_t nSrc, nDst;
+
+    memcpy(&nSrc, SrcAddr + j, 8);
+    memcpy(&nDst, DstAddr + j, 8);
+    key = (key ^ nSrc) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 31) ^ nDst) * 0x94d049bb133111ebULL;
+  }
+
+  key ^= key >> 29;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 32;
+  return (uint32_t)(key % FLOW_HASH_BUCKETS);
+}
+
+/* Bytes the link carried again count as redundant just like a table hit */
+static void countRetransmit(uint32_t nBytes, char bWhole) {
+
+  gFlowStats.RetransmitBytes += nBytes;
+  gPacketHitBytes += nBytes;
+
+  if (gProgressOn) {
+    countProgressHit(nBytes);
+  }
+
+  if (bWhole) {
+    gPacketHitCount++;
+  }
+}
+
+/* Count bytes behind NextSeq, except those of the last skipped gap */
+static void countOldBytes(struct Flow *pFlow, uint32_t nSeq, uint32_t nBytes,
+                          char bWhole) {
+
+  uint32_t nStart = (int32_t)(nSeq - pFlow->GapStart) > 0 ? nSeq
+                                                         : pFlow->GapStart;
+  uint32_t nEnd = (int32_t)(nSeq + nBytes - pFlow->GapEnd) < 0
+                      ? nSeq + nBytes
+                      : pFlow->GapEnd;
+  uint32_t nLate = (int32_t)(nEnd - nStart) > 0 ? nEnd - nStart : 0;
+
+  gFlowStats.LateBytes += nLate;
+
+  if (nLate < nBytes) {
+    countRetransmit(nBytes - nLate, bWhole && nLate == 0);
+  }
+}
+
+/* Hand a finished chunk to the redundancy table */
+static void emitChunk(struct Flow *pFlow, uint32_t nLength) {
+
+  struct Packet *pChunk;
+
+  pChunk = allocatePacket(nLength);
+
+  if (pChunk == NULL) {
+    return;
+  }
+
+  memcpy(pChunk->Data, pFlow->Stream, nLength);
+  pChunk->LengthIncluded = nLength;
+  pChunk->LengthOriginal = nLength;
+  pChunk->TimeCapture = pFlow->LastSeen;
+  pChunk->PayloadOffset = 0;
+  pChunk->PayloadSize = nLength;
+  pChunk->Protocol = 6;
+  pChunk->SrcPort = pFlow->SrcPort;
+  pChunk->DstPort = pFlow->DstPort;
+
+  gFlowStats.Chunks++;
+  gFlowStats.ChunkBytes += nLength;
+
+  processPayload(pChunk);
+
+  // Shift the rest of the stream down and restart the chunker
+  memmove(pFlow->Stream, pFlow->Stream + nLength, pFlow->StreamLen - nLength);
+  pFlow->StreamLen -= nLength;
+  pFlow->ScanPos = 0;
+  pFlow->Gear = 0;
+}
+
+/* Look for the next FastCDC cut point, returns 0 if more bytes are needed */
+static uint32_t findChunkCut(struct Flow *pFlow) {
+
+  uint32_t i;
+  uint64_t fp = pFlow->Gear;
+
+  // Bytes under the minimum are never hashed
+  i = pFlow->ScanPos < CDC_MIN_SIZE ? CDC_MIN_SIZE : pFlow->ScanPos;
+
+  for (; i < pFlow->StreamLen; i++) {
+    fp = (fp << 1) + GearTable[pFlow->Stream[i]];
+
+    if (!(fp & (i < CDC_AVG_SIZE ? CDC_MASK_SMALL : CDC_MASK_LARGE))) {
+      return i + 1;
+    }
+
+    if (i + 1 >= CDC_MAX_SIZE) {
+      return CDC_MAX_SIZE;
+    }
+  }
+
+  pFlow->ScanPos = i;
+  pFlow->Gear = fp;
+  return 0;
+}
+
+/* Append in-order bytes to the stream, emitting chunks as they are cut */
+static void appendStream(struct Flow *pFlow, const uint8_t *pData,
+                         uint32_t nLength) {
+
+  uint32_t nCopy;
+  uint32_t nCut;
+
+  if (pFlow->Stream == NULL) {
+    pFlow->Stream = (uint8_t *)malloc(CDC_MAX_SIZE);
+
+    if (pFlow->Stream == NULL) {
+      printf("* Error: malloc failed for a flow stream buffer\n");
+      return;
+    }
+  }
+
+  while (nLength > 0) {
+    nCopy = CDC_MAX_SIZE - pFlow->StreamLen;
+
+    if (nCopy > nLength) {
+      nCopy = nLength;
+    }
+
+    memcpy(pFlow->Stream + pFlow->StreamLen, pData, nCopy);
+    pFlow->StreamLen += nCopy;
+    pData += nCopy;
+    nLength -= nCopy;
+
+    while ((nCut = findChunkCut(pFlow)) != 0) {
+      emitChunk(pFlow, nCut);
+    }
+  }
+}
+
+/* Whatever is left in the stream becomes a chunk of its own */
+static void flushStream(struct Flow *pFlow) {
+
+  if (pFlow->StreamLen > 0) {
+    emitChunk(pFlow, pFlow->StreamLen);
+  }
+}
+
+/* Move any buffered segments that are now in order into the stream */
+static void drainSegments(struct Flow *pFlow) {
+
+  struct FlowSegment *pSeg;
+  uint32_t nSkip;
+
+  while ((pSeg = pFlow->OutOfOrder) != NULL &&
+         (int32_t)(pSeg->Seq - pFlow->NextSeq) <= 0) {
+
+    pFlow->OutOfOrder = pSeg->Next;
+    pFlow->OutOfOrderBytes -= pSeg->Length;
+
+    // Trim any part we already have
+    nSkip = pFlow->NextSeq - pSeg->Seq;
+
+    if (nSkip < pSeg->Length) {
+      appendStream(pFlow, pSeg->Data + nSkip, pSeg->Length - nSkip);
+      pFlow->NextSeq += pSeg->Length - nSkip;
+    } else {
+      countRetransmit(pSeg->Length, 1);
+    }
+
+    free(pSeg);
+  }
+}
+
+/* Resume the stream at nSeq, leaving out the bytes in between */
+static void skipTo(struct Flow *pFlow, uint32_t nSeq) {
+
+  // The content before a gap cannot continue into the content after it
+  flushStream(pFlow);
+  pFlow->GapStart = pFlow->NextSeq;
+  pFlow->GapEnd = nSeq;
+  pFlow->NextSeq = nSeq;
+}
+
+/* Give up waiting on a gap and resume at the first buffered segment */
+static void skipGap(struct Flow *pFlow) {
+
+  if (pFlow->OutOfOrder == NULL) {
+    return;
+  }
+
+  gFlowStats.GapsSkipped++;
+  skipTo(pFlow, pFlow->OutOfOrder->Seq);
+  drainSegments(pFlow);
+}
+
+static void addSegment(struct Flow *pFlow, uint32_t nSeq, const uint8_t *pData,
+                       uint32_t nLength) {
+
+  struct FlowSegment *pSeg;
+  struct FlowSegment **ppWalk;
+  int32_t nAhead;
+
+  nAhead = (int32_t)(nSeq - pFlow->NextSeq);
+
+  /* Old data (retransmission) - keep only the part past NextSeq */
+  if (nAhead < 0) {
+
+    if ((uint32_t)-nAhead >= nLength) {
+      countOldBytes(pFlow, nSeq, nLength, 1);
+      return;
+    }
+
+    countOldBytes(pFlow, nSeq, -nAhead, 0);
+    pData += -nAhead;
+    nLength -= -nAhead;
+    nAhead = 0;
+  }
+
+  /* In order - straight into the stream */
+  if (nAhead == 0) {
+    appendStream(pFlow, pData, nLength);
+    pFlow->NextSeq += nLength;
+    drainSegments(pFlow);
+    return;
+  }
+
+  /* Ahead of a gap - hold on to it, within the per-flow budget */
+  gFlowStats.SegmentsOutOfOrder++;
+
+  if (pFlow->OutOfOrderBytes + nLength > FLOW_MAX_OOO_BYTES) {
+
+    /* Give up on the gap.  A segment in front of everything buffered is
+     * where the stream resumes (the bytes skipped were never seen, so they
+     * are not a retransmission), otherwise it is the first buffered one. */
+    if (pFlow->OutOfOrder == NULL ||
+        (int32_t)(nSeq - pFlow->OutOfOrder->Seq) < 0) {
+      gFlowStats.GapsSkipped++;
+      skipTo(pFlow, nSeq);
+    } else {
+      skipGap(pFlow);
+    }
+
+    addSegment(pFlow, nSeq, pData, nLength);
+    return;
+  }
+
+  ppWalk = &pFlow->OutOfOrder;
+
+  while (*ppWalk != NULL && (int32_t)((*ppWalk)->Seq - nSeq) < 0) {
+    ppWalk = &(*ppWalk)->Next;
+  }
+
+  if (*ppWalk != NULL && (*ppWalk)->Seq == nSeq) {
+    countRetransmit(nLength, 1);
+    return;
+  }
+
+  pSeg = (struct FlowSegment *)malloc(sizeof(struct FlowSegment) + nLength);
+
+  if (pSeg == NULL) {
+    printf("* Error: malloc failed for an out of order segment\n");
+    return;
+  }
+
+  pSeg->Seq = nSeq;
+  pSeg->Length = nLength;
+  memcpy(pSeg->Data, pData, nLength);
+  pSeg->Next = *ppWalk;
+  *ppWalk = pSeg;
+  pFlow->OutOfOrderBytes += nLength;
+}
+
+static void unlinkLRU(struct Flow *pFlow) {
+
+  if (pFlow->Newer != NULL) {
+    pFlow->Newer->Older = pFlow->Older;
+  } else {
+    FlowNewest = pFlow->Older;
+  }
+
+  if (pFlow->Older != NULL) {
+    pFlow->Older->Newer = pFlow->Newer;
+  } else {
+    FlowOldest = pFlow->Newer;
+  }
+
+  pFlow->Newer = NULL;
+  pFlow->Older = NULL;
+}
+
+static void pushLRU(struct Flow *pFlow) {
+
+  pFlow->Older = FlowNewest;
+  pFlow->Newer = NULL;
+
+  if (FlowNewest != NULL) {
+    FlowNewest->Newer = pFlow;
+  } else {
+    FlowOldest = pFlow;
+  }
+
+  FlowNewest = pFlow;
+}
+
+/* Flush what the flow still holds and return it to the free list */
+static void releaseFlow(struct Flow *pFlow) {
+
+  struct Flow **ppWalk;
+
+  while (pFlow->OutOfOrder != NULL) {
+    skipGap(pFlow);
+  }
+
+  flushStream(pFlow);
+  free(pFlow->Stream);
+
+  ppWalk = &FlowBuckets[hashFlowKey(pFlow->SrcAddr, pFlow->DstAddr,
+                                    pFlow->SrcPort, pFlow->DstPort)];
+
+  while (*ppWalk != pFlow) {
+    ppWalk = &(*ppWalk)->HashNext;
+  }
+
+  *ppWalk = pFlow->HashNext;
+  unlinkLRU(pFlow);
+
+  memset(pFlow, 0, sizeof(struct Flow));
+  pFlow->HashNext = FlowFree;
+  FlowFree = pFlow;
+  FlowsActive--;
+}
+
+void processFlowSegment(struct Packet *pPacket, uint32_t IPOffset,
+                        uint32_t TCPOffset) {
+
+  uint8_t *pIP = pPacket->Data + IPOffset;
+  uint8_t *pTCP = pPacket->Data + TCPOffset;
+  uint8_t pSrcAddr[16], pDstAddr[16];
+  uint32_t nSeq, nDataOffset, nIPLength, nSegLength;
+  uint16_t nSrcPort, nDstPort;
+  uint8_t nFlags;
+  struct Flow *pFlow;
+  uint32_t nBucket;
+
+  if (TCPOffset + 20 > pPacket->LengthIncluded) {
+    discardPacket(pPacket);
+    return;
+  }
+
+  // IPv6 gives the length past its fixed header, IPv4 the total length
+  if (pIP[0] >> 4 == 6) {
+    memcpy(pSrcAddr, pIP + 8, 16);
+    memcpy(pDstAddr, pIP + 24, 16);
+    nIPLength = 40 + (pIP[4] << 8 | pIP[5]);
+  } else {
+    memcpy(pSrcAddr, IPV4_MAPPED, 12);
+    memcpy(pDstAddr, IPV4_MAPPED, 12);
+    memcpy(pSrcAddr + 12, pIP + 12, 4);
+    memcpy(pDstAddr + 12, pIP + 16, 4);
+    nIPLength = pIP[2] << 8 | pIP[3];
+  }
+
+  nSrcPort = pTCP[0] << 8 | pTCP[1];
+  nDstPort = pTCP[2] << 8 | pTCP[3];
+  nSeq = (uint32_t)pTCP[4] << 24 | pTCP[5] << 16 | pTCP[6] << 8 | pTCP[7];
+  nDataOffset = TCPOffset + (pTCP[12] >> 4) * 4;
+  nFlags = pTCP[13];
+
+  // The IP total length excludes Ethernet padding on short frames
+  if (IPOffset + nIPLength > nDataOffset) {
+    nSegLength = IPOffset + nIPLength - nDataOffset;
+  } else {
+    nSegLength = 0;
+  }
+
+  gFlowStats.Segments++;
+
+  /* Expire idle flows (oldest first, so this stops at the first live one) */
+  while (FlowOldest != NULL && pPacket->TimeCapture.tv_sec -
+                                       FlowOldest->LastSeen.tv_sec >
+                                   FLOW_IDLE_SECONDS) {
+    gFlowStats.FlowsExpired++;
+    releaseFlow(FlowOldest);
+  }
+
+  nBucket = hashFlowKey(pSrcAddr, pDstAddr, nSrcPort, nDstPort);
+
+  for (pFlow = FlowBuckets[nBucket]; pFlow != NULL; pFlow = pFlow->HashNext) {
+    if (pFlow->SrcPort == nSrcPort && pFlow->DstPort == nDstPort &&
+        memcmp(pFlow->SrcAddr, pSrcAddr, 16) == 0 &&
+        memcmp(pFlow->DstAddr, pDstAddr, 16) == 0) {
+      break;
+    }
+  }
+
+  if (pFlow == NULL) {
+
+    // Pure ACKs and teardown of flows we never saw do not start a flow
+    if ((nSegLength == 0 && !(nFlags & TCP_FLAG_SYN)) ||
+        (nFlags & TCP_FLAG_RST)) {
+      discardPacket(pPacket);
+      return;
+    }
+
+    if (FlowFree == NULL) {
+      gFlowStats.FlowsEvicted++;
+      releaseFlow(FlowOldest);
+    }
+
+    pFlow = FlowFree;
+    FlowFree = pFlow->HashNext;
+
+    memcpy(pFlow->SrcAddr, pSrcAddr, 16);
+    memcpy(pFlow->DstAddr, pDstAddr, 16);
+    pFlow->SrcPort = nSrcPort;
+    pFlow->DstPort = nDstPort;
+    pFlow->HashNext = FlowBuckets[nBucket];
+    FlowBuckets[nBucket] = pFlow;
+
+    // A SYN consumes one sequence number, otherwise pick up mid-stream
+    pFlow->NextSeq = (nFlags & TCP_FLAG_SYN) ? nSeq + 1 : nSeq;
+    pFlow->GapStart = pFlow->NextSeq;
+    pFlow->GapEnd = pFlow->NextSeq;
+    FlowsActive++;
+    gFlowStats.FlowsCreated++;
+  } else {
+    unlinkLRU(pFlow);
+  }
+
+  pushLRU(pFlow);
+  pFlow->LastSeen = pPacket->TimeCapture;
+
+  if (nFlags & TCP_FLAG_SYN) {
+    nSeq++;
+  }
+
+  if (nSegLength > 0) {
+
+    if (nDataOffset + nSegLength > pPacket->LengthIncluded) {
+      /* Truncated by the capture - treat the missing bytes as a gap */
+      skipTo(pFlow, nSeq + nSegLength);
+      drainSegments(pFlow);
+    } else {
+      addSegment(pFlow, nSeq, pPacket->Data + nDataOffset, nSegLength);
+    }
+  }
+
+  if (nFlags & (TCP_FLAG_FIN | TCP_FLAG_RST)) {
+    releaseFlow(pFlow);
+  }
+
+  discardPacket(pPacket);
+}
+
+void flushFlows() {
+
+  while (FlowOldest != NULL) {
+    releaseFlow(FlowOldest);
+  }
+}
+
+void printFlowStats() {
+
+  printf("  Flows Tracked:           %lu (%lu expired, %lu evicted)\n",
+         (unsigned long)gFlowStats.FlowsCreated,
+         (unsigned long)gFlowStats.FlowsExpired,
+         (unsigned long)gFlowStats.FlowsEvicted);
+  printf("  Segments Reassembled:    %lu (%lu out of order, %lu gaps skipped)\n",
+         (unsigned long)gFlowStats.Segments,
+         (unsigned long)gFlowStats.SegmentsOutOfOrder,
+         (unsigned long)gFlowStats.GapsSkipped);
+  printf("  Retransmitted Bytes:     %lu (%lu more arrived after their gap "
+         "was skipped)\n",
+         (unsigned long)gFlowStats.RetransmitBytes,
+         (unsigned long)gFlowStats.LateBytes);
+  printf("  Chunks Emitted:          %lu (average %lu bytes)\n",
+         (unsigned long)gFlowStats.Chunks,
+         (unsigned long)(gFlowStats.Chunks
+                             ? gFlowStats.ChunkBytes / gFlowStats.Chunks
+                             : 0));
+}
@@ -0,0 +1,66 @@
+/* flow.h : TCP flow reassembly and content-defined chunking */
+
+#ifndef __FLOW_H
+#define __FLOW_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "packet.h"
+
+/* Bounds on the flow table so it survives real traffic */
+#define FLOW_MAX_FLOWS          8192
+#define FLOW_HASH_BUCKETS       16384
+#define FLOW_IDLE_SECONDS       60
+
+/* Out of order bytes held per flow before giving up on a gap */
+#define FLOW_MAX_OOO_BYTES      65536
+
+/* FastCDC chunk size bounds, the average is 2^CDC_AVG_BITS */
+#define CDC_MIN_SIZE            512
+#define CDC_AVG_BITS            11
+#define CDC_MAX_SIZE            8192
+
+/* Non-zero if TCP payloads go through the flow stage (-flows) */
+extern char gFlowReassembly;
+
+/* Summary counters for the flow stage */
+struct FlowStats
+{
+    uint64_t    FlowsCreated;
+    uint64_t    FlowsExpired;
+    uint64_t    FlowsEvicted;
+    uint64_t    Segments;
+    uint64_t    SegmentsOutOfOrder;
+    uint64_t    RetransmitBytes;
+    uint64_t    GapsSkipped;
+
+    /* Bytes that arrived after the gap they belong in was skipped */
+    uint64_t    LateBytes;
+    uint64_t    Chunks;
+    uint64_t    ChunkBytes;
+};
+
+extern struct FlowStats gFlowStats;
+
+/** Set up the flow table and the chunker gear table
+ * @returns 1 if successful, 0 otherwise
+ */
+char initializeFlows ();
+
+/** Feed one TCP segment to its flow.  The stream bytes are chunked and each
+ * chunk goes through processPayload.  Must be called with the table locked.
+ * The packet is always consumed.
+ * @param pPacket    The packet carrying the segment
+ * @param IPOffset   Offset of the IPv4 or IPv6 header in the packet
+ * @param TCPOffset  Offset of the TCP header in the packet
+ */
+void processFlowSegment (struct Packet * pPacket, uint32_t IPOffset, uint32_t TCPOffset);
+
+/* Flush every open flow through the chunker (call before tallying) */
+void flushFlows ();
+
+/* Print the flow stage summary */
+void printFlowStats ();
+
+#endif
@@ -0,0 +1,145 @@
+/* history.c : LZ4-compressed payload history (-compress-history)
+ *
+ * A retained packet costs its struct and a DEFAULT_READ_BUFFER data buffer
+ * whatever the payload size.  With -compress-history the payload is
+ * compressed into a block of its own size and the packet freed, so the
+ * same memory holds several times the history.  The block is only
+ * expanded when an incoming payload matches its fingerprint and size,
+ * which is all but always a hit.
+ *
+ * Everything here runs under the table lock (or after the consumers are
+ * done), which also guards the counters.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "history.h"
+#include "lz4.h"
+#include "packet.h"
+
+char gCompressHistory = 0;
+
+/* Payloads stored, and of those kept raw since they did not compress */
+static uint64_t HistoryStored = 0;
+static uint64_t HistoryRaw = 0;
+
+/* Payload bytes in, and bytes held after compression */
+static uint64_t HistoryPayloadBytes = 0;
+static uint64_t HistoryPackedBytes = 0;
+
+/* Bytes the same payloads would have held as packets */
+static uint64_t HistoryPacketBytes = 0;
+
+static uint64_t HistoryCompressNs = 0;
+static uint64_t HistoryExpands = 0;
+static uint64_t HistoryExpandNs = 0;
+
+static __thread uint8_t HistoryScratch[LZ4_BOUND(LZ4_MAX_INPUT)];
+
+static uint64_t historyClock() {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void initializeCompressedHistory() { gCompressHistory = 1; }
+
+void compressEntry(struct PacketEntry *pEntry) {
+
+  struct Packet *pPacket = pEntry->ThePacket;
+  uint64_t nStart = historyClock();
+  int nSize;
+
+  if (pPacket == NULL || pEntry->PayloadSize > LZ4_MAX_INPUT) {
+    return;
+  }
+
+  nSize = lz4Compress(pPacket->Data + pPacket->PayloadOffset,
+                      pEntry->PayloadSize, HistoryScratch,
+                      sizeof(HistoryScratch));
+
+  /* A block no smaller than the payload is stored as the payload itself */
+  if (nSize <= 0 || nSize >= (int)pEntry->PayloadSize) {
+    nSize = pEntry->PayloadSize;
+    memcpy(HistoryScratch, pPacket->Data + pPacket->PayloadOffset, nSize);
+    HistoryRaw++;
+  }
+
+  pEntry->Compressed = (uint8_t *)malloc(nSize);
+
+  if (pEntry->Compressed == NULL) {
+    return;
+  }
+
+  memcpy(pEntry->Compressed, HistoryScratch, nSize);
+  pEntry->CompressedSize = nSize;
+  pEntry->ThePacket = NULL;
+
+  HistoryStored++;
+  HistoryPayloadBytes += pEntry->PayloadSize;
+  HistoryPackedBytes += nSize;
+  HistoryPacketBytes += sizeof(struct Packet) + pPacket->SizeDataMax;
+
+  discardPacket(pPacket);
+  HistoryCompressNs += historyClock() - nStart;
+}
+
+uint8_t *expandEntry(struct PacketEntry *pEntry) {
+
+  uint64_t nStart;
+
+  if (pEntry->CompressedSize == pEntry->PayloadSize) {
+    return pEntry->Compressed;
+  }
+
+  nStart = historyClock();
+
+  if (lz4Decompress(pEntry->Compressed, pEntry->CompressedSize,
+                    HistoryScratch,
+                    pEntry->PayloadSize) != (int)pEntry->PayloadSize) {
+    printf("* Error: A compressed payload in the table is damaged\n");
+    memset(HistoryScratch, 0, pEntry->PayloadSize);
+  }
+
+  HistoryExpands++;
+  HistoryExpandNs += historyClock() - nStart;
+
+  return HistoryScratch;
+}
+
+void releaseEntry(struct PacketEntry *pEntry) {
+
+  free(pEntry->Compressed);
+  pEntry->Compressed = NULL;
+  pEntry->CompressedSize = 0;
+}
+
+void printCompressedHistory(uint64_t Hits) {
+
+  printf("Compressed payload history (LZ4)\n");
+  printf("  Payloads Compressed:     %lu (%lu kept raw)\n",
+         (unsigned long)HistoryStored, (unsigned long)HistoryRaw);
+  printf("  Payload Bytes:           %lu -> %lu (ratio %.2f)\n",
+         (unsigned long)HistoryPayloadBytes, (unsigned long)HistoryPackedBytes,
+         HistoryPackedBytes ? (double)HistoryPayloadBytes / HistoryPackedBytes
+                            : 0.0);
+  printf("  Memory per Payload:      %.0f bytes (%.0f as a packet, capacity "
+         "gain %.1fx)\n",
+         HistoryStored ? (double)HistoryPackedBytes / HistoryStored : 0.0,
+         HistoryStored ? (double)HistoryPacketBytes / HistoryStored : 0.0,
+         HistoryPackedBytes ? (double)HistoryPacketBytes / HistoryPackedBytes
+                            : 0.0);
+  printf("  Compression:             %.0f ns per payload\n",
+         HistoryStored ? (double)HistoryCompressNs / HistoryStored : 0.0);
+  printf("  Decompressions:          %lu (%.0f ns each, %.0f ns per hit)\n",
+         (unsigned long)HistoryExpands,
+         HistoryExpands ? (double)HistoryExpandNs / HistoryExpands : 0.0,
+         Hits ? (double)HistoryExpandNs / Hits : 0.0);
+}
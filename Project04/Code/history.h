@@ -0,0 +1,38 @@
+/* history.h : LZ4-compressed payload history (-compress-history) */
+
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+#include <stdint.h>
+
+#include "pcap-process.h"
+
+/* Non-zero if retained payloads are kept compressed */
+extern char gCompressHistory;
+
+/* Keep the payloads retained from now on compressed */
+void initializeCompressedHistory ();
+
+/** Replace the packet of a newly filled entry with its payload compressed
+ * (or copied as is if it does not compress).  Called with the table lock.
+ * @param pEntry  The entry, holding its packet in ThePacket
+ */
+void compressEntry (struct PacketEntry * pEntry);
+
+/** Decompress the payload of an entry for a comparison
+ * @param pEntry  An entry with Compressed set
+ * @returns The payload, valid until the calling thread expands another
+ */
+uint8_t * expandEntry (struct PacketEntry * pEntry);
+
+/** Free the compressed payload of an entry being emptied
+ * @param pEntry  An entry with Compressed set
+ */
+void releaseEntry (struct PacketEntry * pEntry);
+
+/** Print what compression saved and what the comparisons cost
+ * @param Hits  Duplicate payloads found, for the cost per hit
+ */
+void printCompressedHistory (uint64_t Hits);
+
+#endif
@@ -0,0 +1,169 @@
+/* horizon.c : Time-windowed dedup driven by the capture time
+ *
+ * With -horizon, an entry in BigTable lives until its payload has not been
+ * seen for the horizon (in capture time, not in table slots).  Every entry
+ * has a timer on a hierarchical timer wheel that is pushed back on each hit.
+ *
+ * Entries warm-started from a snapshot have no capture time yet, so their
+ * timers start from the first packet of the run.
+ *
+ * Since a hit records how long ago the payload was last seen, one pass also
+ * gives the hits for every shorter horizon: a hit of age A is a hit for each
+ * horizon of at least A.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "horizon.h"
+#include "hugepage.h"
+#include "pcap-process.h"
+#include "timerwheel.h"
+
+uint64_t gHorizonMs = 0;
+
+static struct TimerWheel HorizonWheel;
+
+/* Capture time (ms) when each entry was filled or last hit, HORIZON_UNKNOWN
+ * if it is empty or was warm-started and not hit since (a capture can start
+ * at time zero) */
+#define HORIZON_UNKNOWN UINT64_MAX
+
+static uint64_t *HorizonLastSeen;
+
+/* Set once the warm-started entries have their timers */
+static char HorizonStarted = 0;
+
+static const uint64_t HorizonPointsMs[HORIZON_POINTS] = {
+    1,     10,    100,    250,    500,    1000,    2000,   5000,
+    10000, 30000, 60000, 300000, 600000, 1800000, 3600000};
+
+/* Hits by age, bucketed on the points above (the last bucket is anything
+ * older than the last point but within the horizon) and of unknown age */
+static uint64_t HorizonHits[HORIZON_POINTS + 1];
+static uint64_t HorizonBytes[HORIZON_POINTS + 1];
+static uint64_t HorizonUnknownHits;
+static uint64_t HorizonUnknownBytes;
+static uint64_t HorizonExpired;
+
+static uint64_t captureMs(struct Packet *pPacket) {
+  return (uint64_t)pPacket->TimeCapture.tv_sec * 1000 +
+         pPacket->TimeCapture.tv_usec / 1000;
+}
+
+char initializeHorizon(int TableSize, uint64_t HorizonMs) {
+
+  if (!initializeTimerWheel(&HorizonWheel, TableSize)) {
+    return 0;
+  }
+
+  HorizonLastSeen = (uint64_t *)allocateLarge(sizeof(uint64_t) * TableSize);
+
+  if (HorizonLastSeen == NULL) {
+    printf("* Error: Unable to create the horizon table\n");
+    return 0;
+  }
+
+  for (int j = 0; j < TableSize; j++) {
+    HorizonLastSeen[j] = HORIZON_UNKNOWN;
+  }
+
+  gHorizonMs = HorizonMs;
+  HorizonWheel.Current = 0;
+  return 1;
+}
+
+static void expireEntry(int nEntry) {
+
+  HorizonExpired++;
+  HorizonLastSeen[nEntry] = HORIZON_UNKNOWN;
+
+  // The timer is already off the wheel, so this only folds the counters
+  resetAndSaveEntry(nEntry);
+}
+
+void advanceHorizon(struct Packet *pPacket) {
+
+  uint64_t nNow = captureMs(pPacket);
+
+  advanceTimerWheel(&HorizonWheel, nNow, expireEntry);
+
+  // Whatever is in the table before the first packet came from a snapshot
+  if (!HorizonStarted) {
+    HorizonStarted = 1;
+
+    for (int j = 0; j < BigTableSize; j++) {
+      if (BigTable[j].PayloadSize != 0) {
+        scheduleTimer(&HorizonWheel, j, nNow + gHorizonMs);
+      }
+    }
+  }
+}
+
+void touchHorizon(int nEntry, struct Packet *pPacket, char bHit) {
+
+  uint64_t nNow = captureMs(pPacket);
+
+  if (bHit) {
+    int nPoint = 0;
+
+    if (HorizonLastSeen[nEntry] == HORIZON_UNKNOWN) {
+      HorizonUnknownHits++;
+      HorizonUnknownBytes += pPacket->PayloadSize;
+    } else {
+      uint64_t nAge = nNow > HorizonLastSeen[nEntry]
+                          ? nNow - HorizonLastSeen[nEntry]
+                          : 0;
+
+      while (nPoint < HORIZON_POINTS && nAge > HorizonPointsMs[nPoint]) {
+        nPoint++;
+      }
+
+      HorizonHits[nPoint]++;
+      HorizonBytes[nPoint] += pPacket->PayloadSize;
+    }
+  }
+
+  HorizonLastSeen[nEntry] = nNow;
+  scheduleTimer(&HorizonWheel, nEntry, nNow + gHorizonMs);
+}
+
+void dropHorizon(int nEntry) {
+  cancelTimer(&HorizonWheel, nEntry);
+  HorizonLastSeen[nEntry] = HORIZON_UNKNOWN;
+}
+
+void printHorizonCurve() {
+
+  uint64_t nHits = 0;
+  uint64_t nBytes = 0;
+
+  printf("Redundancy by horizon (%lu entries expired)\n",
+         (unsigned long)HorizonExpired);
+  printf("  Horizon (s)     Hits       Bytes   Percent\n");
+
+  for (int j = 0; j <= HORIZON_POINTS; j++) {
+    uint64_t nPointMs = j < HORIZON_POINTS ? HorizonPointsMs[j] : gHorizonMs;
+
+    nHits += HorizonHits[j];
+    nBytes += HorizonBytes[j];
+
+    // The curve means nothing past the horizon entries were kept for
+    if (nPointMs >= gHorizonMs) {
+      printf("  %11.3f %8lu %11lu %8.2f%%\n", gHorizonMs / 1000.0,
+             (unsigned long)nHits, (unsigned long)nBytes,
+             gPacketSeenBytes ? nBytes * 100.0 / gPacketSeenBytes : 0.0);
+      break;
+    }
+
+    printf("  %11.3f %8lu %11lu %8.2f%%\n", nPointMs / 1000.0,
+           (unsigned long)nHits, (unsigned long)nBytes,
+           gPacketSeenBytes ? nBytes * 100.0 / gPacketSeenBytes : 0.0);
+  }
+
+  if (HorizonUnknownHits > 0) {
+    printf("  Hits on warm-started entries of unknown age: %lu (%lu bytes)\n",
+           (unsigned long)HorizonUnknownHits,
+           (unsigned long)HorizonUnknownBytes);
+  }
+}
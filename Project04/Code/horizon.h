@@ -0,0 +1,36 @@
+/* horizon.h : Time-windowed dedup driven by the capture time */
+
+#ifndef __HORIZON_H
+#define __HORIZON_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/* Horizons (in milliseconds) that the hit curve is reported at */
+#define HORIZON_POINTS      15
+
+/* Expiry horizon in milliseconds, zero if entries never age out (-horizon) */
+extern uint64_t gHorizonMs;
+
+/** Set up the per-entry timers for a table of the given size
+ * @param TableSize  Number of entries in BigTable
+ * @param HorizonMs  How long an entry lives after it was last seen
+ * @returns 1 if successful, 0 otherwise
+ */
+char initializeHorizon (int TableSize, uint64_t HorizonMs);
+
+/* Expire every entry not seen within the horizon of this packet's capture
+ * time (called before the lookup, with the table locked) */
+void advanceHorizon (struct Packet * pPacket);
+
+/* An entry was just filled (bHit zero) or hit (bHit non-zero) by pPacket */
+void touchHorizon (int nEntry, struct Packet * pPacket, char bHit);
+
+/* An entry was emptied for any other reason */
+void dropHorizon (int nEntry);
+
+/* Print the hits and bytes that fell within each horizon */
+void printHorizonCurve ();
+
+#endif
@@ -0,0 +1,114 @@
+/* hugepage.c : Large allocations backed by 2 MB pages (-hugepages)
+ *
+ * Random probes into a table of a few hundred megabytes miss the TLB on
+ * nearly every lookup with 4 KB pages.  Explicit huge pages (MAP_HUGETLB)
+ * need pages reserved in vm.nr_hugepages, so when none are free the block is
+ * mapped 2 MB aligned and advised with MADV_HUGEPAGE, which the kernel backs
+ * with transparent huge pages as it can.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "hugepage.h"
+
+char gHugePages = 0;
+
+/* Bytes placed each way */
+static size_t HugeTlbBytes = 0;
+static size_t TransparentBytes = 0;
+
+static size_t roundHuge(size_t Length) {
+
+  return (Length + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+void *allocateLarge(size_t Length) {
+
+  size_t nLength = roundHuge(Length);
+  uint8_t *pBlock;
+  uint8_t *pAligned;
+
+  if (!gHugePages) {
+    return calloc(1, Length);
+  }
+
+  pBlock = (uint8_t *)mmap(NULL, nLength, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+  if (pBlock != MAP_FAILED) {
+    HugeTlbBytes += nLength;
+    return pBlock;
+  }
+
+  /* Map an extra huge page so the block can start on a 2 MB boundary */
+  pBlock = (uint8_t *)mmap(NULL, nLength + HUGE_PAGE_SIZE,
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+
+  if (pBlock == MAP_FAILED) {
+    printf("* Error: Unable to map %lu bytes\n", (unsigned long)nLength);
+    return NULL;
+  }
+
+  pAligned = (uint8_t *)(((uintptr_t)pBlock + HUGE_PAGE_SIZE - 1) &
+                         ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+
+  if (pAligned > pBlock) {
+    munmap(pBlock, pAligned - pBlock);
+  }
+
+  munmap(pAligned + nLength, pBlock + HUGE_PAGE_SIZE - pAligned);
+
+  madvise(pAligned, nLength, MADV_HUGEPAGE);
+  TransparentBytes += nLength;
+  return pAligned;
+}
+
+void freeLarge(void *pBlock, size_t Length) {
+
+  if (pBlock == NULL) {
+    return;
+  }
+
+  if (!gHugePages) {
+    free(pBlock);
+    return;
+  }
+
+  munmap(pBlock, roundHuge(Length));
+}
+
+size_t transparentHugeBytes() {
+
+  char sLine[128];
+  unsigned long nAnonHuge = 0;
+  FILE *pFile = fopen("/proc/self/smaps_rollup", "r");
+
+  if (pFile == NULL) {
+    return 0;
+  }
+
+  while (fgets(sLine, sizeof(sLine), pFile) != NULL) {
+    if (sscanf(sLine, "AnonHugePages: %lu kB", &nAnonHuge) == 1) {
+      break;
+    }
+  }
+
+  fclose(pFile);
+  return (size_t)nAnonHuge * 1024;
+}
+
+void printHugePages() {
+
+  printf("Huge pages\n");
+  printf("  MAP_HUGETLB Bytes:       %lu\n", (unsigned long)HugeTlbBytes);
+  printf("  Transparent Bytes:       %lu (%lu backed by the kernel)\n",
+         (unsigned long)TransparentBytes,
+         (unsigned long)transparentHugeBytes());
+}
@@ -0,0 +1,32 @@
+/* hugepage.h : Large allocations backed by 2 MB pages (-hugepages) */
+
+#ifndef __HUGEPAGE_H
+#define __HUGEPAGE_H
+
+#include <stddef.h>
+
+#define HUGE_PAGE_SIZE      (2UL << 20)
+
+/* Non-zero if large allocations should use huge pages */
+extern char gHugePages;
+
+/** Allocate a zeroed block that is indexed at random (the table and the
+ * structures sized by it).  With gHugePages it is backed by MAP_HUGETLB
+ * pages if any are reserved, otherwise by 2 MB aligned memory advised for
+ * transparent huge pages; without it, it comes from calloc.
+ * @param Length  Bytes to allocate
+ * @returns The zeroed block, NULL if it could not be allocated
+ */
+void * allocateLarge (size_t Length);
+
+/* Release a block from allocateLarge */
+void freeLarge (void * pBlock, size_t Length);
+
+/* Bytes of this process the kernel backs with transparent huge pages */
+size_t transparentHugeBytes ();
+
+/* Print how the large blocks were backed and how much the kernel actually
+ * gave as transparent huge pages */
+void printHugePages ();
+
+#endif
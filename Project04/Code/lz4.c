@@ -0,0 +1,200 @@
+/* lz4.c : LZ4 block compression for retained payloads
+ *
+ * A small single-pass LZ4 block codec: a 4K-entry hash of the positions of
+ * 4-byte sequences finds matches, which are extended forward only, and
+ * runs without matches are skipped faster the longer they get.  The output
+ * is a standard LZ4 block (any LZ4 decoder reads it), with the format's
+ * rules that the last match starts 12 bytes before the end and the last 5
+ * bytes are literals.
+ */
+
+#include <string.h>
+
+#include "lz4.h"
+
+#define LZ4_HASH_LOG        12
+#define LZ4_MIN_MATCH       4
+#define LZ4_MF_LIMIT        12
+#define LZ4_LAST_LITERALS   5
+
+static uint32_t read32(const uint8_t *p) {
+
+  uint32_t nValue;
+
+  memcpy(&nValue, p, sizeof(nValue));
+  return nValue;
+}
+
+/* Write a length of 15 or more as its extra bytes after the token */
+static uint8_t *writeLength(uint8_t *pOut, int nLength) {
+
+  for (nLength -= 15; nLength >= 255; nLength -= 255) {
+    *pOut++ = 255;
+  }
+
+  *pOut++ = (uint8_t)nLength;
+  return pOut;
+}
+
+int lz4Compress(const uint8_t *pSrc, int SrcSize, uint8_t *pDst, int DstSize) {
+
+  uint16_t pTable[1 << LZ4_HASH_LOG];
+  uint8_t *pOut = pDst;
+  uint8_t *pEnd = pDst + DstSize;
+  int nAnchor = 0;
+  int nPos = 0;
+
+  if (SrcSize < 0 || SrcSize > LZ4_MAX_INPUT) {
+    return 0;
+  }
+
+  memset(pTable, 0, sizeof(pTable));
+
+  while (nPos < SrcSize - LZ4_MF_LIMIT) {
+    uint32_t nSequence = read32(pSrc + nPos);
+    uint32_t nHash = (nSequence * 2654435761u) >> (32 - LZ4_HASH_LOG);
+    int nRef = pTable[nHash];
+    int nLiterals, nMatch;
+
+    pTable[nHash] = (uint16_t)nPos;
+
+    if (nRef >= nPos || read32(pSrc + nRef) != nSequence) {
+      nPos += 1 + ((nPos - nAnchor) >> 6);
+      continue;
+    }
+
+    nMatch = LZ4_MIN_MATCH;
+
+    while (nPos + nMatch < SrcSize - LZ4_LAST_LITERALS &&
+           pSrc[nRef + nMatch] == pSrc[nPos + nMatch]) {
+      nMatch++;
+    }
+
+    /* Token, literal length, literals, offset and match length */
+    nLiterals = nPos - nAnchor;
+
+    if (pOut + 1 + nLiterals / 255 + 1 + nLiterals + 2 + nMatch / 255 + 1 >
+        pEnd) {
+      return 0;
+    }
+
+    *pOut++ = (uint8_t)((nLiterals < 15 ? nLiterals : 15) << 4 |
+                        (nMatch - LZ4_MIN_MATCH < 15 ? nMatch - LZ4_MIN_MATCH
+                                                     : 15));
+
+    if (nLiterals >= 15) {
+      pOut = writeLength(pOut, nLiterals);
+    }
+
+    memcpy(pOut, pSrc + nAnchor, nLiterals);
+    pOut += nLiterals;
+    *pOut++ = (uint8_t)(nPos - nRef);
+    *pOut++ = (uint8_t)((nPos - nRef) >> 8);
+
+    if (nMatch - LZ4_MIN_MATCH >= 15) {
+      pOut = writeLength(pOut, nMatch - LZ4_MIN_MATCH);
+    }
+
+    nPos += nMatch;
+    nAnchor = nPos;
+  }
+
+  /* The rest goes out as literals */
+  if (pOut + 1 + (SrcSize - nAnchor) / 255 + 1 + (SrcSize - nAnchor) > pEnd) {
+    return 0;
+  }
+
+  *pOut++ = (uint8_t)((SrcSize - nAnchor < 15 ? SrcSize - nAnchor : 15) << 4);
+
+  if (SrcSize - nAnchor >= 15) {
+    pOut = writeLength(pOut, SrcSize - nAnchor);
+  }
+
+  memcpy(pOut, pSrc + nAnchor, SrcSize - nAnchor);
+  pOut += SrcSize - nAnchor;
+
+  return pOut - pDst;
+}
+
+/* Read the extra bytes of a length of 15; -1 if they run off the block */
+static int readLength(const uint8_t *pSrc, int SrcSize, int *pPos) {
+
+  int nLength = 15;
+  uint8_t nByte;
+
+  do {
+    if (*pPos >= SrcSize) {
+      return -1;
+    }
+
+    nByte = pSrc[(*pPos)++];
+    nLength += nByte;
+  } while (nByte == 255);
+
+  return nLength;
+}
+
+int lz4Decompress(const uint8_t *pSrc, int SrcSize, uint8_t *pDst,
+                  int DstSize) {
+
+  int nIn = 0;
+  int nOut = 0;
+
+  while (nIn < SrcSize) {
+    uint8_t nToken = pSrc[nIn++];
+    int nLiterals = nToken >> 4;
+    int nMatch = nToken & 15;
+    int nOffset;
+
+    if (nLiterals == 15 && (nLiterals = readLength(pSrc, SrcSize, &nIn)) < 0) {
+      return -1;
+    }
+
+    if (nLiterals > SrcSize - nIn || nLiterals > DstSize - nOut) {
+      return -1;
+    }
+
+    memcpy(pDst + nOut, pSrc + nIn, nLiterals);
+    nIn += nLiterals;
+    nOut += nLiterals;
+
+    /* The last sequence is literals only */
+    if (nIn == SrcSize) {
+      break;
+    }
+
+    if (SrcSize - nIn < 2) {
+      return -1;
+    }
+
+    nOffset = pSrc[nIn] | pSrc[nIn + 1] << 8;
+    nIn += 2;
+
+    if (nOffset == 0 || nOffset > nOut) {
+      return -1;
+    }
+
+    if (nMatch == 15 && (nMatch = readLength(pSrc, SrcSize, &nIn)) < 0) {
+      return -1;
+    }
+
+    nMatch += LZ4_MIN_MATCH;
+
+    if (nMatch > DstSize - nOut) {
+      return -1;
+    }
+
+    /* Matches may overlap their own output */
+    if (nOffset >= nMatch) {
+      memcpy(pDst + nOut, pDst + nOut - nOffset, nMatch);
+    } else {
+      for (int j = 0; j < nMatch; j++) {
+        pDst[nOut + j] = pDst[nOut - nOffset + j];
+      }
+    }
+
+    nOut += nMatch;
+  }
+
+  return nOut;
+}
@@ -0,0 +1,33 @@
+/* lz4.h : LZ4 block compression for retained payloads */
+
+#ifndef __LZ4_H
+#define __LZ4_H
+
+#include <stdint.h>
+
+/* Largest input a block may hold (offsets are 16 bits) */
+#define LZ4_MAX_INPUT       65535
+
+/* Worst-case compressed size of Size bytes */
+#define LZ4_BOUND(Size)     ((Size) + (Size) / 255 + 16)
+
+/** Compress a buffer into one LZ4 block (the format of LZ4_compress_default)
+ * @param pSrc      The bytes to compress
+ * @param SrcSize   How many (at most LZ4_MAX_INPUT)
+ * @param pDst      Where the block is written
+ * @param DstSize   Room at pDst
+ * @returns The size of the block, 0 if it does not fit in DstSize
+ */
+int lz4Compress (const uint8_t * pSrc, int SrcSize, uint8_t * pDst, int DstSize);
+
+/** Decompress an LZ4 block, checking every length and offset against the
+ * buffers so that a damaged block cannot overrun them
+ * @param pSrc      The block
+ * @param SrcSize   Size of the block
+ * @param pDst      Where the bytes are written
+ * @param DstSize   Room at pDst
+ * @returns The number of bytes written, -1 if the block is malformed
+ */
+int lz4Decompress (const uint8_t * pSrc, int SrcSize, uint8_t * pDst, int DstSize);
+
+#endif
@@ -0,0 +1,306 @@
+/* lz4test.c : Round trips and damaged blocks for lz4.c and expandEntry
+ *
+ * Payloads of every size class and several kinds of content go through
+ * lz4Compress and back through lz4Decompress, which must give the same
+ * bytes and refuse an output buffer one byte short.  Valid blocks are then
+ * cut short, have bytes flipped and are replaced by noise, and a few are
+ * written by hand to break one rule each; lz4Decompress must reject them
+ * or stay inside its output.  Every output buffer is followed by guard
+ * bytes that are checked afterwards (build with -fsanitize=address to also
+ * catch reads past the block).  Last, payloads go through compressEntry
+ * and expandEntry as the table does with -compress-history, whole and with
+ * their block damaged.
+ *
+ * Usage: lz4test [SEED]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+#include "lz4.h"
+#include "packet.h"
+
+#define TEST_GUARD          64
+#define TEST_GUARD_BYTE     0xa5
+#define TEST_NOISE_BLOCKS   20000
+
+static uint64_t TestState;
+static int TestChecks = 0;
+static int TestFailures = 0;
+
+static uint64_t splitmix64(uint64_t *pState) {
+
+  uint64_t z = (*pState += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static void check(int bOk, const char *pWhat, int Size, int Kind) {
+
+  TestChecks++;
+
+  if (!bOk) {
+    TestFailures++;
+    printf("* Failed: %s (size %d, kind %d)\n", pWhat, Size, Kind);
+  }
+}
+
+/* Fill a payload with one of several kinds of content */
+static void fillPayload(uint8_t *pData, int Size, int Kind) {
+
+  for (int j = 0; j < Size; j++) {
+    switch (Kind) {
+    case 0:
+      pData[j] = 0;
+      break;
+    case 1:
+      pData[j] = (uint8_t)splitmix64(&TestState);
+      break;
+    case 2:
+      // A short period, so matches overlap their own output
+      pData[j] = (uint8_t)(j % 3);
+      break;
+    case 3:
+      // Text-like: a small alphabet
+      pData[j] = "GET /index.html HTTP/1.1\r\n"[splitmix64(&TestState) % 26];
+      break;
+    default:
+      // Random runs with copies of earlier bytes in between
+      if (j >= 64 && splitmix64(&TestState) % 4 == 0) {
+        int nFrom = splitmix64(&TestState) % j;
+        int nLength = 4 + splitmix64(&TestState) % 60;
+
+        for (; nLength > 0 && j < Size; nLength--, j++) {
+          pData[j] = pData[nFrom++];
+        }
+
+        j--;
+      } else {
+        pData[j] = (uint8_t)splitmix64(&TestState);
+      }
+      break;
+    }
+  }
+}
+
+/* Decompress into a buffer of exactly DstSize followed by guard bytes
+ * @returns What lz4Decompress returned, or -2 if the guard was overwritten
+ */
+static int guardedDecompress(const uint8_t *pBlock, int BlockSize,
+                             uint8_t *pOut, int DstSize) {
+
+  uint8_t *pDst = (uint8_t *)malloc(DstSize + TEST_GUARD);
+  int nResult;
+
+  memset(pDst + DstSize, TEST_GUARD_BYTE, TEST_GUARD);
+  nResult = lz4Decompress(pBlock, BlockSize, pDst, DstSize);
+
+  for (int j = 0; j < TEST_GUARD; j++) {
+    if (pDst[DstSize + j] != TEST_GUARD_BYTE) {
+      nResult = -2;
+      break;
+    }
+  }
+
+  if (pOut != NULL && nResult > 0) {
+    memcpy(pOut, pDst, nResult);
+  }
+
+  free(pDst);
+  return nResult;
+}
+
+/* A damaged block is fine if it is rejected or stays in its buffer */
+static void checkDamaged(const uint8_t *pBlock, int BlockSize, int DstSize,
+                         const char *pWhat, int Kind) {
+
+  /* A copy of exactly BlockSize, so reading past it is caught too */
+  uint8_t *pCopy = (uint8_t *)malloc(BlockSize > 0 ? BlockSize : 1);
+  int nResult;
+
+  memcpy(pCopy, pBlock, BlockSize);
+  nResult = guardedDecompress(pCopy, BlockSize, NULL, DstSize);
+  check(nResult >= -1 && nResult <= DstSize, pWhat, BlockSize, Kind);
+  free(pCopy);
+}
+
+static void testRoundTrip(int Size, int Kind) {
+
+  uint8_t *pSrc = (uint8_t *)malloc(Size + 1);
+  uint8_t *pBlock = (uint8_t *)malloc(LZ4_BOUND(Size));
+  uint8_t *pOut = (uint8_t *)malloc(Size + 1);
+  int nBlock, nResult;
+
+  fillPayload(pSrc, Size, Kind);
+  nBlock = lz4Compress(pSrc, Size, pBlock, LZ4_BOUND(Size));
+  check(nBlock > 0 && nBlock <= LZ4_BOUND(Size), "compress within the bound",
+        Size, Kind);
+
+  if (nBlock <= 0) {
+    free(pSrc);
+    free(pBlock);
+    free(pOut);
+    return;
+  }
+
+  nResult = guardedDecompress(pBlock, nBlock, pOut, Size);
+  check(nResult == Size && memcmp(pSrc, pOut, Size) == 0, "round trip", Size,
+        Kind);
+
+  if (Size > 0) {
+    check(guardedDecompress(pBlock, nBlock, NULL, Size - 1) == -1,
+          "reject an output one byte short", Size, Kind);
+  }
+
+  /* Cut short anywhere */
+  for (int j = 0; j < nBlock; j += 1 + nBlock / 64) {
+    checkDamaged(pBlock, j, Size, "truncated block", Kind);
+  }
+
+  /* One byte changed at a time */
+  for (int j = 0; j < nBlock; j += 1 + nBlock / 64) {
+    uint8_t nSaved = pBlock[j];
+
+    pBlock[j] ^= (uint8_t)(1 + splitmix64(&TestState) % 255);
+    checkDamaged(pBlock, nBlock, Size, "corrupted byte", Kind);
+    pBlock[j] = nSaved;
+  }
+
+  free(pSrc);
+  free(pBlock);
+  free(pOut);
+}
+
+static void testNoise() {
+
+  uint8_t pBlock[512];
+
+  for (int j = 0; j < TEST_NOISE_BLOCKS; j++) {
+    int nSize = 1 + splitmix64(&TestState) % sizeof(pBlock);
+    int nDst = splitmix64(&TestState) % 2048;
+
+    fillPayload(pBlock, nSize, 1);
+    checkDamaged(pBlock, nSize, nDst, "random block", 1);
+  }
+}
+
+/* Blocks that each break one rule of the format */
+static void testHandWritten() {
+
+  /* Match offset of zero */
+  static const uint8_t pZeroOffset[] = {0x40, 'a', 'b', 'c', 'd', 0, 0, 0};
+  /* Match reaching back before the output */
+  static const uint8_t pFarOffset[] = {0x40, 'a', 'b', 'c', 'd', 5, 0, 0};
+  /* Literal length continues past the block */
+  static const uint8_t pLongLiterals[] = {0xf0, 255, 255};
+  /* More literals than the block holds */
+  static const uint8_t pShortLiterals[] = {0x50, 'a', 'b'};
+  /* Only one byte of the offset */
+  static const uint8_t pHalfOffset[] = {0x10, 'a', 1};
+  /* Match length continues past the block */
+  static const uint8_t pLongMatch[] = {0x1f, 'a', 1, 0, 255};
+  /* A valid match longer than the output */
+  static const uint8_t pBigMatch[] = {0x1f, 'a', 1, 0, 200, 0x00};
+
+  check(guardedDecompress(pZeroOffset, sizeof(pZeroOffset), NULL, 64) == -1,
+        "zero offset", sizeof(pZeroOffset), -1);
+  check(guardedDecompress(pFarOffset, sizeof(pFarOffset), NULL, 64) == -1,
+        "offset before the output", sizeof(pFarOffset), -1);
+  check(guardedDecompress(pLongLiterals, sizeof(pLongLiterals), NULL, 64) ==
+            -1,
+        "literal length past the block", sizeof(pLongLiterals), -1);
+  check(guardedDecompress(pShortLiterals, sizeof(pShortLiterals), NULL, 64) ==
+            -1,
+        "literals past the block", sizeof(pShortLiterals), -1);
+  check(guardedDecompress(pHalfOffset, sizeof(pHalfOffset), NULL, 64) == -1,
+        "half an offset", sizeof(pHalfOffset), -1);
+  check(guardedDecompress(pLongMatch, sizeof(pLongMatch), NULL, 64) == -1,
+        "match length past the block", sizeof(pLongMatch), -1);
+  check(guardedDecompress(pBigMatch, sizeof(pBigMatch), NULL, 64) == -1,
+        "match past the output", sizeof(pBigMatch), -1);
+  check(guardedDecompress(pBigMatch, sizeof(pBigMatch), NULL, 220) == 220,
+        "the same match with room for it", sizeof(pBigMatch), -1);
+}
+
+/* Keep a payload the way the table does and expand it again */
+static void testEntry(int Size, int Kind, char bDamage) {
+
+  struct Packet *pPacket = allocatePacket(Size);
+  struct PacketEntry entry;
+  uint8_t *pPayload;
+  uint8_t *pOut;
+
+  memset(&entry, 0, sizeof(entry));
+  pPacket->PayloadOffset = 0;
+  pPacket->PayloadSize = Size;
+  fillPayload(pPacket->Data, Size, Kind);
+
+  pPayload = (uint8_t *)malloc(Size);
+  memcpy(pPayload, pPacket->Data, Size);
+
+  entry.ThePacket = pPacket;
+  entry.PayloadSize = Size;
+  compressEntry(&entry);
+  check(entry.ThePacket == NULL && entry.Compressed != NULL,
+        "entry kept compressed", Size, Kind);
+
+  if (entry.Compressed == NULL) {
+    discardPacket(entry.ThePacket);
+    free(pPayload);
+    return;
+  }
+
+  if (!bDamage) {
+    check(memcmp(expandEntry(&entry), pPayload, Size) == 0, "entry expanded",
+          Size, Kind);
+  } else if (entry.CompressedSize < entry.PayloadSize) {
+    /* Cut the block short; the payload must come back as zeros instead */
+    entry.CompressedSize /= 2;
+    pOut = expandEntry(&entry);
+    check(pOut[0] == 0 && memcmp(pOut, pOut + 1, Size - 1) == 0,
+          "damaged entry zeroed", Size, Kind);
+  }
+
+  releaseEntry(&entry);
+  free(pPayload);
+}
+
+int main(int argc, char *argv[]) {
+
+  static const int pSizes[] = {0,   1,    4,    5,    12,   13,   16,
+                               64,  128,  255,  256,  1000, 1460, 1500,
+                               4096, 9000, 32768, 65534, LZ4_MAX_INPUT};
+  int nSizes = sizeof(pSizes) / sizeof(pSizes[0]);
+
+  TestState = argc > 1 ? strtoull(argv[1], NULL, 0) : 1;
+
+  for (int j = 0; j < nSizes; j++) {
+    for (int k = 0; k < 5; k++) {
+      testRoundTrip(pSizes[j], k);
+    }
+  }
+
+  for (int j = 0; j < 200; j++) {
+    testRoundTrip(1 + splitmix64(&TestState) % LZ4_MAX_INPUT,
+                  splitmix64(&TestState) % 5);
+  }
+
+  testNoise();
+  testHandWritten();
+
+  for (int j = 1; j < nSizes; j++) {
+    for (int k = 0; k < 5; k++) {
+      testEntry(pSizes[j], k, 0);
+    }
+
+    testEntry(pSizes[j], 2, 1);
+  }
+
+  printf("lz4test: %d checks, %d failed\n", TestChecks, TestFailures);
+  return TestFailures > 0;
+}
@@ -13,9 +13,30 @@ char *strdup(const char *s);
 
 #include <string.h>
 
+#include "approx.h"
+#include "autotune.h"
+#include "breakdown.h"
+#include "decompress.h"
+#include "filter.h"
+#include "history.h"
+#include "flow.h"
+#include "horizon.h"
+#include "hugepage.h"
+#include "mrc.h"
+#include "overlap.h"
 #include "packet.h"
 #include "pcap-process.h"
 #include "pcap-read.h"
+#include "perfcount.h"
+#include "placement.h"
+#include "progress.h"
+#include "recode.h"
+#include "sample.h"
+#include "stages.h"
+#include "state.h"
+#include "stats.h"
+#include "steal.h"
+#include "topk.h"
 
 // Max number of files that can be read, and max length each file can be
 #define MAX_SIZE 100
@@ -27,13 +48,30 @@ pthread_mutex_t LockTable;
 pthread_cond_t PushCond;
 pthread_cond_t PopCond;
 
-// Initialize the number of values in the stack
+// Initialize the number of values in the stack and where the oldest one is
+// (the stack is drained in arrival order so flows see segments in sequence)
 int StackNum = 0;
+int StackHead = 0;
 
 // Initialize flags to be used to keep track of conditions
 char FinishedFlag = 0;
 char Continue = 1;
-char Finished = 0;
+
+// Packets taken off the stack, whether the reader of this file is done, and
+// how many consumers -threads auto wants to stop (all under LockStack)
+uint64_t PoppedCount = 0;
+char ReaderDone = 0;
+int RetireCount = 0;
+
+// Next packet (in read order) allowed to change the table with
+// -deterministic, and where the consumer holding each one waits its turn
+// (both under LockTable)
+uint64_t CommitNext = 0;
+pthread_cond_t CommitCond[MAX_SIZE];
+
+// Sizing of the consumer pool for -threads auto
+char AutoThreadsOn = 0;
+struct AutoThreads AutoPool;
 
 // Initialize packet
 struct Packet *StackObjects[MAX_SIZE];
@@ -45,50 +83,141 @@ void *thread_producer(void *PacketData) {
   struct FilePcapInfo *FileInfo = (struct FilePcapInfo *)PacketData;
   
   // Read the file and push the packets
+  placeReaderThread();
+  startPerfCounters();
   readPcapFile(FileInfo);
+  stopPerfCounters(PERF_ROLE_READER);
+  detachStages();
+
+  // Let -threads auto know it can stop watching this file
+  pthread_mutex_lock(&LockStack);
+  ReaderDone = 1;
+  pthread_mutex_unlock(&LockStack);
   return NULL;
   
 }
 
+// Hand a consumer's per-thread results over before it goes away
+void consumerDone() {
+
+  // With -deterministic the consumers share one summary, merged per file
+  if (gTopK && !gDeterministic) {
+    detachTopK();
+  }
+
+  if (gApproximate) {
+    detachApproximate();
+  }
+
+  detachStages();
+  stopPerfCounters(PERF_ROLE_CONSUMER);
+}
+
 // Function for the consumer thread
+// Pop the oldest packet off the shared stack, waiting for one if need be
+// (NULL once the file is done or -threads auto retires the caller)
+struct Packet *popStackPacket(uint64_t *pSequence) {
+
+  struct Packet *currPacket;
+
+  // Lock the mutex for the stack
+  pthread_mutex_lock(&LockStack);
+
+  // If stack is empty, then wait (or stop if -threads auto asks to)
+  while (StackNum <= 0 || RetireCount > 0) {
+
+    // Check if finished
+    if (FinishedFlag || RetireCount > 0) {
+
+      if (RetireCount > 0) {
+        RetireCount--;
+      }
+      
+      pthread_mutex_unlock(&LockStack);
+      return NULL;
+      
+    }
+
+    // Wait
+    pthread_cond_wait(&PopCond, &LockStack);
+  }
+  
+  // Pop the oldest packet
+  currPacket = StackObjects[StackHead];
+  StackHead = (StackHead + 1) % MAX_SIZE;
+  StackNum--;
+
+  // The stack is drained in read order, so the pop count numbers packets
+  *pSequence = PoppedCount++;
+
+  // Communicate to producers that there is room to push
+  pthread_cond_signal(&PushCond);
+  pthread_mutex_unlock(&LockStack);
+  return currPacket;
+}
+
 void *thread_consumer(void *PacketData) {
   
   struct Packet *currPacket;
+  uint64_t nStart, nWait, nSequence = 0;
+
+  placeConsumerThread(*(int *)PacketData);
+  startPerfCounters();
+  attachStatsThread(*(int *)PacketData);
 
   // While loop as long as continue flag is true
   while (Continue) {
 
-    // Lock the mutex for the stack
-    pthread_mutex_lock(&LockStack);
+    nStart = stageClock();
+    nWait = statsClock();
 
-    // If stack is empty, then wait
-    while (StackNum <= 0) {
+    // With -steal take from this consumer's own deque (or a peer's)
+    if (gStealOn) {
+      currPacket = takeStealPacket(*(int *)PacketData);
+    } else {
+      currPacket = popStackPacket(&nSequence);
+    }
 
-      // Wait
-      pthread_cond_wait(&PopCond, &LockStack);
-      
-      // Check if finished
-      if (StackNum == 0 && FinishedFlag) {
-        
-        Finished = 0;
-        pthread_mutex_unlock(&LockStack);
-        return NULL;
-        
-      }
+    if (currPacket == NULL) {
+      consumerDone();
+      return NULL;
     }
-    
-    // Pop the packet
-    currPacket = StackObjects[StackNum - 1];
-    StackNum--;
 
-    // Communicate to producers that there is room to push
-    pthread_cond_signal(&PushCond);
-    pthread_mutex_unlock(&LockStack);
+    nStart = recordStage(STAGE_DEQUEUE_WAIT, nStart);
+    countStatsPacket(currPacket);
+
+    // Sketching touches only this thread's sketches, so it needs no lock
+    if (gApproximate) {
+      countStatsStall(nWait);
+      processPacketApproximate(currPacket);
+      continue;
+    }
     
+    // Hash in parallel; only the table changes wait for their turn (or, with
+    // -steal, for the lock)
+    if (gDeterministic || gStealOn) {
+      fingerprintPacket(currPacket);
+    }
+
     // Lock the table's lock and process the packet
     pthread_mutex_lock(&LockTable);
+
+    // A packet popped earlier by another consumer goes first.  Waiters
+    // share a slot once more than MAX_SIZE are in flight (-threads auto on
+    // a big host), so the slot is broadcast and the wrong ones wait again
+    while (gDeterministic && CommitNext != nSequence) {
+      pthread_cond_wait(&CommitCond[nSequence % MAX_SIZE], &LockTable);
+    }
+
+    recordStage(STAGE_TABLE_LOCK, nStart);
+    countStatsStall(nWait);
     processPacket(currPacket);
 
+    if (gDeterministic) {
+      CommitNext++;
+      pthread_cond_broadcast(&CommitCond[CommitNext % MAX_SIZE]);
+    }
+
     // Unlock the table's lock
     pthread_mutex_unlock(&LockTable);
     
@@ -108,11 +237,31 @@ void PcapFileProcess(char *fileName, int numThreads) {
   fileInfo.Packets = 0;
   fileInfo.MaxPackets = 0;
 
-  // Initialize consumer threads
-  int numConsumerThreads = numThreads - 1;
+  // Consumers keep going until this file has been read
+  FinishedFlag = 0;
+  ReaderDone = 0;
+  RetireCount = 0;
+
+  // Initialize consumer threads (-threads auto may start more later)
+  int numConsumerThreads = AutoThreadsOn ? AutoPool.Consumers : numThreads - 1;
+  int maxConsumerThreads =
+      AutoThreadsOn ? AutoPool.MaxConsumers : numConsumerThreads;
   pthread_t *pThreadConsumers;
   pThreadConsumers =
-      (pthread_t *)malloc(sizeof(pthread_t *) * numConsumerThreads);
+      (pthread_t *)malloc(sizeof(pthread_t) * maxConsumerThreads);
+
+  // Slot of each consumer in the stats records
+  int consumerIndex[maxConsumerThreads];
+
+  beginStatsFile(fileName);
+
+  if (gStealOn) {
+    beginStealFile();
+  }
+
+  if (gOverlap) {
+    beginOverlapFile(fileName);
+  }
 
   // Initialize producer threads
   pthread_t pThreadProducer;
@@ -122,25 +271,65 @@ void PcapFileProcess(char *fileName, int numThreads) {
 
   // Create consumer threads
   for (int i = 0; i < numConsumerThreads; i++) {
-    pthread_create(&pThreadConsumers[i], 0, thread_consumer, 0);
+    consumerIndex[i] = i;
+    pthread_create(&pThreadConsumers[i], 0, thread_consumer, &consumerIndex[i]);
+  }
+
+  // Grow or shrink the consumers while the file is read
+  if (AutoThreadsOn) {
+    AutoPool.LastPopped = PoppedCount;
+
+    while (1) {
+      pthread_mutex_lock(&LockStack);
+      char done = ReaderDone;
+      pthread_mutex_unlock(&LockStack);
+
+      if (done) {
+        break;
+      }
+
+      int change = stepAutoThreads(&AutoPool, &PoppedCount);
+
+      if (change > 0 && numConsumerThreads < maxConsumerThreads) {
+        consumerIndex[numConsumerThreads] = numConsumerThreads;
+        pthread_create(&pThreadConsumers[numConsumerThreads], 0,
+                       thread_consumer, &consumerIndex[numConsumerThreads]);
+        numConsumerThreads++;
+      } else if (change < 0) {
+        pthread_mutex_lock(&LockStack);
+        RetireCount++;
+        pthread_cond_broadcast(&PopCond);
+        pthread_mutex_unlock(&LockStack);
+      }
+    }
   }
 
   // Use join function to allow producer thread to finish
   pthread_join(pThreadProducer, 0);
   
   // Update flag values to let consumers know that producers are done now
+  pthread_mutex_lock(&LockStack);
   FinishedFlag = 1;
-  Finished = 1;
 
-  // Broadcast signal to pop while the finished flag is true
-  while (Finished) {
-    pthread_cond_broadcast(&PopCond);
+  // Broadcast signal so waiting consumers see the finished flag
+  pthread_cond_broadcast(&PopCond);
+  pthread_mutex_unlock(&LockStack);
+
+  if (gStealOn) {
+    finishStealFile();
   }
 
   // Iterate through consumer threads to join them
   for (int i = 0; i < numConsumerThreads; i++) {
     pthread_join(pThreadConsumers[i], 0);
   }
+
+  if (gTopK && gDeterministic) {
+    detachTopK();
+  }
+
+  endStatsFile(numConsumerThreads);
+  free(pThreadConsumers);
   
 }
 
@@ -157,11 +346,58 @@ int main(int argc, char *argv[]) {
     /* You should handle this argument but make this a lower priority when
        writing this code to handle this
      */
-    printf("  -threads N       Number of threads to use (2 to 8)\n");
+    printf("  -threads N       Number of threads to use (2 to 8, or auto)\n");
     /* Note that you do not need to handle this argument in your code */
     printf("  -window  W       Window of bytes for partial matching (64 to "
            "512)\n");
     printf("       If not specified, the optimal setting will be used\n");
+    printf("  -decompress-threads N  Threads for multi-frame .gz/.zst "
+           "captures (default one per core)\n");
+    printf("  -flows           Reassemble TCP flows and dedup content-defined "
+           "chunks\n");
+    printf("  -steal           Give each consumer its own deque and let idle "
+           "ones steal\n");
+    printf("  -deterministic   Change the table in read order (same results "
+           "for any -threads)\n");
+    printf("  -approximate     Estimate redundancy in constant memory (no "
+           "table)\n");
+    printf("  -sample 1/N      Process one payload in N and extrapolate\n");
+    printf("  -stage-times     Print latency percentiles for each stage\n");
+    printf("  -perfcounters    Count cycles, instructions, LLC and branch "
+           "misses\n");
+    printf("  -progress S      Print progress, throughput and ETA every S "
+           "seconds\n");
+    printf("  -stats-format F  Write per-file, interval and thread records "
+           "(json or csv)\n");
+    printf("  -stats-out FILE  Where -stats-format writes (default stderr)\n");
+    printf("  -stats-interval S  Seconds between interval records (default "
+           "1)\n");
+    printf("  -pin CPUS        Pin the reader to the first of CPUS (e.g. 0-3,8) "
+           "and consumers to the rest\n");
+    printf("  -numa            Keep threads, table and packets on the NUMA "
+           "nodes in use\n");
+    printf("  -hugepages       Back the table with 2 MB pages\n");
+    printf("  -filter EXPR     Only analyze packets matching EXPR (e.g. \"tcp "
+           "and port 80\")\n");
+    printf("  -breakdown       Break redundancy down by protocol, service and "
+           "size\n");
+    printf("  -overlap         Report which files share payloads with which\n");
+    printf("  -overlap-csv CSV Also write the file pairs to CSV\n");
+    printf("  -compress-history  Keep retained payloads LZ4 compressed\n");
+    printf("  -table N         Number of entries in the table (default %d)\n",
+           DEFAULT_TABLE_SIZE);
+    printf("  -mrc CSV         Write hit ratio versus history size to CSV\n");
+    printf("  -mrc-samples N   Fingerprints sampled for -mrc (default %d)\n",
+           MRC_MAX_SAMPLES);
+    printf("  -topk K          Report the K payloads with the most redundant "
+           "bytes\n");
+    printf("  -horizon S       Expire entries not seen for S seconds of capture "
+           "time\n");
+    printf("  -encode OUT      Write FileName to OUT with duplicate payloads "
+           "replaced\n");
+    printf("  -decode OUT      Rebuild the pcap OUT from the encoded FileName\n");
+    printf("  -load-state S    Warm-start the table from snapshot S\n");
+    printf("  -save-state S    Write the table to snapshot S when done\n");
     return -1;
   }
 
@@ -178,6 +414,50 @@ int main(int argc, char *argv[]) {
   // Initialize default number of threads
   int numThreads = 2;
 
+  // Snapshots to warm-start from and to checkpoint to (if any)
+  char *loadStateFile = NULL;
+  char *saveStateFile = NULL;
+
+  // Size of the table
+  int tableSize = DEFAULT_TABLE_SIZE;
+  char tableGiven = 0;
+
+  // Where to write the history size curve and how many samples to keep
+  char *mrcFile = NULL;
+  char *overlapFile = NULL;
+  int mrcSamples = MRC_MAX_SAMPLES;
+
+  // How many heavy-hitter payloads to report (zero for none)
+  int topK = 0;
+
+  // How long entries live in capture time (zero means forever)
+  double horizonSeconds = 0;
+
+  // CPUs to pin to and whether to place memory by NUMA node
+  char *pinList = NULL;
+  char numaPlacement = 0;
+
+  // Machine-readable records: format, destination and interval
+  char *statsFormat = NULL;
+  char *statsFile = NULL;
+  double statsInterval = 1;
+
+  // Seconds between progress reports (zero for none)
+  double progressInterval = 0;
+
+  // Process one payload in sampleRate (zero for all of them)
+  uint32_t sampleRate = 0;
+
+  // Sketch the payloads instead of keeping them
+  char approximate = 0;
+
+  // Give each consumer its own deque to steal from
+  char steal = 0;
+
+  // Output of the encoder or decoder (instead of reporting redundancy)
+  char *encodeFile = NULL;
+  char *decodeFile = NULL;
+
   // parse arguments
   for (int i = 2; i < argc; i++) {
 
@@ -188,6 +468,16 @@ int main(int argc, char *argv[]) {
         printf("Error: value not specified after -threads\n");
         return 0;
       }
+      else if (strcmp(argv[i + 1], "auto") == 0) {
+
+        // Size the consumers from the cores and the queue as it runs
+        AutoThreadsOn = 1;
+        initializeAutoThreads(&AutoPool);
+
+        // The encoder and decoder just use every core
+        numThreads = AutoPool.MaxConsumers + 1;
+        i++;
+      }
       else {
 
         // Store the number of threads value
@@ -202,9 +492,324 @@ int main(int argc, char *argv[]) {
       }
       
     }
+    // Check -decompress-threads flag
+    else if (strcmp(argv[i], "-decompress-threads") == 0) {
+
+      if (i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+        printf("Error: -decompress-threads needs a positive number\n");
+        return 0;
+      }
+
+      gDecompressThreads = atoi(argv[i + 1]);
+      i++;
+    }
+    // Check -flows flag
+    else if (strcmp(argv[i], "-flows") == 0) {
+      gFlowReassembly = 1;
+    }
+    // Check -pin flag
+    else if (strcmp(argv[i], "-pin") == 0) {
+
+      if (i + 1 >= argc) {
+        printf("Error: value not specified after -pin\n");
+        return 0;
+      }
+
+      pinList = argv[i + 1];
+      i++;
+    }
+    // Check -overlap and -overlap-csv flags
+    else if (strcmp(argv[i], "-overlap") == 0) {
+      initializeOverlap();
+    }
+    else if (strcmp(argv[i], "-overlap-csv") == 0) {
+
+      if (i + 1 >= argc) {
+        printf("Error: value not specified after %s\n", argv[i]);
+        return 0;
+      }
+
+      overlapFile = argv[i + 1];
+      initializeOverlap();
+      i++;
+    }
+    // Check -compress-history flag
+    else if (strcmp(argv[i], "-compress-history") == 0) {
+      initializeCompressedHistory();
+    }
+    // Check -breakdown flag
+    else if (strcmp(argv[i], "-breakdown") == 0) {
+      initializeBreakdown();
+    }
+    // Check -filter flag
+    else if (strcmp(argv[i], "-filter") == 0) {
+
+      if (i + 1 >= argc) {
+        printf("Error: value not specified after -filter\n");
+        return 0;
+      }
+
+      if (!compileFilter(argv[i + 1])) {
+        return 0;
+      }
+
+      i++;
+    }
+    // Check -hugepages flag
+    else if (strcmp(argv[i], "-hugepages") == 0) {
+      gHugePages = 1;
+    }
+    // Check -numa flag
+    else if (strcmp(argv[i], "-numa") == 0) {
+      numaPlacement = 1;
+    }
+    // Check -progress flag
+    else if (strcmp(argv[i], "-progress") == 0) {
+
+      if (i + 1 >= argc) {
+        printf("Error: value not specified after -progress\n");
+        return 0;
+      }
+
+      progressInterval = atof(argv[i + 1]);
+
+      if (progressInterval <= 0) {
+        printf("Error: -progress must be a positive number of seconds\n");
+        return 0;
+      }
+
+      i++;
+    }
+    // Check -stats-format, -stats-out and -stats-interval flags
+    else if (strcmp(argv[i], "-stats-format") == 0 ||
+             strcmp(argv[i], "-stats-out") == 0 ||
+             strcmp(argv[i], "-stats-interval") == 0) {
+
+      if (i + 1 >= argc) {
+        printf("Error: value not specified after %s\n", argv[i]);
+        return 0;
+      }
+
+      if (strcmp(argv[i], "-stats-format") == 0) {
+        statsFormat = argv[i + 1];
+      } else if (strcmp(argv[i], "-stats-out") == 0) {
+        statsFile = argv[i + 1];
+      } else {
+        statsInterval = atof(argv[i + 1]);
+
+        if (statsInterval <= 0) {
+          printf("Error: -stats-interval must be a positive number\n");
+          return 0;
+        }
+      }
+
+      i++;
+    }
+    // Check -perfcounters flag
+    else if (strcmp(argv[i], "-perfcounters") == 0) {
+      initializePerfCounters();
+    }
+    // Check -stage-times flag
+    else if (strcmp(argv[i], "-stage-times") == 0) {
+      initializeStages();
+    }
+    // Check -steal flag
+    else if (strcmp(argv[i], "-steal") == 0) {
+      steal = 1;
+    }
+    // Check -deterministic flag
+    else if (strcmp(argv[i], "-deterministic") == 0) {
+      gDeterministic = 1;
+    }
+    // Check -approximate flag
+    else if (strcmp(argv[i], "-approximate") == 0) {
+      approximate = 1;
+    }
+    // Check -sample flag (1/N or just N)
+    else if (strcmp(argv[i], "-sample") == 0) {
+
+      if (i + 1 >= argc) {
+        printf("Error: value not specified after -sample\n");
+        return 0;
+      }
+
+      char *rate = strchr(argv[i + 1], '/');
+      int sampleValue = atoi(rate != NULL ? rate + 1 : argv[i + 1]);
+
+      if ((rate != NULL && atoi(argv[i + 1]) != 1) || sampleValue < 1) {
+        printf("Error: -sample must be of the form 1/N\n");
+        return 0;
+      }
+
+      sampleRate = sampleValue;
+      i++;
+    }
+    // Check -table, -mrc and -mrc-samples flags
+    else if (strcmp(argv[i], "-table") == 0 ||
+             strcmp(argv[i], "-mrc") == 0 ||
+             strcmp(argv[i], "-mrc-samples") == 0) {
+
+      if (i + 1 >= argc) {
+        printf("Error: value not specified after %s\n", argv[i]);
+        return 0;
+      }
+
+      if (strcmp(argv[i], "-mrc") == 0) {
+        mrcFile = argv[i + 1];
+      } else if (strcmp(argv[i], "-table") == 0) {
+        tableSize = atoi(argv[i + 1]);
+        tableGiven = 1;
+      } else {
+        mrcSamples = atoi(argv[i + 1]);
+      }
+
+      if (tableSize < 1 || mrcSamples < 1) {
+        printf("Error: %s must be a positive number\n", argv[i]);
+        return 0;
+      }
+
+      if (mrcSamples > MRC_SAMPLES_LIMIT) {
+        printf("Error: -mrc-samples must be a number from 1-%d\n",
+               MRC_SAMPLES_LIMIT);
+        return 0;
+      }
+
+      i++;
+    }
+    // Check -topk flag
+    else if (strcmp(argv[i], "-topk") == 0) {
+
+      if (i + 1 >= argc) {
+        printf("Error: value not specified after -topk\n");
+        return 0;
+      }
+
+      topK = atoi(argv[i + 1]);
+
+      if (topK < 1 || topK > TOPK_MAX) {
+        printf("Error: -topk must be a number from 1-%d\n", TOPK_MAX);
+        return 0;
+      }
+
+      i++;
+    }
+    // Check -horizon flag
+    else if (strcmp(argv[i], "-horizon") == 0) {
+
+      if (i + 1 >= argc) {
+        printf("Error: value not specified after -horizon\n");
+        return 0;
+      }
+
+      horizonSeconds = atof(argv[i + 1]);
+
+      if (horizonSeconds <= 0) {
+        printf("Error: horizon must be a positive number of seconds\n");
+        return 0;
+      }
+
+      i++;
+    }
+    // Check -encode and -decode flags
+    else if (strcmp(argv[i], "-encode") == 0 ||
+             strcmp(argv[i], "-decode") == 0) {
+
+      if (i + 1 >= argc) {
+        printf("Error: value not specified after %s\n", argv[i]);
+        return 0;
+      }
+
+      if (strcmp(argv[i], "-encode") == 0) {
+        encodeFile = argv[i + 1];
+      } else {
+        decodeFile = argv[i + 1];
+      }
+
+      i++;
+    }
+    // Check -load-state and -save-state flags
+    else if (strcmp(argv[i], "-load-state") == 0 ||
+             strcmp(argv[i], "-save-state") == 0) {
+
+      if (i + 1 >= argc) {
+        printf("Error: value not specified after %s\n", argv[i]);
+        return 0;
+      }
+
+      if (strcmp(argv[i], "-load-state") == 0) {
+        loadStateFile = argv[i + 1];
+      } else {
+        saveStateFile = argv[i + 1];
+      }
+
+      i++;
+    }
     
   }
 
+  // The encoder and decoder work on a single file and report on their own
+  if (encodeFile != NULL) {
+    return encodeCapture(inputFile, encodeFile, numThreads) ? 0 : -1;
+  }
+
+  if (decodeFile != NULL) {
+    return decodeCapture(inputFile, decodeFile, numThreads) ? 0 : -1;
+  }
+
+  // The sketches keep no payloads, so nothing that needs the table applies
+  if (approximate && (gFlowReassembly || mrcFile != NULL || topK > 0 ||
+                      horizonSeconds > 0 || gOverlap || gBreakdown ||
+                      gCompressHistory || loadStateFile != NULL ||
+                      saveStateFile != NULL)) {
+    printf("Error: -approximate cannot be combined with -flows, -mrc, -topk, "
+           "-horizon, -overlap, -breakdown, -compress-history or the state "
+           "options\n");
+    return 0;
+  }
+
+  // A snapshot brings its own table size
+  if (tableGiven && loadStateFile != NULL) {
+    printf("Error: -table cannot be combined with -load-state (the snapshot "
+           "sets the table size)\n");
+    return 0;
+  }
+
+  // Sampling by payload would split the segments of a flow
+  if (sampleRate > 1 && (gFlowReassembly || approximate)) {
+    printf("Error: -sample cannot be combined with -flows or -approximate\n");
+    return 0;
+  }
+
+  // Deques are per consumer and steals take packets out of read order, so
+  // neither a pool that changes size nor committing in read order fits them
+  if (steal && (AutoThreadsOn || gDeterministic)) {
+    printf("Error: -steal cannot be combined with -threads auto or "
+           "-deterministic\n");
+    return 0;
+  }
+
+  if (steal && !initializeSteal(numThreads - 1)) {
+    return 0;
+  }
+
+  if (pinList != NULL && !initializePinning(pinList)) {
+    return 0;
+  }
+
+  if (numaPlacement && !initializeNumaPlacement()) {
+    return 0;
+  }
+
+  if (statsFormat != NULL &&
+      !initializeStats(statsFormat, statsFile, statsInterval,
+                       numThreads - 1)) {
+    return 0;
+  }
+
+  if (progressInterval > 0 && !initializeProgress(progressInterval, inputFile)) {
+    return 0;
+  }
+
   // TODO: Measure start time here!
   struct timeval t1;
   struct timeval t2;
@@ -215,14 +820,68 @@ int main(int argc, char *argv[]) {
   double startMicTime = (t1.tv_usec / 1000000.0);
   double actualStartTime = (double) startTime + startMicTime;
 
+  // Page placement across the nodes since the start of the run
+  struct NumaCounters numaBefore, numaAfter;
+  readNumaCounters(&numaBefore);
+
   // Initialize locks
   pthread_mutex_init(&LockStack, 0);
   pthread_mutex_init(&LockTable, 0);
 
+  for (int i = 0; i < MAX_SIZE; i++) {
+    pthread_cond_init(&CommitCond[i], 0);
+  }
+
   printf("MAIN: Initializing the table for redundancy extraction\n");
-  initializeProcessing(DEFAULT_TABLE_SIZE);
+
+  if (approximate) {
+
+    if (!initializeApproximate()) {
+      return 0;
+    }
+  } else if (loadStateFile != NULL) {
+
+    if (!loadProcessingState(loadStateFile)) {
+      return 0;
+    }
+
+    printf("MAIN: Warm-started %u of %d entries from %s\n",
+           gStateLoaded.EntriesUsed, BigTableSize, loadStateFile);
+  } else if (!initializeProcessing(tableSize)) {
+    return 0;
+  }
+
+  if (horizonSeconds > 0 &&
+      !initializeHorizon(BigTableSize, (uint64_t)(horizonSeconds * 1000))) {
+    return 0;
+  }
+
+  if (topK > 0 && !initializeTopK(topK)) {
+    return 0;
+  }
+
+  if (mrcFile != NULL && !initializeMissRatio(mrcSamples)) {
+    return 0;
+  }
+
+  if (sampleRate > 1) {
+    initializeSample(sampleRate);
+  }
+
+  if (gFlowReassembly && !initializeFlows()) {
+    return 0;
+  }
+
+  if (gNumaPlacement && !gApproximate) {
+    placeTableMemory(BigTable, sizeof(struct PacketEntry) * BigTableSize);
+  }
+
   printf("MAIN: Initializing the table for redundancy extraction ... done\n");
 
+  if (gProgressOn) {
+    startProgress();
+  }
+
   // If the input file is a .pcap file, process it
   if (strstr(inputFile, ".pcap")) {
     PcapFileProcess(inputFile, numThreads);
@@ -253,24 +912,118 @@ int main(int argc, char *argv[]) {
     
   }
 
+  if (gProgressOn) {
+    stopProgress();
+  }
+
+  if (AutoThreadsOn) {
+    reportAutoThreads(&AutoPool);
+  }
+
+  // Push the bytes still held by open flows through the chunker
+  if (gFlowReassembly) {
+    flushFlows();
+  }
+
+  // Checkpoint before tallying since the tally empties the table
+  if (saveStateFile != NULL) {
+    saveProcessingState(saveStateFile);
+  }
+
   printf("Summarizing the processed entries\n");
-  tallyProcessing();
+
+  if (gApproximate) {
+    finishApproximate();
+  } else {
+    tallyProcessing();
+  }
+
+  if (gSampleRate > 1) {
+    finishSample();
+  }
   
   /* Output the statistics */
 
   printf("Parsing of file %s complete\n", argv[1]);
 
-  printf("  Total Packets Parsed:    %d\n", gPacketSeenCount);
+  printf("  Total Packets Parsed:    %lu\n", (unsigned long)gPacketSeenCount);
   printf("  Total Bytes   Parsed:    %lu\n", (unsigned long)gPacketSeenBytes);
-  printf("  Total Packets Duplicate: %d\n", gPacketHitCount);
+  printf("  Total Packets Duplicate: %lu\n", (unsigned long)gPacketHitCount);
   printf("  Total Bytes   Duplicate: %lu\n", (unsigned long)gPacketHitBytes);
 
   float fPct;
 
-  fPct = (float)gPacketHitBytes / (float)gPacketSeenBytes * 100.0;
+  // A filter may leave nothing to parse
+  fPct = gPacketSeenBytes
+             ? (float)gPacketHitBytes / (float)gPacketSeenBytes * 100.0
+             : 0;
 
   printf("  Total Duplicate Percent: %6.2f%%\n", fPct);
 
+  if (gFlowReassembly) {
+    printFlowStats();
+  }
+
+  if (gHorizonMs) {
+    printHorizonCurve();
+  }
+
+  if (mrcFile != NULL) {
+    writeMissRatioCurve(mrcFile);
+  }
+
+  if (gTopK) {
+    printTopK();
+  }
+
+  if (gStageTiming) {
+    printStages();
+  }
+
+  if (gPerfCounters) {
+    printPerfCounters(gPacketSeenCount, gPacketSeenBytes);
+  }
+
+  if (gBreakdown) {
+    printBreakdown();
+  }
+
+  if (gCompressHistory) {
+    printCompressedHistory(gPacketHitCount);
+  }
+
+  if (gOverlap) {
+    printOverlap();
+  }
+
+  if (overlapFile != NULL) {
+    writeOverlap(overlapFile);
+  }
+
+  if (gFilterOn) {
+    printFilterStats();
+  }
+
+  if (gStealOn) {
+    printSteal();
+  }
+
+  if (gHugePages) {
+    printHugePages();
+  }
+
+  if (gPinThreads || gNumaPlacement) {
+    readNumaCounters(&numaAfter);
+    printNumaCounters(&numaBefore, &numaAfter);
+  }
+
+  if (loadStateFile != NULL) {
+    printf("  Snapshot Packets Parsed: %lu (before this run)\n",
+           (unsigned long)gStateLoaded.SeenCount);
+    printf("  Snapshot Bytes Duplicate: %lu (before this run)\n",
+           (unsigned long)gStateLoaded.HitBytes);
+  }
+
   // TODO: Measure stop time here!
   //  Output the total runtime in an appropriate unit
   //get stopping time
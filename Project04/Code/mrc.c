@@ -0,0 +1,420 @@
+/* mrc.c : Single-pass redundancy versus history size curve (SHARDS)
+ *
+ * For an LRU history of C entries, a payload is a hit exactly when fewer than
+ * C distinct payloads were seen since its last occurrence (its stack
+ * distance).  A histogram of stack distances therefore gives the hit ratio of
+ * every history size at once.
+ *
+ * Following SHARDS, only fingerprints whose hash falls under a threshold are
+ * tracked, and their distances are scaled up by the sampling rate.  Memory
+ * is bounded: when more than MaxSamples fingerprints are tracked, the one
+ * with the largest hash is dropped and the threshold is lowered to it, with
+ * the histogram rescaled to the new rate.
+ *
+ * Which fingerprints happen to be sampled skews the totals (a sampled heavy
+ * hitter inflates every hit ratio), so the curve is corrected as in
+ * SHARDS_adj: the gap between the expected and the actual number of sampled
+ * references is added to the smallest distance.
+ *
+ * Distances are counted with a treap of the tracked fingerprints ordered by
+ * their last access time, augmented with subtree sizes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mrc.h"
+
+char gMissRatioCurve = 0;
+
+/* A tracked fingerprint, also a node of the treap and of the heap */
+struct MrcNode
+{
+    uint64_t    Fingerprint;
+    uint64_t    Time;
+    uint32_t    Value;
+    uint32_t    Priority;
+    uint32_t    Size;
+    int32_t     Left;
+    int32_t     Right;
+};
+
+static struct MrcNode *MrcNodes;
+static int32_t *MrcIndex;
+static uint32_t MrcIndexMask;
+static int32_t *MrcHeap;
+static uint32_t MrcCount;
+static uint32_t MrcMax;
+static int32_t MrcRoot;
+static int32_t MrcFree;
+static uint64_t MrcTime;
+static uint32_t MrcSeed = 2463534242u;
+
+/* Sampling threshold and rate (Threshold / MRC_MODULUS) */
+static uint32_t MrcThreshold;
+static double MrcRate;
+
+/* Histogram of scaled distances, rescaled whenever the rate drops */
+static double MrcHits[MRC_BUCKETS];
+static double MrcHitBytes[MRC_BUCKETS];
+static double MrcRefs;
+static double MrcRefBytes;
+
+/* Every reference, sampled or not */
+static uint64_t MrcAllRefs;
+static uint64_t MrcAllBytes;
+
+char initializeMissRatio(uint32_t MaxSamples) {
+
+  uint32_t nIndexSize = 1;
+
+  while (nIndexSize < MaxSamples * 2) {
+    nIndexSize <<= 1;
+  }
+
+  MrcNodes = (struct MrcNode *)malloc(sizeof(struct MrcNode) * (MaxSamples + 1));
+  MrcIndex = (int32_t *)malloc(sizeof(int32_t) * nIndexSize);
+  MrcHeap = (int32_t *)malloc(sizeof(int32_t) * (MaxSamples + 1));
+
+  if (MrcNodes == NULL || MrcIndex == NULL || MrcHeap == NULL) {
+    printf("* Error: Unable to create the miss ratio sampler\n");
+    return 0;
+  }
+
+  memset(MrcIndex, 0xff, sizeof(int32_t) * nIndexSize);
+  MrcIndexMask = nIndexSize - 1;
+
+  // Free list of nodes threaded through Left
+  for (uint32_t j = 0; j <= MaxSamples; j++) {
+    MrcNodes[j].Left = j < MaxSamples ? (int32_t)j + 1 : -1;
+  }
+
+  MrcFree = 0;
+  MrcRoot = -1;
+  MrcCount = 0;
+  MrcMax = MaxSamples;
+  MrcTime = 0;
+  MrcThreshold = MRC_MODULUS;
+  MrcRate = 1.0;
+  gMissRatioCurve = 1;
+  return 1;
+}
+
+/* xorshift for the treap priorities */
+static uint32_t nextPriority() {
+  MrcSeed ^= MrcSeed << 13;
+  MrcSeed ^= MrcSeed >> 17;
+  MrcSeed ^= MrcSeed << 5;
+  return MrcSeed;
+}
+
+static uint32_t treapSize(int32_t nNode) {
+  return nNode < 0 ? 0 : MrcNodes[nNode].Size;
+}
+
+static void treapUpdate(int32_t nNode) {
+  MrcNodes[nNode].Size = 1 + treapSize(MrcNodes[nNode].Left) +
+                         treapSize(MrcNodes[nNode].Right);
+}
+
+/* Split into times <= Time and times > Time */
+static void treapSplit(int32_t nNode, uint64_t Time, int32_t *pLeft,
+                       int32_t *pRight) {
+
+  if (nNode < 0) {
+    *pLeft = -1;
+    *pRight = -1;
+  } else if (MrcNodes[nNode].Time <= Time) {
+    treapSplit(MrcNodes[nNode].Right, Time, &MrcNodes[nNode].Right, pRight);
+    *pLeft = nNode;
+    treapUpdate(nNode);
+  } else {
+    treapSplit(MrcNodes[nNode].Left, Time, pLeft, &MrcNodes[nNode].Left);
+    *pRight = nNode;
+    treapUpdate(nNode);
+  }
+}
+
+static int32_t treapMerge(int32_t nLeft, int32_t nRight) {
+
+  if (nLeft < 0) {
+    return nRight;
+  }
+
+  if (nRight < 0) {
+    return nLeft;
+  }
+
+  if (MrcNodes[nLeft].Priority > MrcNodes[nRight].Priority) {
+    MrcNodes[nLeft].Right = treapMerge(MrcNodes[nLeft].Right, nRight);
+    treapUpdate(nLeft);
+    return nLeft;
+  }
+
+  MrcNodes[nRight].Left = treapMerge(nLeft, MrcNodes[nRight].Left);
+  treapUpdate(nRight);
+  return nRight;
+}
+
+/* New times are always the latest, so inserting is a merge on the right */
+static void treapAppend(int32_t nNode) {
+  MrcNodes[nNode].Left = -1;
+  MrcNodes[nNode].Right = -1;
+  MrcNodes[nNode].Size = 1;
+  MrcRoot = treapMerge(MrcRoot, nNode);
+}
+
+/* Remove a node and return how many nodes have a later time */
+static uint32_t treapRemove(int32_t nNode) {
+
+  int32_t nLess, nMid, nMore;
+  uint32_t nLater;
+
+  treapSplit(MrcRoot, MrcNodes[nNode].Time - 1, &nLess, &nMid);
+  treapSplit(nMid, MrcNodes[nNode].Time, &nMid, &nMore);
+  nLater = treapSize(nMore);
+  MrcRoot = treapMerge(nLess, nMore);
+  return nLater;
+}
+
+static int32_t *findIndexSlot(uint64_t Fingerprint) {
+
+  uint32_t nSlot = (uint32_t)Fingerprint & MrcIndexMask;
+
+  while (MrcIndex[nSlot] >= 0 &&
+         MrcNodes[MrcIndex[nSlot]].Fingerprint != Fingerprint) {
+    nSlot = (nSlot + 1) & MrcIndexMask;
+  }
+
+  return &MrcIndex[nSlot];
+}
+
+/* Linear probing removal that shifts later entries back into the hole */
+static void removeIndex(uint64_t Fingerprint) {
+
+  uint32_t nHole = (int32_t *)findIndexSlot(Fingerprint) - MrcIndex;
+  uint32_t nSlot = nHole;
+
+  MrcIndex[nHole] = -1;
+
+  while (1) {
+    nSlot = (nSlot + 1) & MrcIndexMask;
+
+    if (MrcIndex[nSlot] < 0) {
+      return;
+    }
+
+    uint32_t nHome = (uint32_t)MrcNodes[MrcIndex[nSlot]].Fingerprint &
+                     MrcIndexMask;
+
+    // Move it back only if the hole lies between its home and here
+    if (((nSlot - nHome) & MrcIndexMask) >= ((nSlot - nHole) & MrcIndexMask)) {
+      MrcIndex[nHole] = MrcIndex[nSlot];
+      MrcIndex[nSlot] = -1;
+      nHole = nSlot;
+    }
+  }
+}
+
+static void heapSwap(uint32_t a, uint32_t b) {
+  int32_t t = MrcHeap[a];
+  MrcHeap[a] = MrcHeap[b];
+  MrcHeap[b] = t;
+}
+
+static void heapPush(int32_t nNode) {
+
+  uint32_t nPos = MrcCount++;
+
+  MrcHeap[nPos] = nNode;
+
+  while (nPos > 0 && MrcNodes[MrcHeap[(nPos - 1) / 2]].Value <
+                         MrcNodes[MrcHeap[nPos]].Value) {
+    heapSwap(nPos, (nPos - 1) / 2);
+    nPos = (nPos - 1) / 2;
+  }
+}
+
+static int32_t heapPop() {
+
+  int32_t nTop = MrcHeap[0];
+  uint32_t nPos = 0;
+
+  MrcHeap[0] = MrcHeap[--MrcCount];
+
+  while (1) {
+    uint32_t nBig = nPos;
+    uint32_t nLeft = 2 * nPos + 1;
+    uint32_t nRight = 2 * nPos + 2;
+
+    if (nLeft < MrcCount &&
+        MrcNodes[MrcHeap[nLeft]].Value > MrcNodes[MrcHeap[nBig]].Value) {
+      nBig = nLeft;
+    }
+
+    if (nRight < MrcCount &&
+        MrcNodes[MrcHeap[nRight]].Value > MrcNodes[MrcHeap[nBig]].Value) {
+      nBig = nRight;
+    }
+
+    if (nBig == nPos) {
+      return nTop;
+    }
+
+    heapSwap(nPos, nBig);
+    nPos = nBig;
+  }
+}
+
+/* Drop the largest sampled hashes and lower the rate to fit in MrcMax */
+static void lowerThreshold() {
+
+  double nScale;
+
+  while (MrcCount > MrcMax ||
+         (MrcCount > 0 && MrcNodes[MrcHeap[0]].Value >= MrcThreshold)) {
+    int32_t nNode = heapPop();
+
+    MrcThreshold = MrcNodes[nNode].Value;
+    treapRemove(nNode);
+    removeIndex(MrcNodes[nNode].Fingerprint);
+
+    MrcNodes[nNode].Left = MrcFree;
+    MrcFree = nNode;
+  }
+
+  nScale = (double)MrcThreshold / MRC_MODULUS / MrcRate;
+  MrcRate = (double)MrcThreshold / MRC_MODULUS;
+
+  for (int j = 0; j < MRC_BUCKETS; j++) {
+    MrcHits[j] *= nScale;
+    MrcHitBytes[j] *= nScale;
+  }
+
+  MrcRefs *= nScale;
+  MrcRefBytes *= nScale;
+}
+
+static int distanceBucket(uint64_t nDistance) {
+
+  int nLog = 63 - __builtin_clzll(nDistance | 1);
+  int nBucket;
+
+  if (nDistance < MRC_SUB_BUCKETS) {
+    return (int)nDistance;
+  }
+
+  nBucket = (nLog - MRC_SUB_BITS + 1) * MRC_SUB_BUCKETS +
+            (int)((nDistance >> (nLog - MRC_SUB_BITS)) & (MRC_SUB_BUCKETS - 1));
+
+  return nBucket < MRC_BUCKETS ? nBucket : MRC_BUCKETS - 1;
+}
+
+/* Smallest distance that lands in a bucket */
+static uint64_t bucketStart(int nBucket) {
+
+  int nLog;
+
+  if (nBucket < MRC_SUB_BUCKETS) {
+    return nBucket;
+  }
+
+  nLog = nBucket / MRC_SUB_BUCKETS + MRC_SUB_BITS - 1;
+  return (uint64_t)(MRC_SUB_BUCKETS + nBucket % MRC_SUB_BUCKETS)
+         << (nLog - MRC_SUB_BITS);
+}
+
+void recordMissRatio(uint64_t Fingerprint, uint32_t PayloadSize) {
+
+  // The low bits index BigTable, so sample on an independent slice
+  uint32_t nValue = (uint32_t)(Fingerprint >> 32) & (MRC_MODULUS - 1);
+  int32_t *pSlot;
+  int32_t nNode;
+
+  MrcAllRefs++;
+  MrcAllBytes += PayloadSize;
+
+  if (nValue >= MrcThreshold) {
+    return;
+  }
+
+  MrcRefs += 1;
+  MrcRefBytes += PayloadSize;
+  MrcTime++;
+
+  pSlot = findIndexSlot(Fingerprint);
+
+  if (*pSlot >= 0) {
+    /* Seen before - distinct fingerprints since then, scaled by the rate */
+    uint64_t nDistance;
+
+    nNode = *pSlot;
+    nDistance = (uint64_t)(treapRemove(nNode) / MrcRate);
+
+    MrcHits[distanceBucket(nDistance)] += 1;
+    MrcHitBytes[distanceBucket(nDistance)] += PayloadSize;
+
+    MrcNodes[nNode].Time = MrcTime;
+    treapAppend(nNode);
+    return;
+  }
+
+  /* First time (a miss at any size) - start tracking it */
+  nNode = MrcFree;
+  MrcFree = MrcNodes[nNode].Left;
+
+  MrcNodes[nNode].Fingerprint = Fingerprint;
+  MrcNodes[nNode].Time = MrcTime;
+  MrcNodes[nNode].Value = nValue;
+  MrcNodes[nNode].Priority = nextPriority();
+  *pSlot = nNode;
+  treapAppend(nNode);
+  heapPush(nNode);
+
+  if (MrcCount > MrcMax) {
+    lowerThreshold();
+  }
+}
+
+char writeMissRatioCurve(const char *pFileName) {
+
+  FILE *pFile;
+  double nExpectRefs = MrcAllRefs * MrcRate;
+  double nExpectBytes = MrcAllBytes * MrcRate;
+  double nHits = nExpectRefs - MrcRefs;
+  double nBytes = nExpectBytes - MrcRefBytes;
+  int nLast = 0;
+
+  pFile = fopen(pFileName, "w");
+
+  if (pFile == NULL) {
+    printf("* Error: Unable to create the curve file %s\n", pFileName);
+    return 0;
+  }
+
+  for (int j = 0; j < MRC_BUCKETS; j++) {
+    if (MrcHits[j] > 0) {
+      nLast = j;
+    }
+  }
+
+  /* A history of C entries hits every distance below C */
+  fprintf(pFile, "history_entries,hit_ratio,byte_hit_ratio\n");
+
+  for (int j = 0; j <= nLast; j++) {
+    nHits += MrcHits[j];
+    nBytes += MrcHitBytes[j];
+
+    fprintf(pFile, "%lu,%.6f,%.6f\n", (unsigned long)bucketStart(j + 1),
+            nExpectRefs > 0 ? nHits / nExpectRefs : 0.0,
+            nExpectBytes > 0 ? nBytes / nExpectBytes : 0.0);
+  }
+
+  fclose(pFile);
+
+  printf("Redundancy curve written to %s (%u fingerprints tracked, sampling "
+         "rate %.4f)\n",
+         pFileName, MrcCount, MrcRate);
+  return 1;
+}
@@ -0,0 +1,40 @@
+/* mrc.h : Single-pass redundancy versus history size curve (SHARDS) */
+
+#ifndef __MRC_H
+#define __MRC_H
+
+#include <stdint.h>
+
+/* Default bound on the number of sampled fingerprints tracked */
+#define MRC_MAX_SAMPLES     8192
+
+/* Most that can be asked for (the index is sized to a power of two above
+ * twice the samples) */
+#define MRC_SAMPLES_LIMIT   (1 << 24)
+
+/* Sampling is done on a slice of the fingerprint modulo this */
+#define MRC_MODULUS         (1 << 24)
+
+/* Histogram of stack distances: MRC_SUB_BUCKETS per power of two */
+#define MRC_SUB_BITS        3
+#define MRC_SUB_BUCKETS     (1 << MRC_SUB_BITS)
+#define MRC_BUCKETS         (40 * MRC_SUB_BUCKETS)
+
+/* Non-zero if the curve is being computed (-mrc) */
+extern char gMissRatioCurve;
+
+/** Set up the sampler
+ * @param MaxSamples  Fingerprints tracked at most; memory stays bounded by it
+ * @returns 1 if successful, 0 otherwise
+ */
+char initializeMissRatio (uint32_t MaxSamples);
+
+/* Account for one payload reference (called with the table locked) */
+void recordMissRatio (uint64_t Fingerprint, uint32_t PayloadSize);
+
+/** Write the curve as CSV: history size (entries), hit ratio, byte hit ratio
+ * @returns 1 if successful, 0 otherwise
+ */
+char writeMissRatioCurve (const char * pFileName);
+
+#endif
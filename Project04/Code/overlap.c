@@ -0,0 +1,251 @@
+/* overlap.c : Which capture files share payloads with which (-overlap)
+ *
+ * Each table entry remembers the file it was retained from.  A hit adds to
+ * the (origin, current) cell of a sparse matrix kept as an open-addressed
+ * hash of the pairs seen so far, so the cost follows the hits rather than
+ * the number of files.  Hits already hold the table lock, which guards the
+ * matrix too.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "overlap.h"
+#include "pcap-process.h"
+#include "stats.h"
+
+struct OverlapPair
+{
+    /* Origin file in the high half, current file in the low; 0 if empty */
+    uint32_t    Key;
+    uint32_t    Hits;
+    uint64_t    Bytes;
+};
+
+char gOverlap = 0;
+uint16_t gOverlapFile = OVERLAP_SNAPSHOT;
+
+static struct OverlapPair *OverlapPairs = NULL;
+static uint32_t OverlapSlots = 0;
+static uint32_t OverlapUsed = 0;
+
+/* Names and parsed bytes of the files by index (0 is the snapshot) */
+static char **OverlapNames = NULL;
+static uint64_t *OverlapBytes = NULL;
+static int OverlapFiles = 0;
+static uint64_t OverlapMark = 0;
+static char OverlapSorted = 0;
+
+void initializeOverlap() { gOverlap = 1; }
+
+/* Close out the parsed bytes of the current file */
+static void markOverlapFile() {
+
+  if (OverlapFiles > 0) {
+    OverlapBytes[OverlapFiles - 1] += gPacketSeenBytes - OverlapMark;
+  }
+
+  OverlapMark = gPacketSeenBytes;
+}
+
+char beginOverlapFile(const char *pFileName) {
+
+  char **pNames;
+  uint64_t *pBytes;
+
+  if (OverlapFiles == 0) {
+    OverlapNames = (char **)malloc(sizeof(char *));
+    OverlapBytes = (uint64_t *)calloc(1, sizeof(uint64_t));
+
+    if (OverlapNames == NULL || OverlapBytes == NULL) {
+      printf("* Error: Unable to allocate the overlap matrix\n");
+      return 0;
+    }
+
+    OverlapNames[0] = strdup("(snapshot)");
+    OverlapFiles = 1;
+  }
+
+  markOverlapFile();
+
+  if (OverlapFiles > OVERLAP_MAX_FILES) {
+    return 1;
+  }
+
+  pNames = (char **)realloc(OverlapNames, sizeof(char *) * (OverlapFiles + 1));
+
+  if (pNames == NULL) {
+    printf("* Error: Unable to allocate the overlap matrix\n");
+    return 0;
+  }
+
+  OverlapNames = pNames;
+  pBytes = (uint64_t *)realloc(OverlapBytes,
+                               sizeof(uint64_t) * (OverlapFiles + 1));
+
+  if (pBytes == NULL) {
+    printf("* Error: Unable to allocate the overlap matrix\n");
+    return 0;
+  }
+
+  OverlapBytes = pBytes;
+  OverlapNames[OverlapFiles] = strdup(pFileName);
+  OverlapBytes[OverlapFiles] = 0;
+  gOverlapFile = (uint16_t)OverlapFiles;
+  OverlapFiles++;
+
+  return 1;
+}
+
+static struct OverlapPair *findPair(struct OverlapPair *pPairs, uint32_t Slots,
+                                    uint32_t Key) {
+
+  uint32_t j = (Key * 2654435761u) & (Slots - 1);
+
+  while (pPairs[j].Key != 0 && pPairs[j].Key != Key) {
+    j = (j + 1) & (Slots - 1);
+  }
+
+  return &pPairs[j];
+}
+
+/* Double the pairs once they are three quarters full */
+static char growPairs() {
+
+  uint32_t nSlots = OverlapSlots ? OverlapSlots * 2 : 256;
+  struct OverlapPair *pPairs;
+
+  pPairs = (struct OverlapPair *)calloc(nSlots, sizeof(struct OverlapPair));
+
+  if (pPairs == NULL) {
+    return 0;
+  }
+
+  for (uint32_t j = 0; j < OverlapSlots; j++) {
+    if (OverlapPairs[j].Key != 0) {
+      *findPair(pPairs, nSlots, OverlapPairs[j].Key) = OverlapPairs[j];
+    }
+  }
+
+  free(OverlapPairs);
+  OverlapPairs = pPairs;
+  OverlapSlots = nSlots;
+
+  return 1;
+}
+
+void countOverlap(uint16_t OriginFile, uint32_t Bytes) {
+
+  struct OverlapPair *pPair;
+  uint32_t nKey = (uint32_t)OriginFile << 16 | gOverlapFile;
+
+  if (OverlapUsed * 4 >= OverlapSlots * 3 && !growPairs()) {
+    return;
+  }
+
+  pPair = findPair(OverlapPairs, OverlapSlots, nKey);
+
+  if (pPair->Key == 0) {
+    pPair->Key = nKey;
+    OverlapUsed++;
+  }
+
+  pPair->Hits++;
+  pPair->Bytes += Bytes;
+}
+
+static int comparePairs(const void *a, const void *b) {
+
+  const struct OverlapPair *pA = (const struct OverlapPair *)a;
+  const struct OverlapPair *pB = (const struct OverlapPair *)b;
+
+  if (pA->Bytes != pB->Bytes) {
+    return pA->Bytes < pB->Bytes ? 1 : -1;
+  }
+
+  return pA->Key < pB->Key ? -1 : pA->Key > pB->Key;
+}
+
+/* Pack the used pairs to the front, most redundant bytes first */
+static void sortPairs() {
+
+  uint32_t nUsed = 0;
+
+  if (OverlapSorted) {
+    return;
+  }
+
+  OverlapSorted = 1;
+  markOverlapFile();
+
+  for (uint32_t j = 0; j < OverlapSlots; j++) {
+    if (OverlapPairs[j].Key != 0) {
+      OverlapPairs[nUsed++] = OverlapPairs[j];
+    }
+  }
+
+  qsort(OverlapPairs, nUsed, sizeof(struct OverlapPair), comparePairs);
+
+  /* The hash is gone; nothing is counted after the report */
+  OverlapSlots = nUsed;
+}
+
+void printOverlap() {
+
+  sortPairs();
+
+  printf("Payloads shared between files (%u pairs of %d files)\n", OverlapUsed,
+         OverlapFiles - 1);
+  printf("  %-28s %-28s %10s %15s %7s\n", "Retained From", "Hit In", "Hits",
+         "Redundant Bytes", "Of Hit");
+
+  for (uint32_t j = 0; j < OverlapSlots; j++) {
+    int nOrigin = OverlapPairs[j].Key >> 16;
+    int nCurrent = OverlapPairs[j].Key & 0xffff;
+
+    printf("  %3d %-24s %3d %-24s %10u %15lu %6.2f%%\n", nOrigin,
+           OverlapNames[nOrigin], nCurrent, OverlapNames[nCurrent],
+           OverlapPairs[j].Hits,
+           (unsigned long)OverlapPairs[j].Bytes,
+           OverlapBytes[nCurrent]
+               ? OverlapPairs[j].Bytes * 100.0 / OverlapBytes[nCurrent]
+               : 0.0);
+  }
+}
+
+char writeOverlap(const char *pFileName) {
+
+  FILE *pFile;
+
+  pFile = fopen(pFileName, "w");
+
+  if (pFile == NULL) {
+    printf("* Error: Unable to create the overlap file %s\n", pFileName);
+    return 0;
+  }
+
+  sortPairs();
+  fprintf(pFile, "origin,origin_file,hit,hit_file,hits,redundant_bytes,"
+                 "hit_file_bytes\n");
+
+  for (uint32_t j = 0; j < OverlapSlots; j++) {
+    int nOrigin = OverlapPairs[j].Key >> 16;
+    int nCurrent = OverlapPairs[j].Key & 0xffff;
+
+    fprintf(pFile, "%d,", nOrigin);
+    writeCsvText(pFile, OverlapNames[nOrigin]);
+    fprintf(pFile, ",%d,", nCurrent);
+    writeCsvText(pFile, OverlapNames[nCurrent]);
+    fprintf(pFile, ",%u,%lu,%lu\n", OverlapPairs[j].Hits,
+            (unsigned long)OverlapPairs[j].Bytes,
+            (unsigned long)OverlapBytes[nCurrent]);
+  }
+
+  fclose(pFile);
+
+  printf("Overlap matrix written to %s\n", pFileName);
+  return 1;
+}
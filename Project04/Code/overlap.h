@@ -0,0 +1,45 @@
+/* overlap.h : Which capture files share payloads with which (-overlap) */
+
+#ifndef __OVERLAP_H
+#define __OVERLAP_H
+
+#include <stdint.h>
+
+/* Origin of the entries warm-started from a snapshot; files count from 1 */
+#define OVERLAP_SNAPSHOT    0
+
+/* Files past this share the last index */
+#define OVERLAP_MAX_FILES   65535
+
+/* Non-zero if hits are being attributed to file pairs */
+extern char gOverlap;
+
+/* Index of the file being processed, stamped on the entries it retains */
+extern uint16_t gOverlapFile;
+
+/* Start attributing hits to file pairs */
+void initializeOverlap ();
+
+/** Note that a new file is about to be processed
+ * @param pFileName  Name of the capture file
+ * @returns 1 on success, 0 if out of memory
+ */
+char beginOverlapFile (const char * pFileName);
+
+/** Count a hit on an entry retained while processing another (or the same)
+ * file.  Called with the table lock held.
+ * @param OriginFile  The file that retained the entry
+ * @param Bytes       Size of the duplicate payload
+ */
+void countOverlap (uint16_t OriginFile, uint32_t Bytes);
+
+/* Print the file pairs with shared payloads, most redundant bytes first */
+void printOverlap ();
+
+/** Write every file pair with shared payloads as CSV
+ * @param pFileName  Where to write
+ * @returns 1 on success, 0 if the file could not be written
+ */
+char writeOverlap (const char * pFileName);
+
+#endif
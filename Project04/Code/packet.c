@@ -5,6 +5,23 @@
 
 #include "packet.h"
 
+/* Type / Len values of the frames that are parsed */
+#define ETHERTYPE_IPV4      0x0800
+#define ETHERTYPE_IPV6      0x86dd
+#define ETHERTYPE_VLAN      0x8100
+#define ETHERTYPE_QINQ      0x88a8
+#define ETHERTYPE_QINQ_OLD  0x9100
+
+/* IPv6 extension headers that are walked past */
+#define IPV6_HOP_BY_HOP     0
+#define IPV6_ROUTING        43
+#define IPV6_FRAGMENT       44
+#define IPV6_AH             51
+#define IPV6_DEST_OPTS      60
+
+/* Most VLAN tags and IPv6 extension headers looked at in a packet */
+#define PARSE_MAX_VLAN_TAGS     2
+#define PARSE_MAX_EXT_HEADERS   8
 
 
 struct Packet * allocatePacket (uint16_t DataSize)
@@ -39,6 +56,13 @@ struct Packet * allocatePacket (uint16_t DataSize)
     pPacket->PayloadOffset = 0;
     pPacket->PayloadSize = 0;
 
+    pPacket->Protocol = 0;
+    pPacket->SrcPort = 0;
+    pPacket->DstPort = 0;
+
+    pPacket->Fingerprinted = 0;
+    pPacket->Fingerprint = 0;
+
     return pPacket;
 }
 
@@ -54,3 +78,174 @@ void discardPacket (struct Packet * pPacket)
     /* Free up the actual struct itself */
     free(pPacket);
 }
+
+char parsePacketHeaders (struct Packet * pPacket, struct PacketHeaders * pHeaders)
+{
+    const uint8_t * pData = pPacket->Data;
+    uint32_t nLength = pPacket->LengthIncluded;
+    uint32_t nOffset;
+    uint32_t nL4;
+    uint32_t PayloadOffset;
+    uint16_t nType;
+    uint8_t  nProto;
+
+    pPacket->PayloadOffset = 0;
+    pPacket->PayloadSize = 0;
+    pPacket->Protocol = 0;
+    pPacket->SrcPort = 0;
+    pPacket->DstPort = 0;
+    pHeaders->Fragment = 0;
+
+    /* Ethernet, IPv4 and the smaller (UDP) transport header have to fit */
+    if(nLength < 14 + 20 + 8)
+    {
+        return PARSE_TOO_SHORT;
+    }
+
+    /* Skip the MACs and any VLAN tags, each 4 bytes in front of the real
+       Type / Len (802.1ad or the older 0x9100 outside, 802.1Q inside) */
+    nOffset = 12;
+    nType = pData[12] << 8 | pData[13];
+
+    for(int j = 0; j < PARSE_MAX_VLAN_TAGS && (nType == ETHERTYPE_VLAN ||
+        nType == ETHERTYPE_QINQ || nType == ETHERTYPE_QINQ_OLD); j++)
+    {
+        nOffset += 4;
+        nType = pData[nOffset] << 8 | pData[nOffset + 1];
+    }
+
+    nOffset += 2;
+    pHeaders->IPOffset = nOffset;
+
+    if(nType == ETHERTYPE_IPV4)
+    {
+        /* IHL counts 32 bit words, anything past 5 is options */
+        uint32_t nHeader = (pData[nOffset] & 0x0f) * 4;
+
+        if(nOffset + 20 > nLength || nOffset + nHeader > nLength)
+        {
+            return PARSE_TOO_SHORT;
+        }
+
+        if((pData[nOffset] >> 4) != 4 || nHeader < 20)
+        {
+            return PARSE_NOT_IP;
+        }
+
+        pHeaders->IPVersion = 4;
+        pHeaders->Fragment = ((pData[nOffset + 6] & 0x1f) |
+                              pData[nOffset + 7]) != 0;
+        nProto = pData[nOffset + 9];
+        nL4 = nOffset + nHeader;
+    }
+    else if(nType == ETHERTYPE_IPV6)
+    {
+        if(nOffset + 40 > nLength)
+        {
+            return PARSE_TOO_SHORT;
+        }
+
+        if((pData[nOffset] >> 4) != 6)
+        {
+            return PARSE_NOT_IP;
+        }
+
+        pHeaders->IPVersion = 6;
+        nProto = pData[nOffset + 6];
+        nL4 = nOffset + 40;
+
+        /* Walk the extension headers up to the transport one (ESP, no next
+           header or anything unknown ends the walk) */
+        for(int j = 0; j < PARSE_MAX_EXT_HEADERS; j++)
+        {
+            uint32_t nExtLength;
+
+            if(nProto != IPV6_HOP_BY_HOP && nProto != IPV6_ROUTING &&
+               nProto != IPV6_DEST_OPTS && nProto != IPV6_FRAGMENT &&
+               nProto != IPV6_AH)
+            {
+                break;
+            }
+
+            /* Every extension header is at least 8 bytes */
+            if(nL4 + 8 > nLength)
+            {
+                return PARSE_TOO_SHORT;
+            }
+
+            if(nProto == IPV6_FRAGMENT)
+            {
+                pHeaders->Fragment = ((pData[nL4 + 2] << 8 |
+                                       pData[nL4 + 3]) & 0xfff8) != 0;
+                nExtLength = 8;
+            }
+            else if(nProto == IPV6_AH)
+            {
+                nExtLength = (pData[nL4 + 1] + 2) * 4;
+            }
+            else
+            {
+                nExtLength = (pData[nL4 + 1] + 1) * 8;
+            }
+
+            nProto = pData[nL4];
+            nL4 += nExtLength;
+        }
+    }
+    else
+    {
+        return PARSE_NOT_IP;
+    }
+
+    pHeaders->L4Offset = nL4;
+    pPacket->Protocol = nProto;
+
+    /* Is this a UDP packet or a TCP packet? */
+    if(nProto != 6 && nProto != 17)
+    {
+        /* Don't know what this protocol is - probably not helpful */
+        return PARSE_OTHER_PROTO;
+    }
+
+    if(pHeaders->Fragment)
+    {
+        /* The transport header went out with the first fragment */
+        PayloadOffset = nL4;
+    }
+    else if(nProto == 6)
+    {
+        /* TCP - data offset is the upper nibble of byte 12 of its header */
+        if(nL4 + 20 > nLength)
+        {
+            return PARSE_TOO_SHORT;
+        }
+
+        PayloadOffset = nL4 + (pData[nL4 + 12] >> 4) * 4;
+    }
+    else
+    {
+        /* UDP - 8 bytes */
+        if(nL4 + 8 > nLength)
+        {
+            return PARSE_TOO_SHORT;
+        }
+
+        PayloadOffset = nL4 + 8;
+    }
+
+    /* Both TCP and UDP lead with the source and destination ports */
+    if(!pHeaders->Fragment)
+    {
+        pPacket->SrcPort = pData[nL4] << 8 | pData[nL4 + 1];
+        pPacket->DstPort = pData[nL4 + 2] << 8 | pData[nL4 + 3];
+    }
+
+    /* A payload may well be empty if the headers cover the whole packet */
+    if(PayloadOffset < nLength)
+    {
+        pPacket->PayloadOffset = PayloadOffset;
+        pPacket->PayloadSize = nLength - PayloadOffset;
+    }
+
+    return PARSE_OK;
+}
@@ -39,11 +39,46 @@ struct Packet
 
     /* Size of the payload */
     uint32_t    PayloadSize;
+
+    /* IP protocol (6 for TCP, 17 for UDP) and ports of the payload */
+    uint8_t     Protocol;
+    uint16_t    SrcPort;
+    uint16_t    DstPort;
+
+    /* Fingerprint of the payload if taken ahead of the table (Fingerprinted
+     * non-zero), see fingerprintPacket */
+    char        Fingerprinted;
+    uint64_t    Fingerprint;
+};
+
+/* Results of parsePacketHeaders */
+#define PARSE_OK            0
+#define PARSE_TOO_SHORT     1
+#define PARSE_NOT_IP        2
+#define PARSE_OTHER_PROTO   3
+
+/* Where the headers of a parsed packet are */
+struct PacketHeaders
+{
+    uint32_t    IPOffset;
+    uint32_t    L4Offset;
+
+    /* 4 or 6 */
+    uint8_t     IPVersion;
+
+    /* Non-zero for a fragment past the first, which has no transport
+     * header (L4Offset is where its share of the payload starts, and the
+     * ports are zero) */
+    char        Fragment;
 };
 
 /* Helper to do the endian magic fix */
-#define endianfixs(A) ((((uint16_t)(A) & 0xff00) >> 8))
-#define endianfixl(A) ((((uint32_t)(A) & 0xff000000) >> 24))
+#define endianfixs(A) ((uint16_t)((((uint16_t)(A) & 0xff00) >> 8) | \
+                                  (((uint16_t)(A) & 0x00ff) << 8)))
+#define endianfixl(A) ((((uint32_t)(A) & 0xff000000) >> 24) | \
+                       (((uint32_t)(A) & 0x00ff0000) >> 8) |  \
+                       (((uint32_t)(A) & 0x0000ff00) << 8) |  \
+                       (((uint32_t)(A) & 0x000000ff) << 24))
 
 /* Allocate a new packet structure with the specified data buffer size */
 struct Packet * allocatePacket (uint16_t DataSize);
@@ -51,5 +86,16 @@ struct Packet * allocatePacket (uint16_t DataSize);
 /* Discard the packet and free back up the memory */
 void discardPacket (struct Packet * pPacket);
 
+/** Locate the TCP or UDP payload of an Ethernet frame without touching any
+ * of the counters or the table.  Up to two VLAN tags (802.1Q and 802.1ad
+ * QinQ), IPv4 with options and IPv6 with extension headers are walked in
+ * one pass.  PayloadOffset and PayloadSize are filled in (zero size if the
+ * headers cover the whole packet), as are the protocol and the ports.
+ * @param pPacket   The packet to parse
+ * @param pHeaders  Filled in with the header locations on success
+ * @returns PARSE_OK if the packet can be analyzed, a PARSE_ reason otherwise
+ */
+char parsePacketHeaders (struct Packet * pPacket, struct PacketHeaders * pHeaders);
+
 
-#endif
\ No newline at end of file
+#endif
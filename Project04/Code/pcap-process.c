@@ -1,29 +1,49 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
 // Include Spooky Hash V2 Algorithm to implement fast and efficient hashing in
 // our solution
+#include "breakdown.h"
+#include "flow.h"
+#include "history.h"
+#include "horizon.h"
+#include "hugepage.h"
+#include "mrc.h"
+#include "overlap.h"
 #include "pcap-process.h"
+#include "progress.h"
+#include "sample.h"
 #include "spooky.h"
+#include "stages.h"
+#include "stats.h"
+#include "state.h"
+#include "topk.h"
 
 // Max number of files that can be read, and max length each file can be
 #define MAX_SIZE 100
 #define MAX_LENGTH 100
 
 /* How many packets have we seen? */
-uint32_t gPacketSeenCount;
+uint64_t gPacketSeenCount;
 
 /* How many total bytes have we seen? */
 uint64_t gPacketSeenBytes;
 
 /* How many hits have we had? */
-uint32_t gPacketHitCount;
+uint64_t gPacketHitCount;
 
 /* How much redundancy have we seen? */
 uint64_t gPacketHitBytes;
 
-/* Our big table for recalling packets */
+/* Is the table changed in read order? */
+char gDeterministic = 0;
+
+/* The engine payloads are looked up in */
+struct RedEngine *gEngine;
+
+/* Our big table for recalling packets (the engine's table) */
 struct PacketEntry *BigTable;
 int BigTableSize;
 int BigTableNextToReplace;
@@ -41,8 +61,8 @@ char initializeProcessing(int TableSize) {
   initializeProcessingStats();
 
   /* Allocate our big table */
-  BigTable =
-      (struct PacketEntry *)malloc(sizeof(struct PacketEntry) * TableSize);
+  BigTable = (struct PacketEntry *)allocateLarge(sizeof(struct PacketEntry) *
+                                                 TableSize);
 
   if (BigTable == NULL) {
 
@@ -55,8 +75,44 @@ char initializeProcessing(int TableSize) {
     BigTable[j].ThePacket = NULL;
     BigTable[j].HitCount = 0;
     BigTable[j].RedundantBytes = 0;
+    BigTable[j].Fingerprint = 0;
+    BigTable[j].PayloadSize = 0;
+    BigTable[j].OriginFile = 0;
+    BigTable[j].ArenaOffset = 0;
+    BigTable[j].Compressed = NULL;
+    BigTable[j].CompressedSize = 0;
+  }
+
+  return attachProcessingTable(BigTable, TableSize);
+}
+
+/* The engine hooks of the CLI, which has just the one engine */
+static uint8_t *hookEntryPayload(struct RedEngine *pEngine,
+                                 struct PacketEntry *pEntry, void *UserData) {
+  return getEntryPayload(pEntry);
+}
+
+static void hookEvictEntry(struct RedEngine *pEngine, int nEntry,
+                           void *UserData) {
+  resetAndSaveEntry(nEntry);
+}
+
+static const struct RedHooks ProcessingHooks = {
+    hookEntryPayload, hookEvictEntry, stageClock, NULL};
+
+char attachProcessingTable(struct PacketEntry *pTable, int TableSize) {
+
+  gEngine = createEngineOn(pTable, TableSize);
+
+  if (gEngine == NULL) {
+    printf("* Error: Unable to create the engine\n");
+    return 0;
   }
 
+  // Payloads may be compressed or in a snapshot, and evictions are counted
+  setEngineHooks(gEngine, &ProcessingHooks);
+
+  BigTable = pTable;
   BigTableSize = TableSize;
   BigTableNextToReplace = 0;
   return 1;
@@ -72,24 +128,64 @@ void resetAndSaveEntry(int nEntry) {
     return;
   }
 
-  if (BigTable[nEntry].ThePacket == NULL) {
+  if (BigTable[nEntry].PayloadSize == 0) {
     return;
   }
 
+  if (gHorizonMs) {
+    dropHorizon(nEntry);
+  }
+
   gPacketHitCount += BigTable[nEntry].HitCount;
   gPacketHitBytes += BigTable[nEntry].RedundantBytes;
-  discardPacket(BigTable[nEntry].ThePacket);
 
-  BigTable[nEntry].HitCount = 0;
-  BigTable[nEntry].RedundantBytes = 0;
-  BigTable[nEntry].ThePacket = NULL;
+  if (gSampleRate > 1) {
+    sampleEntry(BigTable[nEntry].Fingerprint,
+                BigTable[nEntry].RedundantBytes);
+  }
+
+  if (BigTable[nEntry].Compressed != NULL) {
+    releaseEntry(&BigTable[nEntry]);
+  }
+
+  // Warm-started entries have no packet, their bytes stay in the snapshot
+  emptyEngineEntry(gEngine, nEntry);
 }
 
-void processPacket(struct Packet *pPacket) {
+uint8_t *getEntryPayload(struct PacketEntry *pEntry) {
+
+  if (pEntry->Compressed != NULL) {
+    return expandEntry(pEntry);
+  }
+
+  if (pEntry->ThePacket != NULL) {
+    return pEntry->ThePacket->Data + pEntry->ThePacket->PayloadOffset;
+  }
+
+  return getStateArena() + pEntry->ArenaOffset;
+}
+
+void fingerprintPacket(struct Packet *pPacket) {
+
+  struct PacketHeaders headers;
+
+  /* Only what processPacket would hand to processPayload as is */
+  if (pPacket->LengthIncluded <= MIN_PKT_SIZE ||
+      parsePacketHeaders(pPacket, &headers) != PARSE_OK ||
+      pPacket->PayloadSize == 0 ||
+      (gFlowReassembly && pPacket->Protocol == 6 && !headers.Fragment)) {
+    return;
+  }
+
+  pPacket->Fingerprint = spooky_hash64(pPacket->Data + pPacket->PayloadOffset,
+                                       pPacket->PayloadSize, FINGERPRINT_SEED);
+  pPacket->Fingerprinted = 1;
+}
 
-  uint16_t PayloadOffset;
+void processPacket(struct Packet *pPacket) {
 
-  PayloadOffset = 0;
+  struct PacketHeaders headers;
+  char nResult;
 
   /* Do a bit of error checking */
   if (pPacket == NULL) {
@@ -117,136 +213,137 @@ void processPacket(struct Packet *pPacket) {
   gPacketSeenCount++;
   gPacketSeenBytes += pPacket->LengthIncluded;
 
-  /* Is this an IP packet (Layer 2 - Type / Len == 0x0800)? */
-
-  if (pPacket->LengthIncluded <= MIN_PKT_SIZE) {
-
-    discardPacket(pPacket);
-    return;
+  if (gProgressOn) {
+    countProgressPacket(pPacket->LengthIncluded);
   }
 
-  if ((pPacket->Data[12] != 0x08) || (pPacket->Data[13] != 0x00)) {
+  /* The flow stage needs the small segments too */
+  if (pPacket->LengthIncluded <= MIN_PKT_SIZE && !gFlowReassembly) {
 
-    // printf("Not IP - ignoring...\n");
     discardPacket(pPacket);
     return;
   }
 
-  /* Adjust the payload offset to skip the Ethernet header
-      Destination MAC (6 bytes), Source MAC (6 bytes), Type/Len (2 bytes) */
-  PayloadOffset += 14;
+  /* Step 2: Figure out where the payload starts */
+  nResult = parsePacketHeaders(pPacket, &headers);
 
-  /* Step 2: Figure out where the payload starts
-       IP Header - Look at the first byte (Version / Length)
-       UDP - 8 bytes
-       TCP - Look inside header */
-
-  if (pPacket->Data[PayloadOffset] != 0x45) {
-
-    /* Not an IPv4 packet - skip it since it is IPv6 */
-    printf("  Not IPV4 - Ignoring\n");
+  if (nResult != PARSE_OK) {
     discardPacket(pPacket);
     return;
-
-  } else {
-    /* Offset will jump over the IPv4 header eventually (+20 bytes)*/
   }
 
-  /* Is this a UDP packet or a TCP packet? */
-  if (pPacket->Data[PayloadOffset + 9] == 6) {
-    /* TCP */
-    uint8_t TCPHdrSize;
-
-    TCPHdrSize = ((uint8_t)pPacket->Data[PayloadOffset + 9 + 12] >> 4) * 4;
-    PayloadOffset += 20 + TCPHdrSize;
-  } else if (pPacket->Data[PayloadOffset + 9] == 17) {
-    /* UDP */
-
-    /* Increment the offset by 28 bytes (20 for IPv4 header, 8 for the UDP
-     * header)*/
-    PayloadOffset += 28;
-  } else {
-    /* Don't know what this protocol is - probably not helpful */
-    discardPacket(pPacket);
+  /* Reassemble the stream instead if asked to (the flow stage takes over
+   * the packet from here, except for a later fragment with no TCP header) */
+  if (gFlowReassembly && pPacket->Protocol == 6 && !headers.Fragment) {
+    processFlowSegment(pPacket, headers.IPOffset, headers.L4Offset);
     return;
   }
 
   // printf("  processPacket -> Found an IP packet that is TCP or UDP\n");
 
-  uint16_t NetPayload;
+  /* Nothing worth comparing */
+  if (pPacket->LengthIncluded <= MIN_PKT_SIZE || pPacket->PayloadSize == 0) {
+    discardPacket(pPacket);
+    return;
+  }
 
-  NetPayload = pPacket->LengthIncluded - PayloadOffset;
+  processPayload(pPacket);
+}
 
-  pPacket->PayloadOffset = PayloadOffset;
-  pPacket->PayloadSize = NetPayload;
+void processPayload(struct Packet *pPacket) {
 
   /* Step 2: Do any packet payloads match up? */
   // In this section of the code, we'll begin doing the hashing to increase
   // efficiency
 
-  // Initialize j for indexing and the hash value
+  // Initialize j for indexing and the fingerprint of the payload
   int j;
   uint64_t hashValue;
+  uint64_t nStart;
+  uint8_t *pPayload = pPacket->Data + pPacket->PayloadOffset;
+  struct RedLookup lookup;
+
+  // Age out whatever was last seen more than the horizon ago
+  if (gHorizonMs) {
+    advanceHorizon(pPacket);
+  }
 
   // Calculate the hash value for the packet payload using the Spooky Hash V2
   // Algorithm
-  spooky_hash128(pPacket->Data + PayloadOffset, pPacket->PayloadSize,
-                 &hashValue, &hashValue);
+  nStart = stageClock();
+  hashValue = pPacket->Fingerprinted
+                  ? pPacket->Fingerprint
+                  : spooky_hash64(pPayload, pPacket->PayloadSize,
+                                  FINGERPRINT_SEED);
+  recordStage(STAGE_HASH, nStart);
+
+  // Feed the history size curve before the table decides hit or miss
+  if (gMissRatioCurve) {
+    recordMissRatio(hashValue, pPacket->PayloadSize);
+  }
 
-  // Index into the big table using the hash value
-  j = hashValue % BigTableSize;
+  // Index into the big table using the hash value (evicting an older
+  // payload in the entry through resetAndSaveEntry)
+  nStart = stageClock();
+  lookupEngine(gEngine, pPacket, hashValue, &lookup);
+  j = lookup.Entry;
+
+  // The slot check up to a byte compare, then the compare itself
+  if (lookup.CompareEnd != 0) {
+    recordStageSpan(STAGE_LOOKUP, nStart, lookup.CompareStart);
+    recordStageSpan(STAGE_COMPARE, lookup.CompareStart, lookup.CompareEnd);
+    nStart = lookup.CompareEnd;
+  }
 
-  if (BigTable[j].ThePacket != NULL) {
+  // Then the eviction and insert of a miss
+  if (!lookup.Hit) {
+    recordStage(STAGE_LOOKUP, nStart);
+  }
 
-    int k;
+  if (lookup.Hit) {
 
-    /* Are the sizes the same? */
-    if (BigTable[j].ThePacket->PayloadSize == pPacket->PayloadSize) {
+    /* Whoot, whoot - the payloads match up */
+    countStatsHit(pPacket->PayloadSize);
 
-      /* OK - same size - do the bytes match up? */
-      // if (memcmp(&BigTable[j].ThePacket->Data[PayloadOffset],
-      // &pPacket->Data[PayloadOffset], NetPayload))
-      for (k = 0; k < BigTable[j].ThePacket->PayloadSize; k++) {
-        if (BigTable[j].ThePacket->Data[k + PayloadOffset] !=
-            pPacket->Data[k + PayloadOffset]) {
-          /* Nope - they are not the same */
-          break;
-        }
-      }
+    if (gProgressOn) {
+      countProgressHit(pPacket->PayloadSize);
+    }
 
-      /* Did we break out with a mismatch? */
-      if (k < BigTable[j].ThePacket->PayloadSize) {
+    if (gHorizonMs) {
+      touchHorizon(j, pPacket, 1);
+    }
 
-        /* Whoot, whoot - the payloads match up */
-        BigTable[j].HitCount++;
-        BigTable[j].RedundantBytes += pPacket->PayloadSize;
+    if (gTopK) {
+      countTopK(hashValue, pPacket);
+    }
 
-        /* The packets match so get rid of the matching one */
-        discardPacket(pPacket);
-        return;
-      }
+    if (gBreakdown) {
+      countBreakdown(pPacket, 1);
     }
 
-  } else {
+    if (gOverlap) {
+      countOverlap(BigTable[j].OriginFile, pPacket->PayloadSize);
+    }
 
-    /* We made it to an empty entry without a match */
-    BigTable[j].ThePacket = pPacket;
-    BigTable[j].HitCount = 0;
-    BigTable[j].RedundantBytes = 0;
+    /* The packets match so get rid of the matching one */
+    discardPacket(lookup.Drop);
+    return;
   }
 
-  /* Did we search the entire table and find no matches? */
-  if (j == BigTableSize) {
+  if (gBreakdown) {
+    countBreakdown(pPacket, 0);
+  }
 
-    /* Kick out the "oldest" entry by saving its entry to the global counters
-     * and free up that packet allocation */
-    resetAndSaveEntry(BigTableNextToReplace);
+  /* The entry took ownership of the packet */
+  BigTable[j].OriginFile = gOverlapFile;
 
-    /* Take ownership of the packet */
-    BigTable[BigTableNextToReplace].ThePacket = pPacket;
+  if (gHorizonMs) {
+    touchHorizon(j, pPacket, 0);
+  }
 
-    /* Rotate to the next one to replace */
-    BigTableNextToReplace = (BigTableNextToReplace + 1) % BigTableSize;
+  // Swap the packet for its compressed payload once nothing needs it
+  if (gCompressHistory) {
+    compressEntry(&BigTable[j]);
   }
 
   /* All done */
@@ -257,4 +354,8 @@ void tallyProcessing() {
   for (int j = 0; j < BigTableSize; j++) {
     resetAndSaveEntry(j);
   }
+
+  if (gBreakdown) {
+    tallyBreakdown();
+  }
 }
\ No newline at end of file
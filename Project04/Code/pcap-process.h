@@ -5,46 +5,71 @@
 
 #include <stdint.h>
 
+#include "engine.h"
 #include "packet.h"
 
 #define DEFAULT_TABLE_SIZE  40000
-#define MIN_PKT_SIZE        128
 
 /* Global Counters for Summary */
 
 /* How many packets have we seen? */
-extern uint32_t        gPacketSeenCount;
+extern uint64_t        gPacketSeenCount;
 
 /* How many total bytes have we seen? */
 extern uint64_t        gPacketSeenBytes;        
 
 /* How many hits have we had? */
-extern uint32_t        gPacketHitCount;
+extern uint64_t        gPacketHitCount;
 
 /* How much redundancy have we seen? */
 extern uint64_t        gPacketHitBytes;
 
-/* Simple data structure for tracking redundancy */
-struct PacketEntry
-{
-    struct Packet * ThePacket;
 
-    /* How many times has this been a hit? */
-    uint32_t        HitCount;
+/* Non-zero if the table is changed in the order packets were read
+ * (-deterministic), whatever the number of consumers */
+extern char     gDeterministic;
 
-    /* How much data would we have saved? */
-    uint32_t        RedundantBytes;
-};
+/* The engine payloads are looked up in, with the CLI's hooks */
+extern struct RedEngine *      gEngine;
 
-/* Our big table for recalling packets */
+/* Our big table for recalling packets (the engine's table) */
 extern struct PacketEntry *    BigTable; 
 extern int    BigTableSize;
 extern int    BigTableNextToReplace;
 
 char initializeProcessing (int TableSize);
 
+/** Look up payloads in a table that is already filled in (a snapshot)
+ * @param pTable     The table, with every entry empty or holding a payload
+ * @param TableSize  Number of entries in it
+ * @returns 1 if successful, 0 otherwise
+ */
+char attachProcessingTable (struct PacketEntry * pTable, int TableSize);
+
+/* Reset the global counters to zero */
+void initializeProcessingStats ();
+
+/* Fold the counters of an entry into the globals and empty it */
+void resetAndSaveEntry (int nEntry);
+
+/* Get a pointer to the payload bytes retained by a table entry */
+uint8_t * getEntryPayload (struct PacketEntry * pEntry);
+
+/** Fingerprint the payload of a packet that processPacket would look up,
+ * so that -deterministic can hash outside the table lock.  Touches nothing
+ * but the packet.
+ * @param pPacket  The packet as read
+ */
+void fingerprintPacket (struct Packet * pPacket);
+
 void processPacket (struct Packet * pPacket);
 
+/** Look up a parsed payload (PayloadOffset and PayloadSize set) in BigTable
+ * and either count it as a hit or retain it.  Takes ownership of the packet.
+ * @param pPacket  The packet or reassembled chunk to look up
+ */
+void processPayload (struct Packet * pPacket);
+
 void tallyProcessing ();
 
 #endif
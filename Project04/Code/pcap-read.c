@@ -13,9 +13,16 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+#include "decompress.h"
+#include "filter.h"
 #include "packet.h"
 #include "pcap-process.h"
 #include "pcap-read.h"
+#include "progress.h"
+#include "sample.h"
+#include "stages.h"
+#include "stats.h"
+#include "steal.h"
 
 #define SHOW_DEBUG 0
 
@@ -26,10 +33,27 @@
 // Share variables as external variables
 extern struct Packet *StackObjects[];
 extern int StackNum;
+extern int StackHead;
 extern pthread_mutex_t LockStack;
 extern pthread_cond_t PushCond;
 extern pthread_cond_t PopCond;
 
+/* Skip ahead by reading since a decompressed capture cannot seek */
+static void skipBytes(FILE *pTheFile, uint32_t nBytes) {
+
+  char pScratch[256];
+
+  while (nBytes > 0) {
+    uint32_t nChunk = nBytes < sizeof(pScratch) ? nBytes : sizeof(pScratch);
+
+    if (fread(pScratch, 1, nChunk, pTheFile) != nChunk) {
+      return;
+    }
+
+    nBytes -= nChunk;
+  }
+}
+
 char parsePcapFileStart(FILE *pTheFile, struct FilePcapInfo *pFileInfo) {
 
   // Check if the file pointer is null
@@ -100,8 +124,7 @@ char parsePcapFileStart(FILE *pTheFile, struct FilePcapInfo *pFileInfo) {
   }
 
   // Ignore time zone and TZ accuracy
-  fseek(pTheFile, 4, SEEK_CUR);
-  fseek(pTheFile, 4, SEEK_CUR);
+  skipBytes(pTheFile, 8);
 
   fread((char *)&nSnapshotLen, 4, 1, pTheFile);
   fread((char *)&nMediumType, 4, 1, pTheFile);
@@ -166,10 +189,10 @@ struct Packet *readNextPacket(FILE *pTheFile, struct FilePcapInfo *pFileInfo) {
     printf("* Warning: Unable to include packet of size %d due it exceeding %d "
            "bytes\n",
            pPacket->LengthIncluded, pPacket->SizeDataMax);
-    discardPacket(pPacket);
 
     /* Skip this packet payload */
-    fseek(pTheFile, pPacket->LengthIncluded, SEEK_CUR);
+    skipBytes(pTheFile, pPacket->LengthIncluded);
+    discardPacket(pPacket);
     return NULL;
   }
 
@@ -202,36 +225,92 @@ char readPcapFile(struct FilePcapInfo *pFileInfo) {
   pFileInfo->Packets = 0;
   pFileInfo->BytesRead = 0;
 
-  /* Open the file and its respective front matter */
-  pTheFile = fopen(pFileInfo->FileName, "r");
+  /* Open the file (decompressing it if need be) and its front matter */
+  pTheFile = openCapture(pFileInfo->FileName);
 
   /* Read the front matter */
   if (!parsePcapFileStart(pTheFile, pFileInfo)) {
     printf("* Error: Failed to parse front matter on pcap file %s\n",
            pFileInfo->FileName);
+
+    // Also stops the decompression threads of a compressed capture
+    if (pTheFile != NULL) {
+      fclose(pTheFile);
+    }
+
     return 0;
   }
 
+  if (gProgressOn) {
+    beginProgressFile();
+  }
+
   while (!feof(pTheFile)) {
+    uint64_t nStart = stageClock();
+
     pPacket = readNextPacket(pTheFile, pFileInfo);
+    nStart = recordStage(STAGE_READ, nStart);
+
+    if (pPacket != NULL && gProgressOn) {
+      tickProgress(pPacket);
+    }
+
+    // Drop packets the filter rejects before they are queued
+    if (pPacket != NULL && gFilterOn && !filterPacket(pPacket)) {
+      discardPacket(pPacket);
+      pPacket = NULL;
+    }
+
+    // Drop packets outside the sample before anyone hashes them
+    if (pPacket != NULL && gSampleRate > 1 && !samplePacket(pPacket)) {
+      discardPacket(pPacket);
+      pPacket = NULL;
+    }
+
+    // With -steal the packet joins a batch for the next consumer in turn
+    if (pPacket != NULL && gStealOn) {
+      uint32_t nLength = pPacket->LengthIncluded;
+      uint64_t nStall;
+      int nDepth = queueStealPacket(pPacket, &nStall);
+
+      recordStage(STAGE_ENQUEUE_WAIT, nStart);
+      tickStatsReader(nLength, nDepth, nStall);
+    } else if (pPacket != NULL) {
+      uint64_t nStall = 0;
+      uint32_t nLength = pPacket->LengthIncluded;
+      int nDepth;
 
-    if (pPacket != NULL) {
       pthread_mutex_lock(&LockStack);
 
+      // Only a full queue stalls the reader, so only then is it timed
+      if (StackNum >= MAX_SIZE) {
+        nStall = statsClock();
+      }
+
       // Check if stack is full, if so, send wait condition
       while (StackNum >= MAX_SIZE) {
         pthread_cond_wait(&PushCond, &LockStack);
       }
 
-      // Push the packet to the global stack
-      StackObjects[StackNum] = pPacket;
+      if (nStall) {
+        nStall = statsClock() - nStall;
+      }
+
+      recordStage(STAGE_ENQUEUE_WAIT, nStart);
+
+      // Push the packet to the global stack (behind the newest one)
+      StackObjects[(StackHead + StackNum) % MAX_SIZE] = pPacket;
       StackNum++;
+      nDepth = StackNum;
 
       // Send signal that a packet should be popped
       pthread_cond_signal(&PopCond);
 
       // Unlock the stack lock
       pthread_mutex_unlock(&LockStack);
+
+      // The packet belongs to the consumers now
+      tickStatsReader(nLength, nDepth, nStall);
     }
 
     /* Allow for an early bail out if specified */
@@ -242,6 +321,14 @@ char readPcapFile(struct FilePcapInfo *pFileInfo) {
     }
   }
 
+  if (gStealOn) {
+    flushStealBatch();
+  }
+
+  if (gProgressOn) {
+    endProgressFile();
+  }
+
   fclose(pTheFile);
 
   printf("File processing complete - %s file read containing %d packets with "
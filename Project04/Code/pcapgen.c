@@ -0,0 +1,347 @@
+/* pcapgen.c : Synthetic pcap generator for benchmarking redextract
+ *
+ * Writes Ethernet / IPv4 / UDP or TCP packets with a chosen packet-size
+ * distribution, protocol mix and redundancy.  A packet is either
+ *
+ *  - an exact repeat of a payload from the recent pool (-exact),
+ *  - a partial repeat: a pooled payload with its tail rewritten (-partial),
+ *  - or fresh random bytes,
+ *
+ * and every payload written joins the pool, so the mix of repeats is known
+ * up front and the output is reproducible for a given -seed.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Ethernet + IPv4 + the smaller transport header (UDP) */
+#define GEN_HDR_UDP         (14 + 20 + 8)
+#define GEN_HDR_TCP         (14 + 20 + 20)
+#define GEN_MAX_FRAME       1514
+
+/* Payloads kept for repeats */
+#define GEN_POOL_SIZE       4096
+
+/* Sizes of the distribution */
+#define GEN_SIZES_FIXED     0
+#define GEN_SIZES_UNIFORM   1
+#define GEN_SIZES_IMIX      2
+
+struct GenOptions
+{
+    uint64_t    TargetBytes;
+    uint64_t    TargetPackets;
+    int         SizeKind;
+    int         SizeMin;
+    int         SizeMax;
+    double      TcpShare;
+    double      ExactShare;
+    double      PartialShare;
+    double      PartialTail;
+    double      PoolSkew;
+    uint64_t    Seed;
+};
+
+struct GenPayload
+{
+    uint16_t    Size;
+    uint8_t     Data[GEN_MAX_FRAME];
+};
+
+static uint64_t RandomState;
+
+/* xorshift64* - fast and good enough for traffic */
+static uint64_t nextRandom() {
+
+  RandomState ^= RandomState >> 12;
+  RandomState ^= RandomState << 25;
+  RandomState ^= RandomState >> 27;
+  return RandomState * 0x2545f4914f6cdd1dULL;
+}
+
+static double nextUnit() {
+
+  return (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void fillRandom(uint8_t *pData, int Length) {
+
+  for (int j = 0; j < Length; j += 8) {
+    uint64_t nBits = nextRandom();
+    int nTake = Length - j < 8 ? Length - j : 8;
+
+    memcpy(pData + j, &nBits, nTake);
+  }
+}
+
+static int pickFrameSize(struct GenOptions *pOptions) {
+
+  double nDraw;
+
+  switch (pOptions->SizeKind) {
+  case GEN_SIZES_UNIFORM:
+    return pOptions->SizeMin +
+           (int)(nextRandom() % (pOptions->SizeMax - pOptions->SizeMin + 1));
+
+  case GEN_SIZES_IMIX:
+    /* The simple IMIX: 7 x 64, 4 x 576 and 1 x 1500 byte frames */
+    nDraw = nextUnit() * 12;
+    return nDraw < 7 ? 64 : nDraw < 11 ? 576 : 1500;
+
+  default:
+    return pOptions->SizeMin;
+  }
+}
+
+/* Pick a pooled payload, favouring recent ones as the skew grows */
+static int pickPooled(struct GenOptions *pOptions, int PoolCount, int PoolNext) {
+
+  double nAge = pow(nextUnit(), pOptions->PoolSkew) * PoolCount;
+
+  return (PoolNext - 1 - (int)nAge + GEN_POOL_SIZE) % GEN_POOL_SIZE;
+}
+
+static void writeLong(FILE *pFile, uint32_t Value) {
+
+  fwrite(&Value, sizeof(uint32_t), 1, pFile);
+}
+
+static void writeShort(FILE *pFile, uint16_t Value) {
+
+  fwrite(&Value, sizeof(uint16_t), 1, pFile);
+}
+
+static void writeFileHeader(FILE *pFile) {
+
+  writeLong(pFile, 0xa1b2c3d4);
+  writeShort(pFile, 2);
+  writeShort(pFile, 4);
+  writeLong(pFile, 0);
+  writeLong(pFile, 0);
+  writeLong(pFile, 65535);
+  writeLong(pFile, 1);
+}
+
+/* Write one frame carrying pPayload */
+static void writeFrame(FILE *pFile, uint64_t Index, char Tcp,
+                       struct GenPayload *pPayload) {
+
+  uint8_t frame[GEN_MAX_FRAME + GEN_HDR_TCP];
+  int nHeader = Tcp ? GEN_HDR_TCP : GEN_HDR_UDP;
+  int nLength = nHeader + pPayload->Size;
+  uint16_t nFlow = 1024 + Index % 64;
+
+  memset(frame, 0, nHeader);
+
+  /* Ethernet: locally administered MACs, IPv4 */
+  frame[0] = 0x02;
+  frame[6] = 0x02;
+  frame[11] = 1;
+  frame[12] = 0x08;
+
+  /* IPv4 without options */
+  frame[14] = 0x45;
+  frame[16] = (nLength - 14) >> 8;
+  frame[17] = (nLength - 14) & 0xff;
+  frame[22] = 64;
+  frame[23] = Tcp ? 6 : 17;
+  frame[26] = 10;
+  frame[29] = 1;
+  frame[30] = 10;
+  frame[33] = 2;
+
+  /* Ports are the same place for both */
+  frame[34] = nFlow >> 8;
+  frame[35] = nFlow & 0xff;
+  frame[36] = Tcp ? 0 : 0x08;
+  frame[37] = Tcp ? 80 : 0x01;
+
+  if (Tcp) {
+    /* Sequence number keeps moving, data offset of five words, PSH ACK */
+    frame[38] = Index >> 24;
+    frame[39] = Index >> 16;
+    frame[40] = Index >> 8;
+    frame[41] = Index;
+    frame[46] = 5 << 4;
+    frame[47] = 0x18;
+  } else {
+    frame[38] = (nLength - 34) >> 8;
+    frame[39] = (nLength - 34) & 0xff;
+  }
+
+  memcpy(frame + nHeader, pPayload->Data, pPayload->Size);
+
+  /* One millisecond apart */
+  writeLong(pFile, (uint32_t)(Index / 1000));
+  writeLong(pFile, (uint32_t)(Index % 1000) * 1000);
+  writeLong(pFile, nLength);
+  writeLong(pFile, nLength);
+  fwrite(frame, 1, nLength, pFile);
+}
+
+static void showUsage() {
+
+  printf("Usage: pcapgen OUT [options]\n");
+  printf("  -bytes N         Stop after N bytes of packets (default 64M)\n");
+  printf("  -packets N       Stop after N packets instead\n");
+  printf("  -sizes D         fixed:N, uniform:MIN:MAX or imix (default "
+         "uniform:200:1500)\n");
+  printf("  -tcp F           Share of TCP packets, 0 to 1 (default 0.5)\n");
+  printf("  -exact F         Share of exact payload repeats (default 0.3)\n");
+  printf("  -partial F       Share of partial repeats (default 0.1)\n");
+  printf("  -partial-tail F  Share of a partial repeat rewritten (default "
+         "0.25)\n");
+  printf("  -skew S          Pick repeats from recent payloads, 1 is uniform "
+         "(default 2)\n");
+  printf("  -seed N          Random seed (default 1)\n");
+}
+
+static char parseSizes(const char *pSpec, struct GenOptions *pOptions) {
+
+  if (strcmp(pSpec, "imix") == 0) {
+    pOptions->SizeKind = GEN_SIZES_IMIX;
+    return 1;
+  }
+
+  if (sscanf(pSpec, "fixed:%d", &pOptions->SizeMin) == 1) {
+    pOptions->SizeKind = GEN_SIZES_FIXED;
+    pOptions->SizeMax = pOptions->SizeMin;
+  } else if (sscanf(pSpec, "uniform:%d:%d", &pOptions->SizeMin,
+                    &pOptions->SizeMax) == 2) {
+    pOptions->SizeKind = GEN_SIZES_UNIFORM;
+  } else {
+    return 0;
+  }
+
+  return pOptions->SizeMin >= 64 && pOptions->SizeMax <= GEN_MAX_FRAME &&
+         pOptions->SizeMin <= pOptions->SizeMax;
+}
+
+int main(int argc, char *argv[]) {
+
+  struct GenOptions options = {64ULL << 20, 0, GEN_SIZES_UNIFORM, 200, 1500,
+                               0.5, 0.3, 0.1, 0.25, 2, 1};
+  struct GenPayload *pPool;
+  struct GenPayload fresh;
+  int nPoolCount = 0, nPoolNext = 0;
+  uint64_t nPackets = 0, nBytes = 0;
+  uint64_t nExact = 0, nPartial = 0;
+  FILE *pFile;
+
+  if (argc < 2 || argv[1][0] == '-') {
+    showUsage();
+    return -1;
+  }
+
+  for (int i = 2; i < argc; i++) {
+
+    if (i + 1 >= argc) {
+      printf("Error: value not specified after %s\n", argv[i]);
+      return -1;
+    }
+
+    if (strcmp(argv[i], "-bytes") == 0) {
+      options.TargetBytes = strtoull(argv[i + 1], NULL, 10);
+    } else if (strcmp(argv[i], "-packets") == 0) {
+      options.TargetPackets = strtoull(argv[i + 1], NULL, 10);
+    } else if (strcmp(argv[i], "-sizes") == 0) {
+      if (!parseSizes(argv[i + 1], &options)) {
+        printf("Error: bad -sizes %s (frames are 64 to %d bytes)\n",
+               argv[i + 1], GEN_MAX_FRAME);
+        return -1;
+      }
+    } else if (strcmp(argv[i], "-tcp") == 0) {
+      options.TcpShare = atof(argv[i + 1]);
+    } else if (strcmp(argv[i], "-exact") == 0) {
+      options.ExactShare = atof(argv[i + 1]);
+    } else if (strcmp(argv[i], "-partial") == 0) {
+      options.PartialShare = atof(argv[i + 1]);
+    } else if (strcmp(argv[i], "-partial-tail") == 0) {
+      options.PartialTail = atof(argv[i + 1]);
+    } else if (strcmp(argv[i], "-skew") == 0) {
+      options.PoolSkew = atof(argv[i + 1]);
+    } else if (strcmp(argv[i], "-seed") == 0) {
+      options.Seed = strtoull(argv[i + 1], NULL, 10);
+    } else {
+      printf("Error: unknown option %s\n", argv[i]);
+      showUsage();
+      return -1;
+    }
+
+    i++;
+  }
+
+  if (options.ExactShare < 0 || options.PartialShare < 0 ||
+      options.ExactShare + options.PartialShare > 1 || options.PoolSkew < 1) {
+    printf("Error: -exact and -partial must add up to at most 1 and -skew "
+           "be at least 1\n");
+    return -1;
+  }
+
+  pPool = (struct GenPayload *)malloc(sizeof(struct GenPayload) * GEN_POOL_SIZE);
+  pFile = fopen(argv[1], "wb");
+
+  if (pPool == NULL || pFile == NULL) {
+    printf("* Error: Unable to create %s\n", argv[1]);
+    return -1;
+  }
+
+  RandomState = options.Seed * 0x9e3779b97f4a7c15ULL + 1;
+  writeFileHeader(pFile);
+
+  while (options.TargetPackets ? nPackets < options.TargetPackets
+                               : nBytes < options.TargetBytes) {
+    char bTcp = nextUnit() < options.TcpShare;
+    int nHeader = bTcp ? GEN_HDR_TCP : GEN_HDR_UDP;
+    double nKind = nextUnit();
+    struct GenPayload *pPayload = &fresh;
+
+    if (nPoolCount > 0 && nKind < options.ExactShare + options.PartialShare) {
+      pPayload = &pPool[pickPooled(&options, nPoolCount, nPoolNext)];
+
+      if (nKind >= options.ExactShare) {
+        /* Keep the head and rewrite the tail */
+        int nKeep = pPayload->Size * (1 - options.PartialTail);
+
+        fresh.Size = pPayload->Size;
+        memcpy(fresh.Data, pPayload->Data, nKeep);
+        fillRandom(fresh.Data + nKeep, fresh.Size - nKeep);
+        pPayload = &fresh;
+        nPartial++;
+      } else {
+        nExact++;
+      }
+    } else {
+      int nFrame = pickFrameSize(&options);
+
+      fresh.Size = nFrame > nHeader ? nFrame - nHeader : 1;
+      fillRandom(fresh.Data, fresh.Size);
+    }
+
+    writeFrame(pFile, nPackets, bTcp, pPayload);
+    nPackets++;
+    nBytes += (bTcp ? GEN_HDR_TCP : GEN_HDR_UDP) + pPayload->Size;
+
+    /* New payloads (fresh or partial) join the pool */
+    if (pPayload == &fresh) {
+      pPool[nPoolNext] = fresh;
+      nPoolNext = (nPoolNext + 1) % GEN_POOL_SIZE;
+
+      if (nPoolCount < GEN_POOL_SIZE) {
+        nPoolCount++;
+      }
+    }
+  }
+
+  fclose(pFile);
+  free(pPool);
+
+  printf("Wrote %s: %lu packets, %lu bytes, %lu exact and %lu partial "
+         "repeats\n",
+         argv[1], (unsigned long)nPackets, (unsigned long)nBytes,
+         (unsigned long)nExact, (unsigned long)nPartial);
+  return 0;
+}
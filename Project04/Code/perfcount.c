@@ -0,0 +1,163 @@
+/* perfcount.c : Hardware performance counters per thread (-perfcounters)
+ *
+ * Every reader and consumer thread opens its own user-space counters with
+ * perf_event_open, so nothing is shared while they run.  The counts are
+ * scaled for multiplexing (time enabled over time running) and summed per
+ * role under a lock when the thread stops.  When an event cannot be opened
+ * the run carries on and the event is reported as unavailable.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perfcount.h"
+
+char gPerfCounters = 0;
+
+static const char *PerfNames[PERF_EVENTS] = {
+    "cycles", "instructions", "LLC misses", "branch misses"};
+
+static const uint32_t PerfTypes[PERF_EVENTS] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+    PERF_TYPE_HARDWARE};
+
+static const uint64_t PerfConfigs[PERF_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+/* Totals per role, and whether any thread managed to count the event */
+static double PerfTotals[PERF_ROLES][PERF_EVENTS];
+static char PerfCounted[PERF_ROLES][PERF_EVENTS];
+static int PerfError[PERF_EVENTS];
+static pthread_mutex_t LockPerf = PTHREAD_MUTEX_INITIALIZER;
+
+/* Descriptors of the calling thread, -1 if not open */
+static __thread int PerfFds[PERF_EVENTS] = {-1, -1, -1, -1};
+
+void initializePerfCounters() {
+
+  memset(PerfTotals, 0, sizeof(PerfTotals));
+  memset(PerfCounted, 0, sizeof(PerfCounted));
+  memset(PerfError, 0, sizeof(PerfError));
+  gPerfCounters = 1;
+}
+
+void startPerfCounters() {
+
+  struct perf_event_attr attr;
+
+  if (!gPerfCounters) {
+    return;
+  }
+
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PerfTypes[e];
+    attr.config = PerfConfigs[e];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    PerfFds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+    if (PerfFds[e] < 0) {
+      PerfError[e] = errno;
+      continue;
+    }
+
+    ioctl(PerfFds[e], PERF_EVENT_IOC_RESET, 0);
+    ioctl(PerfFds[e], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+void stopPerfCounters(int Role) {
+
+  /* Value, time enabled, time running */
+  uint64_t nRead[3];
+  double nCounts[PERF_EVENTS];
+  char nValid[PERF_EVENTS];
+
+  if (!gPerfCounters) {
+    return;
+  }
+
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    nValid[e] = 0;
+
+    if (PerfFds[e] < 0) {
+      continue;
+    }
+
+    ioctl(PerfFds[e], PERF_EVENT_IOC_DISABLE, 0);
+
+    if (read(PerfFds[e], nRead, sizeof(nRead)) == sizeof(nRead) &&
+        nRead[2] > 0) {
+      nCounts[e] = (double)nRead[0] * nRead[1] / nRead[2];
+      nValid[e] = 1;
+    }
+
+    close(PerfFds[e]);
+    PerfFds[e] = -1;
+  }
+
+  pthread_mutex_lock(&LockPerf);
+
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    if (nValid[e]) {
+      PerfTotals[Role][e] += nCounts[e];
+      PerfCounted[Role][e] = 1;
+    }
+  }
+
+  pthread_mutex_unlock(&LockPerf);
+}
+
+void printPerfCounters(uint64_t Packets, uint64_t Bytes) {
+
+  static const char *RoleNames[PERF_ROLES] = {"reader", "consumers"};
+
+  printf("Hardware counters (user space, per packet / per byte)\n");
+
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    if (!PerfCounted[PERF_ROLE_READER][e] &&
+        !PerfCounted[PERF_ROLE_CONSUMER][e]) {
+      printf("  %-14s unavailable (%s)\n", PerfNames[e],
+             PerfError[e] == EACCES || PerfError[e] == EPERM
+                 ? "check /proc/sys/kernel/perf_event_paranoid"
+             : PerfError[e] == ENOENT || PerfError[e] == EOPNOTSUPP
+                 ? "no hardware counter for it here"
+                 : strerror(PerfError[e]));
+      continue;
+    }
+
+    for (int r = 0; r < PERF_ROLES; r++) {
+      if (!PerfCounted[r][e]) {
+        continue;
+      }
+
+      printf("  %-14s %-10s %16.0f %12.2f %10.4f\n", PerfNames[e],
+             RoleNames[r], PerfTotals[r][e],
+             Packets ? PerfTotals[r][e] / Packets : 0.0,
+             Bytes ? PerfTotals[r][e] / Bytes : 0.0);
+    }
+  }
+
+  for (int r = 0; r < PERF_ROLES; r++) {
+    if (PerfCounted[r][PERF_CYCLES] && PerfCounted[r][PERF_INSTRUCTIONS] &&
+        PerfTotals[r][PERF_CYCLES] > 0) {
+      printf("  IPC            %-10s %16.2f\n", RoleNames[r],
+             PerfTotals[r][PERF_INSTRUCTIONS] / PerfTotals[r][PERF_CYCLES]);
+    }
+  }
+}
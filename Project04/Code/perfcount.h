@@ -0,0 +1,38 @@
+/* perfcount.h : Hardware performance counters per thread (-perfcounters) */
+
+#ifndef __PERFCOUNT_H
+#define __PERFCOUNT_H
+
+#include <stdint.h>
+
+/* Which loop a thread's counters are charged to */
+#define PERF_ROLE_READER    0
+#define PERF_ROLE_CONSUMER  1
+#define PERF_ROLES          2
+
+/* The events counted */
+#define PERF_CYCLES         0
+#define PERF_INSTRUCTIONS   1
+#define PERF_LLC_MISSES     2
+#define PERF_BRANCH_MISSES  3
+#define PERF_EVENTS         4
+
+/* Non-zero if the threads count hardware events */
+extern char gPerfCounters;
+
+/* Start counting on the reader and consumer threads */
+void initializePerfCounters ();
+
+/* Open and enable the counters of the calling thread.  An event the kernel
+ * refuses (perf_event_paranoid, no PMU in a VM) is left out of the report. */
+void startPerfCounters ();
+
+/** Read and close the calling thread's counters and add them to a role
+ * @param Role  PERF_ROLE_READER or PERF_ROLE_CONSUMER
+ */
+void stopPerfCounters (int Role);
+
+/* Print the counts per packet and per byte of each role */
+void printPerfCounters (uint64_t Packets, uint64_t Bytes);
+
+#endif
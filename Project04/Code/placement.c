@@ -0,0 +1,286 @@
+/* placement.c : CPU pinning and NUMA placement (-pin, -numa)
+ *
+ * The topology comes from /sys/devices/system/node and memory policy is set
+ * with the raw mbind system call, so nothing beyond the C library is needed.
+ * With -numa the table is preferred on the one node in use, or interleaved
+ * over the nodes when the pinned consumers span several.  Packets are
+ * allocated by the reader, so keeping the reader on a node of the consumers
+ * keeps both the packets and the queue local to them.
+ *
+ * Cross-node traffic is reported from the kernel's per-node numastat page
+ * counters, which need no privileges but count the whole system.
+ */
+
+#define _GNU_SOURCE
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "placement.h"
+
+char gPinThreads = 0;
+char gNumaPlacement = 0;
+
+/* CPUs to pin to, in order */
+static int PinCpus[PLACE_MAX_CPUS];
+static int PinCount = 0;
+
+/* Node of each CPU (-1 if unknown) and the CPUs of the nodes in use */
+static int CpuNode[PLACE_MAX_CPUS];
+static cpu_set_t NodeCpus;
+static unsigned long NodeMask;
+static int NodeCount = 0;
+
+/** Parse a list such as "0-3,8"
+ * @returns The number of CPUs put in pCpus, -1 if the list is not valid
+ */
+static int parseCpuList(const char *pList, int *pCpus, int Max) {
+
+  int nCount = 0;
+  const char *pAt = pList;
+
+  while (*pAt != '\0' && *pAt != '\n') {
+    char *pEnd;
+    long nFirst = strtol(pAt, &pEnd, 10);
+    long nLast = nFirst;
+
+    if (pEnd == pAt || nFirst < 0) {
+      return -1;
+    }
+
+    if (*pEnd == '-') {
+      pAt = pEnd + 1;
+      nLast = strtol(pAt, &pEnd, 10);
+
+      if (pEnd == pAt || nLast < nFirst) {
+        return -1;
+      }
+    }
+
+    for (long c = nFirst; c <= nLast; c++) {
+      if (nCount >= Max || c >= PLACE_MAX_CPUS) {
+        return -1;
+      }
+      pCpus[nCount++] = (int)c;
+    }
+
+    pAt = pEnd;
+
+    if (*pAt == ',') {
+      pAt++;
+    }
+  }
+
+  return nCount;
+}
+
+/* Fill CpuNode from sysfs, returning how many nodes there are */
+static int readTopology() {
+
+  int nNodes = 0;
+  int pCpus[PLACE_MAX_CPUS];
+
+  for (int c = 0; c < PLACE_MAX_CPUS; c++) {
+    CpuNode[c] = -1;
+  }
+
+  for (int n = 0; n < PLACE_MAX_NODES; n++) {
+    char sPath[64];
+    char sList[4096];
+    FILE *pFile;
+    int nCpus;
+
+    snprintf(sPath, sizeof(sPath), "/sys/devices/system/node/node%d/cpulist",
+             n);
+    pFile = fopen(sPath, "r");
+
+    if (pFile == NULL) {
+      continue;
+    }
+
+    if (fgets(sList, sizeof(sList), pFile) != NULL) {
+      nCpus = parseCpuList(sList, pCpus, PLACE_MAX_CPUS);
+
+      for (int j = 0; j < nCpus; j++) {
+        CpuNode[pCpus[j]] = n;
+      }
+    }
+
+    fclose(pFile);
+    nNodes++;
+  }
+
+  return nNodes;
+}
+
+/* Add a node and its CPUs to those in use */
+static void useNode(int Node) {
+
+  if (Node < 0 || (NodeMask & (1UL << Node))) {
+    return;
+  }
+
+  NodeMask |= 1UL << Node;
+  NodeCount++;
+
+  for (int c = 0; c < PLACE_MAX_CPUS; c++) {
+    if (CpuNode[c] == Node) {
+      CPU_SET(c, &NodeCpus);
+    }
+  }
+}
+
+char initializePinning(const char *CpuList) {
+
+  cpu_set_t allowed;
+
+  PinCount = parseCpuList(CpuList, PinCpus, PLACE_MAX_CPUS);
+
+  if (PinCount <= 0) {
+    printf("* Error: Unable to parse the CPU list %s\n", CpuList);
+    return 0;
+  }
+
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  for (int j = 0; j < PinCount; j++) {
+    if (!CPU_ISSET(PinCpus[j], &allowed)) {
+      printf("* Error: CPU %d is not available to this process\n", PinCpus[j]);
+      return 0;
+    }
+  }
+
+  gPinThreads = 1;
+  return 1;
+}
+
+char initializeNumaPlacement() {
+
+  int nNodes = readTopology();
+  int nCpu = sched_getcpu();
+
+  if (nNodes == 0) {
+    printf("* Error: No NUMA topology under /sys/devices/system/node\n");
+    return 0;
+  }
+
+  CPU_ZERO(&NodeCpus);
+  NodeMask = 0;
+  NodeCount = 0;
+
+  if (gPinThreads) {
+    for (int j = 0; j < PinCount; j++) {
+      useNode(CpuNode[PinCpus[j]]);
+    }
+  } else {
+    useNode(nCpu >= 0 && nCpu < PLACE_MAX_CPUS ? CpuNode[nCpu] : 0);
+  }
+
+  if (NodeCount == 0) {
+    useNode(0);
+  }
+
+  printf("MAIN: NUMA placement on %d of %d node%s (mask 0x%lx)\n", NodeCount,
+         nNodes, nNodes == 1 ? "" : "s", NodeMask);
+  gNumaPlacement = 1;
+  return 1;
+}
+
+static void pinToCpu(int Cpu) {
+
+  cpu_set_t cpus;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(Cpu, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+void placeReaderThread() {
+
+  if (gPinThreads) {
+    pinToCpu(PinCpus[0]);
+  } else if (gNumaPlacement) {
+    pthread_setaffinity_np(pthread_self(), sizeof(NodeCpus), &NodeCpus);
+  }
+}
+
+void placeConsumerThread(int Index) {
+
+  if (gPinThreads) {
+    pinToCpu(PinCount > 1 ? PinCpus[1 + Index % (PinCount - 1)] : PinCpus[0]);
+  } else if (gNumaPlacement) {
+    pthread_setaffinity_np(pthread_self(), sizeof(NodeCpus), &NodeCpus);
+  }
+}
+
+void placeTableMemory(void *pMemory, size_t Length) {
+
+  long nPage = sysconf(_SC_PAGESIZE);
+  uintptr_t nStart = (uintptr_t)pMemory & ~(uintptr_t)(nPage - 1);
+  uintptr_t nEnd = ((uintptr_t)pMemory + Length + nPage - 1) &
+                   ~(uintptr_t)(nPage - 1);
+  int nMode = NodeCount > 1 ? MPOL_INTERLEAVE : MPOL_PREFERRED;
+
+  if (!gNumaPlacement || pMemory == NULL) {
+    return;
+  }
+
+  /* Moving the pages already touched is what makes it stick */
+  if (syscall(SYS_mbind, nStart, nEnd - nStart, nMode, &NodeMask,
+              sizeof(NodeMask) * 8, MPOL_MF_MOVE) != 0) {
+    printf("* Warning: Unable to place the table on node mask 0x%lx\n",
+           NodeMask);
+  }
+}
+
+void readNumaCounters(struct NumaCounters *pCounters) {
+
+  memset(pCounters, 0, sizeof(*pCounters));
+
+  for (int n = 0; n < PLACE_MAX_NODES; n++) {
+    char sPath[64];
+    char sName[32];
+    unsigned long long nValue;
+    FILE *pFile;
+
+    snprintf(sPath, sizeof(sPath), "/sys/devices/system/node/node%d/numastat",
+             n);
+    pFile = fopen(sPath, "r");
+
+    if (pFile == NULL) {
+      continue;
+    }
+
+    while (fscanf(pFile, "%31s %llu", sName, &nValue) == 2) {
+      if (strcmp(sName, "local_node") == 0) {
+        pCounters->LocalPages += nValue;
+      } else if (strcmp(sName, "other_node") == 0) {
+        pCounters->OtherNodePages += nValue;
+      } else if (strcmp(sName, "numa_miss") == 0) {
+        pCounters->MissPages += nValue;
+      }
+    }
+
+    fclose(pFile);
+  }
+}
+
+void printNumaCounters(struct NumaCounters *pBefore,
+                       struct NumaCounters *pAfter) {
+
+  uint64_t nLocal = pAfter->LocalPages - pBefore->LocalPages;
+  uint64_t nOther = pAfter->OtherNodePages - pBefore->OtherNodePages;
+  uint64_t nMiss = pAfter->MissPages - pBefore->MissPages;
+
+  printf("NUMA page allocations during the run (whole system)\n");
+  printf("  Local Node Pages:        %lu\n", (unsigned long)nLocal);
+  printf("  Other Node Pages:        %lu (%.2f%%)\n", (unsigned long)nOther,
+         nLocal + nOther ? nOther * 100.0 / (nLocal + nOther) : 0.0);
+  printf("  Missed Preferred Node:   %lu\n", (unsigned long)nMiss);
+}
@@ -0,0 +1,51 @@
+/* placement.h : CPU pinning and NUMA placement (-pin, -numa) */
+
+#ifndef __PLACEMENT_H
+#define __PLACEMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Most CPUs and NUMA nodes that are tracked */
+#define PLACE_MAX_CPUS      1024
+#define PLACE_MAX_NODES     64
+
+/* Non-zero if threads are pinned (-pin) or kept on one node (-numa) */
+extern char gPinThreads;
+extern char gNumaPlacement;
+
+/* System-wide page allocation counters summed over the nodes */
+struct NumaCounters
+{
+    uint64_t    LocalPages;
+    uint64_t    OtherNodePages;
+    uint64_t    MissPages;
+};
+
+/** Pin the reader to the first CPU of a list and the consumers round-robin
+ * to the rest (or to the same CPU if the list has only one)
+ * @param CpuList  CPUs as in "0-3,8,10-11"
+ * @returns 1 if successful, 0 otherwise
+ */
+char initializePinning (const char * CpuList);
+
+/** Keep the threads, the table and the packets on NUMA nodes: the nodes of
+ * the pinned CPUs if pinning, otherwise the node the program started on
+ * @returns 1 if successful, 0 otherwise
+ */
+char initializeNumaPlacement ();
+
+/* Apply the placement to the calling thread */
+void placeReaderThread ();
+void placeConsumerThread (int Index);
+
+/* Move the pages of a block (the table) to the nodes in use */
+void placeTableMemory (void * pMemory, size_t Length);
+
+/* Read the counters of /sys/devices/system/node/node* /numastat */
+void readNumaCounters (struct NumaCounters * pCounters);
+
+/* Print the pages placed off-node between two readings */
+void printNumaCounters (struct NumaCounters * pBefore, struct NumaCounters * pAfter);
+
+#endif
@@ -0,0 +1,259 @@
+/* progress.c : Progress, throughput and ETA while a run goes on (-progress)
+ *
+ * The reader publishes how far into the input it is (capture bytes, record
+ * headers included) and how many packets it took out, the consumers publish
+ * the bytes they parsed and the duplicate bytes they found.  Each counter
+ * has one writer at a time - the reader, or whoever holds the table lock -
+ * so it is bumped with a relaxed store, and the reporter thread reads them
+ * all with relaxed loads.  The reporter sleeps between reports and never
+ * takes the table or queue locks.
+ *
+ * Percent complete and the ETA need the input size, which is only known
+ * when every file is a plain pcap (a compressed one is read as more bytes
+ * than it takes on disk), otherwise just the rates are shown.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "progress.h"
+
+// Max length of a file name in a list (see main.c)
+#define MAX_LENGTH 100
+
+char gProgressOn = 0;
+
+static uint64_t ProgressIntervalNs;
+
+/* Bytes of all the input, zero if not known */
+static uint64_t ProgressTotal;
+
+/* Written by the reader: capture bytes and packets taken out so far */
+static uint64_t ProgressPosition;
+static uint64_t ProgressPackets;
+
+/* Written under the table lock: bytes parsed and found again */
+static uint64_t ProgressSeenBytes;
+static uint64_t ProgressHitBytes;
+
+/* The reader's own view: bytes of the files it is done with, and of the
+ * current one */
+static uint64_t ReaderBase;
+static uint64_t ReaderOffset;
+
+static pthread_t ProgressThread;
+static pthread_mutex_t ProgressLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ProgressWake = PTHREAD_COND_INITIALIZER;
+static char ProgressStop = 0;
+
+static uint64_t progressClock() {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Add to a counter only the calling thread writes (at this time) */
+static void bumpProgress(uint64_t *pCounter, uint64_t Amount) {
+
+  __atomic_store_n(pCounter, *pCounter + Amount, __ATOMIC_RELAXED);
+}
+
+/* Size of a plain pcap file, zero if it is compressed or cannot be read */
+static uint64_t sizeCapture(const char *pFileName) {
+
+  struct stat info;
+  uint32_t nMagic = 0;
+  FILE *pFile = fopen(pFileName, "rb");
+
+  if (pFile == NULL) {
+    return 0;
+  }
+
+  if (fread(&nMagic, sizeof(nMagic), 1, pFile) != 1 ||
+      (nMagic != 0xa1b2c3d4 && nMagic != 0xd4c3b2a1) ||
+      fstat(fileno(pFile), &info) != 0) {
+    fclose(pFile);
+    return 0;
+  }
+
+  fclose(pFile);
+  return (uint64_t)info.st_size;
+}
+
+char initializeProgress(double Interval, const char *InputFile) {
+
+  ProgressIntervalNs = (uint64_t)(Interval * 1e9);
+  ProgressTotal = 0;
+
+  if (strstr(InputFile, ".pcap")) {
+    ProgressTotal = sizeCapture(InputFile);
+  } else {
+    FILE *pList = fopen(InputFile, "r");
+    char str[MAX_LENGTH];
+
+    if (pList == NULL) {
+      printf("* Error: Unable to open %s for -progress\n", InputFile);
+      return 0;
+    }
+
+    // Any file of unknown size leaves the whole total unknown
+    while (fgets(str, MAX_LENGTH, pList)) {
+      uint64_t nSize;
+
+      str[strcspn(str, "\n")] = 0;
+      nSize = sizeCapture(str);
+
+      if (nSize == 0) {
+        ProgressTotal = 0;
+        break;
+      }
+
+      ProgressTotal += nSize;
+    }
+
+    fclose(pList);
+  }
+
+  gProgressOn = 1;
+  return 1;
+}
+
+void beginProgressFile() {
+
+  ReaderOffset = PROGRESS_FILE_HEADER;
+  __atomic_store_n(&ProgressPosition, ReaderBase + ReaderOffset,
+                   __ATOMIC_RELAXED);
+}
+
+void endProgressFile() {
+
+  ReaderBase += ReaderOffset;
+  ReaderOffset = 0;
+}
+
+void tickProgress(struct Packet *pPacket) {
+
+  ReaderOffset += PROGRESS_RECORD_HEADER + pPacket->LengthIncluded;
+  __atomic_store_n(&ProgressPosition, ReaderBase + ReaderOffset,
+                   __ATOMIC_RELAXED);
+  bumpProgress(&ProgressPackets, 1);
+}
+
+void countProgressPacket(uint32_t Length) {
+
+  bumpProgress(&ProgressSeenBytes, Length);
+}
+
+void countProgressHit(uint32_t RedundantBytes) {
+
+  bumpProgress(&ProgressHitBytes, RedundantBytes);
+}
+
+/* Print one report line
+ * @param Elapsed   Nanoseconds since the reporter started
+ * @param Span      Nanoseconds since the last report
+ * @param pLast     Position and packets at the last report (updated) */
+static void reportProgress(uint64_t Elapsed, uint64_t Span, uint64_t *pLast) {
+
+  uint64_t nPosition = __atomic_load_n(&ProgressPosition, __ATOMIC_RELAXED);
+  uint64_t nPackets = __atomic_load_n(&ProgressPackets, __ATOMIC_RELAXED);
+  uint64_t nSeen = __atomic_load_n(&ProgressSeenBytes, __ATOMIC_RELAXED);
+  uint64_t nHit = __atomic_load_n(&ProgressHitBytes, __ATOMIC_RELAXED);
+  double fSpan = Span / 1e9;
+  char pDuplicate[32];
+
+  // -approximate keeps its counts in the sketches until the end
+  if (nSeen > 0) {
+    snprintf(pDuplicate, sizeof(pDuplicate), "%.2f%%", nHit * 100.0 / nSeen);
+  } else {
+    snprintf(pDuplicate, sizeof(pDuplicate), "-");
+  }
+
+  fprintf(stderr, "PROGRESS: ");
+
+  if (ProgressTotal > 0) {
+    fprintf(stderr, "%5.1f%% of %.1f MB, ",
+            nPosition < ProgressTotal ? nPosition * 100.0 / ProgressTotal
+                                      : 100.0,
+            ProgressTotal / 1e6);
+  } else {
+    fprintf(stderr, "%.1f MB, ", nPosition / 1e6);
+  }
+
+  fprintf(stderr, "%.1f MB/s, %.0f packets/s, %s duplicate",
+          (nPosition - pLast[0]) / 1e6 / fSpan,
+          (nPackets - pLast[1]) / fSpan, pDuplicate);
+
+  // The ETA goes by the average rate, which moves less than the last one
+  if (ProgressTotal > 0 && nPosition > 0 && nPosition < ProgressTotal) {
+    uint64_t nEta = (uint64_t)((double)(ProgressTotal - nPosition) *
+                               (Elapsed / 1e9) / nPosition);
+
+    fprintf(stderr, ", ETA %lu:%02lu:%02lu", (unsigned long)(nEta / 3600),
+            (unsigned long)(nEta / 60 % 60), (unsigned long)(nEta % 60));
+  }
+
+  fprintf(stderr, "\n");
+
+  pLast[0] = nPosition;
+  pLast[1] = nPackets;
+}
+
+static void *runProgress(void *pArg) {
+
+  uint64_t nStart = progressClock();
+  uint64_t nLastNs = nStart;
+  uint64_t pLast[2] = {0, 0};
+
+  pthread_mutex_lock(&ProgressLock);
+
+  while (!ProgressStop) {
+    struct timespec until;
+    uint64_t nNow;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ProgressIntervalNs / 1000000000ULL;
+    until.tv_nsec += ProgressIntervalNs % 1000000000ULL;
+
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+
+    if (pthread_cond_timedwait(&ProgressWake, &ProgressLock, &until) !=
+        ETIMEDOUT) {
+      continue;
+    }
+
+    nNow = progressClock();
+    reportProgress(nNow - nStart, nNow - nLastNs, pLast);
+    nLastNs = nNow;
+  }
+
+  pthread_mutex_unlock(&ProgressLock);
+  return NULL;
+}
+
+void startProgress() {
+
+  ProgressStop = 0;
+  pthread_create(&ProgressThread, 0, runProgress, NULL);
+}
+
+void stopProgress() {
+
+  pthread_mutex_lock(&ProgressLock);
+  ProgressStop = 1;
+  pthread_cond_signal(&ProgressWake);
+  pthread_mutex_unlock(&ProgressLock);
+
+  pthread_join(ProgressThread, 0);
+}
@@ -0,0 +1,39 @@
+/* progress.h : Progress, throughput and ETA while a run goes on (-progress) */
+
+#ifndef __PROGRESS_H
+#define __PROGRESS_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/* Bytes of a pcap file header and of each record header */
+#define PROGRESS_FILE_HEADER    24
+#define PROGRESS_RECORD_HEADER  16
+
+/* Non-zero if the reporter is running (-progress) */
+extern char gProgressOn;
+
+/** Size up the input and get ready to report
+ * @param Interval   Seconds between reports
+ * @param InputFile  A .pcap file or a list of them, as given to redextract
+ * @returns 1 if successful, 0 otherwise
+ */
+char initializeProgress (double Interval, const char * InputFile);
+
+/* Start and stop the reporter thread (stopping prints nothing more) */
+void startProgress ();
+void stopProgress ();
+
+/* Called by the reader as it opens and finishes each file */
+void beginProgressFile ();
+void endProgressFile ();
+
+/* Count a packet the reader took out of the file */
+void tickProgress (struct Packet * pPacket);
+
+/* Count a packet and a duplicate payload (both under the table lock) */
+void countProgressPacket (uint32_t Length);
+void countProgressHit (uint32_t RedundantBytes);
+
+#endif
@@ -0,0 +1,662 @@
+/* recode.c : Redundancy-eliminating encoder and decoder for pcap files
+ *
+ * The encoder walks the capture in batches.  Parsing and fingerprinting the
+ * payloads of a batch is spread across threads, the cache decisions are made
+ * in order by the calling thread (cheap, since only equal fingerprints are
+ * compared byte for byte), and then the threads serialize their share of the
+ * records into the batch output at precomputed offsets.
+ *
+ * The decoder mirrors this: the record walk and cache updates run in order
+ * and only resolve pointers, the threads then copy the records out.  Both
+ * sides cache pointers into their mapped input, so the cache costs no copies.
+ */
+
+/* Needed for mmap due to the C99 flag */
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "packet.h"
+#include "pcap-process.h"
+#include "recode.h"
+#include "spooky.h"
+
+#define PCAP_FILE_HEADER    24
+#define PCAP_RECORD_HEADER  16
+
+/* One pcap record on its way through the encoder or decoder */
+struct RecodeRecord
+{
+    uint8_t         Type;
+    uint32_t        Slot;
+
+    /* Start of the 16 byte record header and of the packet bytes */
+    const uint8_t * Header;
+    const uint8_t * Data;
+    uint32_t        Length;
+
+    uint32_t        PayloadOffset;
+    uint32_t        PayloadSize;
+    uint64_t        Fingerprint;
+
+    /* Payload bytes taken from the cache (decoder REF records) */
+    const uint8_t * RefData;
+
+    /* Where this record lands in the batch output */
+    uint64_t        OutOffset;
+};
+
+/* A slice of a batch for one worker thread */
+struct RecodeWork
+{
+    struct RecodeRecord *   Records;
+    int                     First;
+    int                     Last;
+    uint8_t *               Out;
+};
+
+/* The cache of payloads kept identical on both sides */
+struct RecodeSlot
+{
+    const uint8_t * Data;
+    uint32_t        Size;
+    uint64_t        Fingerprint;
+};
+
+static double nowSeconds() {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return (double)t.tv_sec + t.tv_usec / 1000000.0;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+/* Delete a partly written output, unless it is not a plain file (a pipe or a
+ * device such as /dev/stdout) */
+static void discardOutput(const char *pName) {
+
+  struct stat info;
+
+  if (stat(pName, &info) == 0 && S_ISREG(info.st_mode)) {
+    remove(pName);
+  }
+}
+
+/* Map a whole file read-only, returns NULL on failure */
+static uint8_t *mapFile(const char *pName, uint64_t *pSize) {
+
+  struct stat fileStat;
+  uint8_t *pBase;
+  int fd;
+
+  fd = open(pName, O_RDONLY);
+
+  if (fd < 0) {
+    printf("* Error: Unable to open %s\n", pName);
+    return NULL;
+  }
+
+  if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+    printf("* Error: %s is empty\n", pName);
+    close(fd);
+    return NULL;
+  }
+
+  pBase = (uint8_t *)mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd,
+                          0);
+  close(fd);
+
+  if (pBase == MAP_FAILED) {
+    printf("* Error: Unable to map %s\n", pName);
+    return NULL;
+  }
+
+  *pSize = fileStat.st_size;
+  return pBase;
+}
+
+/* Run one phase over a batch with the records split evenly across threads */
+static void runParallel(void *(*pPhase)(void *), struct RecodeRecord *pRecords,
+                        int nRecords, uint8_t *pOut, int numThreads) {
+
+  pthread_t threads[64];
+  struct RecodeWork work[64];
+
+  if (numThreads > 64) {
+    numThreads = 64;
+  }
+
+  for (int t = 0; t < numThreads; t++) {
+    work[t].Records = pRecords;
+    work[t].First = (int)((int64_t)nRecords * t / numThreads);
+    work[t].Last = (int)((int64_t)nRecords * (t + 1) / numThreads);
+    work[t].Out = pOut;
+  }
+
+  // The calling thread takes the first slice itself
+  for (int t = 1; t < numThreads; t++) {
+    pthread_create(&threads[t], 0, pPhase, &work[t]);
+  }
+
+  pPhase(&work[0]);
+
+  for (int t = 1; t < numThreads; t++) {
+    pthread_join(threads[t], 0);
+  }
+}
+
+/* Encoder phase 1: find and fingerprint the payloads */
+static void *encodeHashPhase(void *pArg) {
+
+  struct RecodeWork *pWork = (struct RecodeWork *)pArg;
+  struct PacketHeaders headers;
+  struct Packet packet;
+
+  for (int j = pWork->First; j < pWork->Last; j++) {
+    struct RecodeRecord *pRec = &pWork->Records[j];
+
+    pRec->Type = RECODE_RAW;
+
+    // Parse in place, the packet does not own the mapped bytes
+    packet.Data = (uint8_t *)pRec->Data;
+    packet.LengthIncluded = pRec->Length;
+
+    if (parsePacketHeaders(&packet, &headers) != PARSE_OK ||
+        packet.PayloadSize < RECODE_MIN_PAYLOAD ||
+        packet.PayloadOffset > 0xffff) {
+      continue;
+    }
+
+    pRec->Type = RECODE_LITERAL;
+    pRec->PayloadOffset = packet.PayloadOffset;
+    pRec->PayloadSize = packet.PayloadSize;
+    pRec->Fingerprint = spooky_hash64(pRec->Data + packet.PayloadOffset,
+                                      packet.PayloadSize, FINGERPRINT_SEED);
+  }
+
+  return NULL;
+}
+
+/* Encoder phase 3: serialize the records at their offsets */
+static void *encodeWritePhase(void *pArg) {
+
+  struct RecodeWork *pWork = (struct RecodeWork *)pArg;
+
+  for (int j = pWork->First; j < pWork->Last; j++) {
+    struct RecodeRecord *pRec = &pWork->Records[j];
+    uint8_t *pOut = pWork->Out + pRec->OutOffset;
+    uint32_t nCopy = pRec->Length;
+
+    *pOut++ = pRec->Type;
+
+    if (pRec->Type == RECODE_TAIL) {
+      put32(pOut, pRec->Length);
+      memcpy(pOut + 4, pRec->Data, pRec->Length);
+      continue;
+    }
+
+    if (pRec->Type != RECODE_RAW) {
+      put32(pOut, pRec->Slot);
+      pOut[4] = pRec->PayloadOffset;
+      pOut[5] = pRec->PayloadOffset >> 8;
+      pOut += 6;
+    }
+
+    memcpy(pOut, pRec->Header, PCAP_RECORD_HEADER);
+    pOut += PCAP_RECORD_HEADER;
+
+    // A reference leaves the payload out
+    if (pRec->Type == RECODE_REF) {
+      nCopy = pRec->PayloadOffset;
+    }
+
+    memcpy(pOut, pRec->Data, nCopy);
+  }
+
+  return NULL;
+}
+
+/* Size of a record once encoded */
+static uint64_t encodedSize(struct RecodeRecord *pRec) {
+
+  switch (pRec->Type) {
+  case RECODE_RAW:
+    return 1 + PCAP_RECORD_HEADER + pRec->Length;
+  case RECODE_LITERAL:
+    return 1 + 6 + PCAP_RECORD_HEADER + pRec->Length;
+  case RECODE_REF:
+    return 1 + 6 + PCAP_RECORD_HEADER + pRec->PayloadOffset;
+  default:
+    return 1 + 4 + pRec->Length;
+  }
+}
+
+char encodeCapture(const char *pInName, const char *pOutName,
+                   int numThreads) {
+
+  struct RecodeHeader header;
+  struct RecodeRecord *pRecords;
+  struct RecodeSlot *pSlots;
+  uint8_t *pIn;
+  uint8_t *pOut = NULL;
+  uint64_t nInSize, nOffset, nOutBytes, nOutCapacity = 0;
+  uint64_t nRefs = 0, nRecordsTotal = 0;
+  uint32_t nMagic;
+  char bFailed = 0;
+  FILE *pFile;
+  double startTime = nowSeconds();
+
+  pIn = mapFile(pInName, &nInSize);
+
+  if (pIn == NULL) {
+    return 0;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.Magic, RECODE_MAGIC, sizeof(header.Magic));
+  header.Version = RECODE_VERSION;
+  header.Slots = RECODE_SLOTS;
+
+  /* Micro and nanosecond pcap magic numbers, in either byte order */
+  nMagic = nInSize >= PCAP_FILE_HEADER ? *(uint32_t *)pIn : 0;
+
+  if (nMagic == 0xa1b2c3d4 || nMagic == 0xa1b23c4d) {
+    header.EndianFlip = 0;
+  } else if (nMagic == 0xd4c3b2a1 || nMagic == 0x4d3cb2a1) {
+    header.EndianFlip = 1;
+  } else {
+    printf("* Error: %s is not a pcap file\n", pInName);
+    munmap(pIn, nInSize);
+    return 0;
+  }
+
+  pRecords =
+      (struct RecodeRecord *)malloc(sizeof(struct RecodeRecord) * RECODE_BATCH);
+  pSlots = (struct RecodeSlot *)calloc(RECODE_SLOTS, sizeof(struct RecodeSlot));
+  pFile = fopen(pOutName, "wb");
+
+  if (pRecords == NULL || pSlots == NULL || pFile == NULL) {
+    printf("* Error: Unable to set up encoding to %s\n", pOutName);
+    free(pRecords);
+    free(pSlots);
+    if (pFile != NULL) {
+      fclose(pFile);
+    }
+    munmap(pIn, nInSize);
+    return 0;
+  }
+
+  if (fwrite(&header, sizeof(header), 1, pFile) != 1 ||
+      fwrite(pIn, 1, PCAP_FILE_HEADER, pFile) != PCAP_FILE_HEADER) {
+    bFailed = 1;
+  }
+
+  nOutBytes = sizeof(header) + PCAP_FILE_HEADER;
+  nOffset = PCAP_FILE_HEADER;
+
+  while (nOffset < nInSize && !bFailed) {
+    int nRecords = 0;
+    uint64_t nBatchBytes = 0;
+
+    /* Walk the record headers to find this batch */
+    while (nRecords < RECODE_BATCH && nOffset < nInSize) {
+      struct RecodeRecord *pRec = &pRecords[nRecords++];
+      uint32_t nLength = 0;
+
+      if (nOffset + PCAP_RECORD_HEADER <= nInSize) {
+        nLength = get32(pIn + nOffset + 8);
+        if (header.EndianFlip) {
+          nLength = endianfixl(nLength);
+        }
+      }
+
+      if (nOffset + PCAP_RECORD_HEADER > nInSize ||
+          nLength > nInSize - nOffset - PCAP_RECORD_HEADER) {
+        /* Truncated last record - carry the bytes over as they are */
+        pRec->Type = RECODE_TAIL;
+        pRec->Data = pIn + nOffset;
+        pRec->Length = nInSize - nOffset;
+        nOffset = nInSize;
+        break;
+      }
+
+      pRec->Header = pIn + nOffset;
+      pRec->Data = pIn + nOffset + PCAP_RECORD_HEADER;
+      pRec->Length = nLength;
+      nOffset += PCAP_RECORD_HEADER + nLength;
+    }
+
+    /* Phase 1 (parallel): parse and fingerprint */
+    if (pRecords[nRecords - 1].Type == RECODE_TAIL) {
+      runParallel(encodeHashPhase, pRecords, nRecords - 1, NULL, numThreads);
+    } else {
+      runParallel(encodeHashPhase, pRecords, nRecords, NULL, numThreads);
+    }
+
+    /* Phase 2 (in order): cache decisions and output offsets */
+    for (int j = 0; j < nRecords; j++) {
+      struct RecodeRecord *pRec = &pRecords[j];
+
+      if (pRec->Type == RECODE_LITERAL) {
+        struct RecodeSlot *pSlot;
+        const uint8_t *pPayload = pRec->Data + pRec->PayloadOffset;
+
+        pRec->Slot = pRec->Fingerprint % RECODE_SLOTS;
+        pSlot = &pSlots[pRec->Slot];
+
+        if (pSlot->Fingerprint == pRec->Fingerprint &&
+            pSlot->Size == pRec->PayloadSize &&
+            memcmp(pSlot->Data, pPayload, pRec->PayloadSize) == 0) {
+          pRec->Type = RECODE_REF;
+          nRefs++;
+        } else {
+          pSlot->Data = pPayload;
+          pSlot->Size = pRec->PayloadSize;
+          pSlot->Fingerprint = pRec->Fingerprint;
+        }
+      }
+
+      pRec->OutOffset = nBatchBytes;
+      nBatchBytes += encodedSize(pRec);
+    }
+
+    if (nBatchBytes > nOutCapacity) {
+      free(pOut);
+      nOutCapacity = nBatchBytes;
+      pOut = (uint8_t *)malloc(nOutCapacity);
+
+      if (pOut == NULL) {
+        printf("* Error: malloc failed for the encode buffer\n");
+        bFailed = 1;
+        break;
+      }
+    }
+
+    /* Phase 3 (parallel): serialize */
+    runParallel(encodeWritePhase, pRecords, nRecords, pOut, numThreads);
+
+    if (fwrite(pOut, 1, nBatchBytes, pFile) != nBatchBytes) {
+      bFailed = 1;
+      break;
+    }
+
+    nOutBytes += nBatchBytes;
+    nRecordsTotal += nRecords;
+  }
+
+  // A full disk may only show up when the last of the buffer is flushed
+  if (fclose(pFile) != 0) {
+    bFailed = 1;
+  }
+
+  munmap(pIn, nInSize);
+  free(pOut);
+  free(pSlots);
+  free(pRecords);
+
+  if (bFailed) {
+    printf("* Error: Unable to write %s\n", pOutName);
+    discardOutput(pOutName);
+    return 0;
+  }
+
+  double elapsed = nowSeconds() - startTime;
+
+  printf("Encoded %s to %s\n", pInName, pOutName);
+  printf("  Records:              %lu (%lu replaced by references)\n",
+         (unsigned long)nRecordsTotal, (unsigned long)nRefs);
+  printf("  Bytes In / Out:       %lu / %lu\n", (unsigned long)nInSize,
+         (unsigned long)nOutBytes);
+  printf("  Compression Ratio:    %.3f\n", (double)nInSize / nOutBytes);
+  printf("  Encode Throughput:    %.3f GB/s (%lf seconds)\n",
+         nInSize / elapsed / 1e9, elapsed);
+  return 1;
+}
+
+/* Decoder phase 2: copy the records out */
+static void *decodeWritePhase(void *pArg) {
+
+  struct RecodeWork *pWork = (struct RecodeWork *)pArg;
+
+  for (int j = pWork->First; j < pWork->Last; j++) {
+    struct RecodeRecord *pRec = &pWork->Records[j];
+    uint8_t *pOut = pWork->Out + pRec->OutOffset;
+
+    if (pRec->Type == RECODE_TAIL) {
+      memcpy(pOut, pRec->Data, pRec->Length);
+      continue;
+    }
+
+    memcpy(pOut, pRec->Header, PCAP_RECORD_HEADER);
+    pOut += PCAP_RECORD_HEADER;
+
+    if (pRec->Type == RECODE_REF) {
+      memcpy(pOut, pRec->Data, pRec->PayloadOffset);
+      memcpy(pOut + pRec->PayloadOffset, pRec->RefData, pRec->PayloadSize);
+    } else {
+      memcpy(pOut, pRec->Data, pRec->Length);
+    }
+  }
+
+  return NULL;
+}
+
+char decodeCapture(const char *pInName, const char *pOutName,
+                   int numThreads) {
+
+  struct RecodeHeader header;
+  struct RecodeRecord *pRecords;
+  struct RecodeSlot *pSlots;
+  uint8_t *pIn;
+  uint8_t *pOut = NULL;
+  uint64_t nInSize, nOffset, nOutBytes, nOutCapacity = 0;
+  char bCorrupt = 0;
+  char bFailed = 0;
+  FILE *pFile;
+  double startTime = nowSeconds();
+
+  pIn = mapFile(pInName, &nInSize);
+
+  if (pIn == NULL) {
+    return 0;
+  }
+
+  if (nInSize < sizeof(header) + PCAP_FILE_HEADER) {
+    printf("* Error: %s is not an encoded capture\n", pInName);
+    munmap(pIn, nInSize);
+    return 0;
+  }
+
+  memcpy(&header, pIn, sizeof(header));
+
+  if (memcmp(header.Magic, RECODE_MAGIC, sizeof(header.Magic)) != 0 ||
+      header.Version != RECODE_VERSION || header.Slots == 0) {
+    printf("* Error: %s is not an encoded capture\n", pInName);
+    munmap(pIn, nInSize);
+    return 0;
+  }
+
+  pRecords =
+      (struct RecodeRecord *)malloc(sizeof(struct RecodeRecord) * RECODE_BATCH);
+  pSlots = (struct RecodeSlot *)calloc(header.Slots, sizeof(struct RecodeSlot));
+  pFile = fopen(pOutName, "wb");
+
+  if (pRecords == NULL || pSlots == NULL || pFile == NULL) {
+    printf("* Error: Unable to set up decoding to %s\n", pOutName);
+    free(pRecords);
+    free(pSlots);
+    if (pFile != NULL) {
+      fclose(pFile);
+    }
+    munmap(pIn, nInSize);
+    return 0;
+  }
+
+  if (fwrite(pIn + sizeof(header), 1, PCAP_FILE_HEADER, pFile) !=
+      PCAP_FILE_HEADER) {
+    bFailed = 1;
+  }
+
+  nOutBytes = PCAP_FILE_HEADER;
+  nOffset = sizeof(header) + PCAP_FILE_HEADER;
+
+  while (nOffset < nInSize && !bCorrupt && !bFailed) {
+    int nRecords = 0;
+    uint64_t nBatchBytes = 0;
+
+    /* Phase 1 (in order): walk the records and resolve the references */
+    while (nRecords < RECODE_BATCH && nOffset < nInSize) {
+      struct RecodeRecord *pRec = &pRecords[nRecords];
+      uint64_t nNeed;
+
+      pRec->Type = pIn[nOffset++];
+      pRec->Slot = 0;
+      pRec->PayloadOffset = 0;
+
+      if (pRec->Type == RECODE_TAIL) {
+        pRec->Length = nOffset + 4 <= nInSize ? get32(pIn + nOffset) : 0;
+        pRec->Data = pIn + nOffset + 4;
+
+        if (nOffset + 4 + (uint64_t)pRec->Length > nInSize) {
+          bCorrupt = 1;
+          break;
+        }
+
+        nOffset += 4 + pRec->Length;
+      } else {
+        nNeed = PCAP_RECORD_HEADER;
+
+        if (pRec->Type == RECODE_LITERAL || pRec->Type == RECODE_REF) {
+          nNeed += 6;
+        } else if (pRec->Type != RECODE_RAW) {
+          bCorrupt = 1;
+          break;
+        }
+
+        if (nOffset + nNeed > nInSize) {
+          bCorrupt = 1;
+          break;
+        }
+
+        if (pRec->Type != RECODE_RAW) {
+          pRec->Slot = get32(pIn + nOffset);
+          pRec->PayloadOffset = pIn[nOffset + 4] | pIn[nOffset + 5] << 8;
+          nOffset += 6;
+        }
+
+        pRec->Header = pIn + nOffset;
+        pRec->Length = get32(pRec->Header + 8);
+
+        if (header.EndianFlip) {
+          pRec->Length = endianfixl(pRec->Length);
+        }
+
+        pRec->Data = pIn + nOffset + PCAP_RECORD_HEADER;
+        nOffset += PCAP_RECORD_HEADER;
+
+        if (pRec->Slot >= header.Slots || pRec->PayloadOffset > pRec->Length) {
+          bCorrupt = 1;
+          break;
+        }
+
+        pRec->PayloadSize = pRec->Length - pRec->PayloadOffset;
+        nNeed = pRec->Type == RECODE_REF ? pRec->PayloadOffset : pRec->Length;
+
+        if (nOffset + nNeed > nInSize) {
+          bCorrupt = 1;
+          break;
+        }
+
+        nOffset += nNeed;
+
+        if (pRec->Type == RECODE_LITERAL) {
+          pSlots[pRec->Slot].Data = pRec->Data + pRec->PayloadOffset;
+          pSlots[pRec->Slot].Size = pRec->PayloadSize;
+        } else if (pRec->Type == RECODE_REF) {
+          if (pSlots[pRec->Slot].Size != pRec->PayloadSize) {
+            bCorrupt = 1;
+            break;
+          }
+          pRec->RefData = pSlots[pRec->Slot].Data;
+        }
+      }
+
+      pRec->OutOffset = nBatchBytes;
+      nBatchBytes += pRec->Type == RECODE_TAIL
+                         ? pRec->Length
+                         : PCAP_RECORD_HEADER + pRec->Length;
+      nRecords++;
+    }
+
+    if (nBatchBytes > nOutCapacity) {
+      free(pOut);
+      nOutCapacity = nBatchBytes;
+      pOut = (uint8_t *)malloc(nOutCapacity);
+
+      if (pOut == NULL) {
+        printf("* Error: malloc failed for the decode buffer\n");
+        bFailed = 1;
+        break;
+      }
+    }
+
+    /* Phase 2 (parallel): copy the records out */
+    runParallel(decodeWritePhase, pRecords, nRecords, pOut, numThreads);
+
+    if (fwrite(pOut, 1, nBatchBytes, pFile) != nBatchBytes) {
+      bFailed = 1;
+      break;
+    }
+
+    nOutBytes += nBatchBytes;
+  }
+
+  if (fclose(pFile) != 0) {
+    bFailed = 1;
+  }
+
+  munmap(pIn, nInSize);
+  free(pOut);
+  free(pSlots);
+  free(pRecords);
+
+  // Leave no partial capture behind
+  if (bCorrupt || bFailed) {
+    if (bCorrupt) {
+      printf("* Error: %s is corrupt at byte %lu\n", pInName,
+             (unsigned long)nOffset);
+    } else {
+      printf("* Error: Unable to write %s\n", pOutName);
+    }
+
+    discardOutput(pOutName);
+    return 0;
+  }
+
+  double elapsed = nowSeconds() - startTime;
+
+  printf("Decoded %s to %s\n", pInName, pOutName);
+  printf("  Bytes In / Out:       %lu / %lu\n", (unsigned long)nInSize,
+         (unsigned long)nOutBytes);
+  printf("  Decode Throughput:    %.3f GB/s (%lf seconds)\n",
+         nOutBytes / elapsed / 1e9, elapsed);
+  return 1;
+}
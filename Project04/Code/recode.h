@@ -0,0 +1,63 @@
+/* recode.h : Redundancy-eliminating encoder and decoder for pcap files */
+
+#ifndef __RECODE_H
+#define __RECODE_H
+
+#include <stdint.h>
+
+#define RECODE_MAGIC        "REDXENC1"
+#define RECODE_VERSION      1
+
+/* Slots in the payload cache that the encoder and decoder keep in step */
+#define RECODE_SLOTS        40000
+
+/* Payloads smaller than this are not worth a reference */
+#define RECODE_MIN_PAYLOAD  64
+
+/* Records handled per parallel batch */
+#define RECODE_BATCH        65536
+
+/* Record types in the encoded stream
+ *
+ *  RAW      [type][16 byte pcap record header][packet bytes]
+ *  LITERAL  [type][u32 slot][u16 payload offset][record header][packet bytes]
+ *  REF      [type][u32 slot][u16 payload offset][record header][header bytes]
+ *  TAIL     [type][u32 length][bytes] trailing bytes that are not a record
+ *
+ *  A LITERAL payload is placed in the cache slot it names, a REF takes its
+ *  payload from that slot.  Multi-byte fields are little endian.
+ */
+#define RECODE_RAW          0
+#define RECODE_LITERAL      1
+#define RECODE_REF          2
+#define RECODE_TAIL         3
+
+/* Front matter of an encoded file, followed by the 24 byte pcap header */
+struct RecodeHeader
+{
+    char        Magic[8];
+    uint32_t    Version;
+    uint32_t    Slots;
+
+    /* The pcap was written with the other endian-ness */
+    uint8_t     EndianFlip;
+    uint8_t     Reserved[7];
+};
+
+/** Encode a pcap file, replacing payloads seen before with references
+ * @param pInName     The pcap file to encode
+ * @param pOutName    Where to write the encoded stream
+ * @param numThreads  Threads used for parsing, hashing and serializing
+ * @returns 1 if successful, 0 otherwise
+ */
+char encodeCapture (const char * pInName, const char * pOutName, int numThreads);
+
+/** Rebuild the byte-identical pcap file from an encoded stream
+ * @param pInName     The encoded file
+ * @param pOutName    Where to write the pcap file
+ * @param numThreads  Threads used for copying records out
+ * @returns 1 if successful, 0 otherwise
+ */
+char decodeCapture (const char * pInName, const char * pOutName, int numThreads);
+
+#endif
@@ -0,0 +1,182 @@
+/* sample.c : Payload-consistent 1/N packet sampling with confidence intervals
+ *
+ * The reader keeps a packet when the hash of its payload falls in one of N
+ * buckets; everything else is counted and dropped before it is queued, so
+ * skipped payloads never reach the table lock, the compare or the history.
+ * The hash has its own seed so the sample is independent of the table index
+ * (a key over only part of the payload groups structured payloads together
+ * and biases the estimate).
+ *
+ * Since a payload is sampled with all of its copies, the redundant bytes of
+ * each sampled payload are exact and the total scales by N (a
+ * Horvitz-Thompson estimate).  Its variance is estimated by N (N - 1) times
+ * the sum of the squared redundant bytes of the sampled payloads.  A payload
+ * can be evicted and come back in another entry, so the table's entries are
+ * summed by fingerprint before they are squared.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pcap-process.h"
+#include "sample.h"
+#include "spooky.h"
+
+uint32_t gSampleRate = 0;
+
+/* Packets the reader skipped (one reader at a time, so no lock) */
+static uint64_t SkippedCount;
+static uint64_t SkippedBytes;
+
+/* Redundant bytes of each sampled payload by fingerprint, open addressing
+ * (a slot is empty while its bytes are zero) */
+static uint64_t *SampleKeys;
+static uint64_t *SampleBytes;
+static uint32_t SampleMask;
+static uint32_t SampleUsed;
+
+/* Squares of the payloads that could not be kept apart (out of memory) */
+static double HitSquares;
+static char SampleSplit;
+
+void initializeSample(uint32_t Rate) {
+
+  gSampleRate = Rate;
+  SkippedCount = 0;
+  SkippedBytes = 0;
+  SampleKeys = NULL;
+  SampleBytes = NULL;
+  SampleMask = 0;
+  SampleUsed = 0;
+  HitSquares = 0;
+  SampleSplit = 0;
+}
+
+char samplePacket(struct Packet *pPacket) {
+
+  struct PacketHeaders headers;
+
+  /* Packets the table would ignore cost nothing to send on */
+  if (pPacket->LengthIncluded <= MIN_PKT_SIZE ||
+      parsePacketHeaders(pPacket, &headers) != PARSE_OK ||
+      pPacket->PayloadSize == 0) {
+    return 1;
+  }
+
+  if (spooky_hash64(pPacket->Data + pPacket->PayloadOffset,
+                    pPacket->PayloadSize, SAMPLE_SEED) %
+          gSampleRate == 0) {
+    return 1;
+  }
+
+  SkippedCount++;
+  SkippedBytes += pPacket->LengthIncluded;
+  return 0;
+}
+
+static uint32_t findSample(uint64_t *pKeys, uint64_t *pBytes, uint32_t nMask,
+                           uint64_t Fingerprint) {
+
+  uint32_t nSlot = (uint32_t)(Fingerprint >> 32) & nMask;
+
+  while (pBytes[nSlot] != 0 && pKeys[nSlot] != Fingerprint) {
+    nSlot = (nSlot + 1) & nMask;
+  }
+
+  return nSlot;
+}
+
+/* Double the map (or create it), returns 0 if there was no memory */
+static char growSample() {
+
+  uint32_t nSize = SampleMask ? (SampleMask + 1) * 2 : SAMPLE_MAP_START;
+  uint64_t *pKeys = (uint64_t *)malloc(sizeof(uint64_t) * nSize);
+  uint64_t *pBytes = (uint64_t *)calloc(nSize, sizeof(uint64_t));
+
+  if (pKeys == NULL || pBytes == NULL) {
+    free(pKeys);
+    free(pBytes);
+    return 0;
+  }
+
+  for (uint32_t j = 0; SampleMask && j <= SampleMask; j++) {
+    if (SampleBytes[j] != 0) {
+      uint32_t nSlot = findSample(pKeys, pBytes, nSize - 1, SampleKeys[j]);
+
+      pKeys[nSlot] = SampleKeys[j];
+      pBytes[nSlot] = SampleBytes[j];
+    }
+  }
+
+  free(SampleKeys);
+  free(SampleBytes);
+  SampleKeys = pKeys;
+  SampleBytes = pBytes;
+  SampleMask = nSize - 1;
+  return 1;
+}
+
+void sampleEntry(uint64_t Fingerprint, uint32_t RedundantBytes) {
+
+  uint32_t nSlot;
+
+  if (RedundantBytes == 0) {
+    return;
+  }
+
+  // Keep the map at most half full
+  if ((SampleUsed + 1) * 2 > SampleMask + 1 && !growSample()) {
+    HitSquares += (double)RedundantBytes * RedundantBytes;
+    SampleSplit = 1;
+    return;
+  }
+
+  nSlot = findSample(SampleKeys, SampleBytes, SampleMask, Fingerprint);
+
+  if (SampleBytes[nSlot] == 0) {
+    SampleKeys[nSlot] = Fingerprint;
+    SampleUsed++;
+  }
+
+  SampleBytes[nSlot] += RedundantBytes;
+}
+
+void finishSample() {
+
+  double nBytes, nError;
+
+  for (uint32_t j = 0; SampleMask && j <= SampleMask; j++) {
+    HitSquares += (double)SampleBytes[j] * SampleBytes[j];
+  }
+
+  free(SampleKeys);
+  free(SampleBytes);
+  SampleKeys = NULL;
+  SampleBytes = NULL;
+  SampleMask = 0;
+
+  gPacketHitCount *= gSampleRate;
+  gPacketHitBytes *= gSampleRate;
+  gPacketSeenCount += SkippedCount;
+  gPacketSeenBytes += SkippedBytes;
+
+  nBytes = gPacketHitBytes;
+  nError = 1.96 * sqrt(HitSquares * gSampleRate * (gSampleRate - 1));
+
+  printf("Sampled 1/%u of the payloads (95%% confidence, skipped %lu "
+         "packets)\n",
+         gSampleRate, (unsigned long)SkippedCount);
+  printf("  Bytes Duplicate Range:   %.0f to %.0f\n", fmax(0, nBytes - nError),
+         fmin(gPacketSeenBytes, nBytes + nError));
+
+  if (gPacketSeenBytes > 0) {
+    printf("  Duplicate Percent Range: %6.2f%% to %6.2f%%\n",
+           fmax(0, nBytes - nError) / gPacketSeenBytes * 100.0,
+           fmin(gPacketSeenBytes, nBytes + nError) / gPacketSeenBytes * 100.0);
+  }
+
+  if (SampleSplit) {
+    printf("  (out of memory summing payloads, the range may be too narrow)\n");
+  }
+}
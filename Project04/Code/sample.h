@@ -0,0 +1,39 @@
+/* sample.h : Payload-consistent 1/N sampling with confidence intervals */
+
+#ifndef __SAMPLE_H
+#define __SAMPLE_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/* Seed of the sampling hash, apart from FINGERPRINT_SEED */
+#define SAMPLE_SEED         0x5a17
+
+/* Slots the map of sampled payloads starts with (a power of two) */
+#define SAMPLE_MAP_START    4096
+
+/* Keep one payload in N, zero or one if every packet is processed (-sample) */
+extern uint32_t gSampleRate;
+
+/* Start sampling 1/Rate of the payloads */
+void initializeSample (uint32_t Rate);
+
+/** Decide in the reader whether a packet goes to the consumers.  The key
+ * is a hash of the whole payload, so identical payloads are always kept or
+ * always skipped.  Skipped packets are only counted and are left for the
+ * caller to discard.
+ * @param pPacket  The packet just read
+ * @returns 1 if the packet is in the sample, 0 otherwise
+ */
+char samplePacket (struct Packet * pPacket);
+
+/* Note the redundant bytes of a table entry as it is folded into the totals
+ * (under the table lock) */
+void sampleEntry (uint64_t Fingerprint, uint32_t RedundantBytes);
+
+/* Scale the global counters up to the whole capture and print the 95%
+ * confidence intervals (call after tallyProcessing) */
+void finishSample ();
+
+#endif
@@ -0,0 +1,164 @@
+/* stages.c : Per-stage latency histograms (-stage-times)
+ *
+ * Each thread adds samples to histograms of its own with no locking, and
+ * they are merged into the global ones under a lock when the thread ends.
+ * A bucket covers a quarter of a power of two, so a reported percentile is
+ * within 25% of the true one.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stages.h"
+
+struct StageHistogram
+{
+    uint64_t    Buckets[STAGE_BUCKETS];
+    uint64_t    Samples;
+    uint64_t    TotalNs;
+};
+
+char gStageTiming = 0;
+
+static const char *StageNames[STAGE_COUNT] = {
+    "read", "enqueue wait", "dequeue wait", "table lock",
+    "hash", "lookup", "compare"};
+
+static struct StageHistogram StagesGlobal[STAGE_COUNT];
+static pthread_mutex_t LockStages = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct StageHistogram StagesLocal[STAGE_COUNT];
+
+void initializeStages() {
+
+  memset(StagesGlobal, 0, sizeof(StagesGlobal));
+  gStageTiming = 1;
+}
+
+uint64_t stageClock() {
+
+  struct timespec now;
+
+  if (!gStageTiming) {
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int bucketOf(uint64_t Ns) {
+
+  int nExp;
+
+  if (Ns < 4) {
+    return (int)Ns;
+  }
+
+  nExp = 63 - __builtin_clzll(Ns);
+  return (nExp - 1) * 4 + (int)((Ns >> (nExp - 2)) & 3);
+}
+
+/* Smallest value that falls in a bucket */
+static uint64_t bucketFloor(int Bucket) {
+
+  if (Bucket < 4) {
+    return Bucket;
+  }
+
+  return (uint64_t)(4 + Bucket % 4) << (Bucket / 4 - 1);
+}
+
+void recordStageSpan(int Stage, uint64_t Start, uint64_t End) {
+
+  if (!gStageTiming) {
+    return;
+  }
+
+  StagesLocal[Stage].Buckets[bucketOf(End - Start)]++;
+  StagesLocal[Stage].Samples++;
+  StagesLocal[Stage].TotalNs += End - Start;
+}
+
+uint64_t recordStage(int Stage, uint64_t Start) {
+
+  uint64_t nNow = stageClock();
+
+  if (nNow == 0) {
+    return 0;
+  }
+
+  recordStageSpan(Stage, Start, nNow);
+  return nNow;
+}
+
+void detachStages() {
+
+  if (!gStageTiming) {
+    return;
+  }
+
+  pthread_mutex_lock(&LockStages);
+
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    for (int j = 0; j < STAGE_BUCKETS; j++) {
+      StagesGlobal[s].Buckets[j] += StagesLocal[s].Buckets[j];
+    }
+
+    StagesGlobal[s].Samples += StagesLocal[s].Samples;
+    StagesGlobal[s].TotalNs += StagesLocal[s].TotalNs;
+  }
+
+  pthread_mutex_unlock(&LockStages);
+
+  memset(StagesLocal, 0, sizeof(StagesLocal));
+}
+
+static uint64_t percentileOf(struct StageHistogram *pHist, double Fraction) {
+
+  uint64_t nRank = (uint64_t)(pHist->Samples * Fraction);
+  uint64_t nSeen = 0;
+
+  for (int j = 0; j < STAGE_BUCKETS; j++) {
+    nSeen += pHist->Buckets[j];
+
+    if (nSeen > nRank) {
+      return bucketFloor(j);
+    }
+  }
+
+  return bucketFloor(STAGE_BUCKETS - 1);
+}
+
+void printStages() {
+
+  uint64_t nTotal = 0;
+
+  detachStages();
+
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    nTotal += StagesGlobal[s].TotalNs;
+  }
+
+  printf("Stage latency (ns, summed over threads)\n");
+  printf("  Stage                Samples       p50       p99      p999   "
+         "Total (s)  Share\n");
+
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    struct StageHistogram *pHist = &StagesGlobal[s];
+
+    if (pHist->Samples == 0) {
+      continue;
+    }
+
+    printf("  %-14s %13lu %9lu %9lu %9lu %11.3f %5.1f%%\n", StageNames[s],
+           (unsigned long)pHist->Samples,
+           (unsigned long)percentileOf(pHist, 0.5),
+           (unsigned long)percentileOf(pHist, 0.99),
+           (unsigned long)percentileOf(pHist, 0.999), pHist->TotalNs / 1e9,
+           nTotal ? pHist->TotalNs * 100.0 / nTotal : 0.0);
+  }
+}
@@ -0,0 +1,47 @@
+/* stages.h : Per-stage latency histograms (-stage-times) */
+
+#ifndef __STAGES_H
+#define __STAGES_H
+
+#include <stdint.h>
+
+/* The stages that are timed */
+#define STAGE_READ          0   /* Reading a packet from the file */
+#define STAGE_ENQUEUE_WAIT  1   /* Reader waiting for room in the queue */
+#define STAGE_DEQUEUE_WAIT  2   /* Consumer waiting for a packet */
+#define STAGE_TABLE_LOCK    3   /* Consumer waiting for the table lock */
+#define STAGE_HASH          4   /* Fingerprinting the payload */
+#define STAGE_LOOKUP        5   /* Table slot check, eviction and insert */
+#define STAGE_COMPARE       6   /* Byte compare of a candidate match */
+#define STAGE_COUNT         7
+
+/* Log-scale buckets: four per power of two of nanoseconds */
+#define STAGE_BUCKETS       256
+
+/* Non-zero if the stages are being timed */
+extern char gStageTiming;
+
+/* Start timing the stages */
+void initializeStages ();
+
+/* A monotonic timestamp in nanoseconds, zero when the stages are not timed */
+uint64_t stageClock ();
+
+/** Add the time since Start to a stage of the calling thread's histograms
+ * @param Stage  One of the STAGE_ values
+ * @param Start  Timestamp from stageClock when the stage began
+ * @returns The current timestamp so the next stage can start from it
+ */
+uint64_t recordStage (int Stage, uint64_t Start);
+
+/* Add the time from Start to End (both from stageClock) to a stage */
+void recordStageSpan (int Stage, uint64_t Start, uint64_t End);
+
+/* Merge the calling thread's histograms into the global ones (call when a
+ * reader or consumer thread finishes) */
+void detachStages ();
+
+/* Print p50 / p99 / p999 and the share of the timed total for each stage */
+void printStages ();
+
+#endif
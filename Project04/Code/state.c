@@ -0,0 +1,246 @@
+/* state.c : Checkpoint and warm-start of the redundancy table
+ *
+ * A snapshot is written once at the end of a run and mapped in at the start
+ * of the next one, so that redundancy is found across rotated captures.
+ * Loading is a single mmap and one pass over the table to check that every
+ * entry stays within the arena; pages of the arena are only faulted in when
+ * a lookup touches them.
+ */
+
+/* Needed for mmap, fileno and fsync due to the C99 flag */
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "pcap-process.h"
+#include "pcap-read.h"
+#include "state.h"
+
+/* Counters carried in by a loaded snapshot */
+struct StateHeader gStateLoaded;
+
+/* The mapping of the loaded snapshot */
+static uint8_t *StateBase = NULL;
+static uint8_t *StateArena = NULL;
+
+static uint64_t alignState(uint64_t nOffset) {
+  return (nOffset + STATE_ALIGN - 1) & ~((uint64_t)STATE_ALIGN - 1);
+}
+
+uint8_t *getStateArena() { return StateArena; }
+
+/* Check that every used entry of a mapped snapshot stays within the arena
+ * and holds no pointers, returns the first bad entry or -1 if all are fine */
+static int checkStateEntries(struct StateHeader *pHeader) {
+
+  struct PacketEntry *pTable =
+      (struct PacketEntry *)(StateBase + pHeader->TableOffset);
+
+  for (uint32_t j = 0; j < pHeader->TableSize; j++) {
+    struct PacketEntry *pEntry = &pTable[j];
+
+    if (pEntry->ThePacket != NULL || pEntry->Compressed != NULL) {
+      return j;
+    }
+
+    if (pEntry->PayloadSize != 0 &&
+        (pEntry->PayloadSize > DEFAULT_READ_BUFFER ||
+         pEntry->ArenaOffset > pHeader->ArenaBytes ||
+         pEntry->PayloadSize > pHeader->ArenaBytes - pEntry->ArenaOffset)) {
+      return j;
+    }
+  }
+
+  return -1;
+}
+
+char loadProcessingState(const char *pFileName) {
+
+  struct stat fileStat;
+  struct StateHeader *pHeader;
+  int fd;
+
+  fd = open(pFileName, O_RDONLY);
+
+  if (fd < 0) {
+    printf("* Error: Unable to open the state file %s\n", pFileName);
+    return 0;
+  }
+
+  if (fstat(fd, &fileStat) != 0 ||
+      (uint64_t)fileStat.st_size < sizeof(struct StateHeader)) {
+    printf("* Error: State file %s is too small\n", pFileName);
+    close(fd);
+    return 0;
+  }
+
+  // Private mapping so table updates during this run never reach the file
+  StateBase = (uint8_t *)mmap(NULL, fileStat.st_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (StateBase == MAP_FAILED) {
+    printf("* Error: Unable to map the state file %s\n", pFileName);
+    StateBase = NULL;
+    return 0;
+  }
+
+  pHeader = (struct StateHeader *)StateBase;
+
+  if (memcmp(pHeader->Magic, STATE_MAGIC, sizeof(pHeader->Magic)) != 0 ||
+      pHeader->Version != STATE_VERSION ||
+      pHeader->EntrySize != sizeof(struct PacketEntry)) {
+    printf("* Error: %s is not a compatible state file\n", pFileName);
+    munmap(StateBase, fileStat.st_size);
+    StateBase = NULL;
+    return 0;
+  }
+
+  if (pHeader->TableSize == 0 || pHeader->TableSize > INT_MAX ||
+      pHeader->TableOffset > (uint64_t)fileStat.st_size ||
+      pHeader->ArenaOffset > (uint64_t)fileStat.st_size ||
+      pHeader->TableOffset + (uint64_t)pHeader->TableSize *
+                                 sizeof(struct PacketEntry) >
+          (uint64_t)fileStat.st_size ||
+      pHeader->ArenaBytes >
+          (uint64_t)fileStat.st_size - pHeader->ArenaOffset) {
+    printf("* Error: State file %s is truncated\n", pFileName);
+    munmap(StateBase, fileStat.st_size);
+    StateBase = NULL;
+    return 0;
+  }
+
+  int nBad = checkStateEntries(pHeader);
+
+  if (nBad >= 0) {
+    printf("* Error: State file %s has a bad entry (%d)\n", pFileName, nBad);
+    munmap(StateBase, fileStat.st_size);
+    StateBase = NULL;
+    return 0;
+  }
+
+  gStateLoaded = *pHeader;
+
+  initializeProcessingStats();
+
+  StateArena = StateBase + pHeader->ArenaOffset;
+  return attachProcessingTable(
+      (struct PacketEntry *)(StateBase + pHeader->TableOffset),
+      pHeader->TableSize);
+}
+
+char saveProcessingState(const char *pFileName) {
+
+  struct StateHeader header;
+  struct PacketEntry entry;
+  static const uint8_t zeroPad[STATE_ALIGN];
+  char *pTempName;
+  FILE *pFile;
+  uint64_t nOffset;
+  uint64_t pendingCount = 0;
+  uint64_t pendingBytes = 0;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.Magic, STATE_MAGIC, sizeof(header.Magic));
+  header.Version = STATE_VERSION;
+  header.EntrySize = sizeof(struct PacketEntry);
+  header.TableSize = BigTableSize;
+  header.TableOffset = STATE_ALIGN;
+  header.ArenaOffset =
+      alignState(header.TableOffset +
+                 (uint64_t)BigTableSize * sizeof(struct PacketEntry));
+
+  for (int j = 0; j < BigTableSize; j++) {
+    if (BigTable[j].PayloadSize != 0) {
+      header.EntriesUsed++;
+      header.ArenaBytes += BigTable[j].PayloadSize;
+      pendingCount += BigTable[j].HitCount;
+      pendingBytes += BigTable[j].RedundantBytes;
+    }
+  }
+
+  header.SeenCount = gStateLoaded.SeenCount + gPacketSeenCount;
+  header.SeenBytes = gStateLoaded.SeenBytes + gPacketSeenBytes;
+  header.HitCount = gStateLoaded.HitCount + gPacketHitCount + pendingCount;
+  header.HitBytes = gStateLoaded.HitBytes + gPacketHitBytes + pendingBytes;
+
+  // Write to a side file and rename it over, the old snapshot may be mapped
+  pTempName = (char *)malloc(strlen(pFileName) + 5);
+
+  if (pTempName == NULL) {
+    printf("* Error: malloc failed while saving the state\n");
+    return 0;
+  }
+
+  sprintf(pTempName, "%s.tmp", pFileName);
+  pFile = fopen(pTempName, "wb");
+
+  if (pFile == NULL) {
+    printf("* Error: Unable to create the state file %s\n", pTempName);
+    free(pTempName);
+    return 0;
+  }
+
+  fwrite(&header, sizeof(header), 1, pFile);
+  fwrite(zeroPad, 1, header.TableOffset - sizeof(header), pFile);
+
+  /* Entries keep their fingerprints; counters were folded into the header */
+  nOffset = 0;
+
+  for (int j = 0; j < BigTableSize; j++) {
+    memset(&entry, 0, sizeof(entry));
+
+    if (BigTable[j].PayloadSize != 0) {
+      entry.Fingerprint = BigTable[j].Fingerprint;
+      entry.PayloadSize = BigTable[j].PayloadSize;
+      entry.ArenaOffset = nOffset;
+      nOffset += BigTable[j].PayloadSize;
+    }
+
+    fwrite(&entry, sizeof(entry), 1, pFile);
+  }
+
+  fwrite(zeroPad, 1,
+         header.ArenaOffset - header.TableOffset -
+             (uint64_t)BigTableSize * sizeof(struct PacketEntry),
+         pFile);
+
+  /* The payload arena, in table order */
+  for (int j = 0; j < BigTableSize; j++) {
+    if (BigTable[j].PayloadSize != 0) {
+      fwrite(getEntryPayload(&BigTable[j]), 1, BigTable[j].PayloadSize, pFile);
+    }
+  }
+
+  if (fflush(pFile) != 0 || ferror(pFile) || fsync(fileno(pFile)) != 0) {
+    printf("* Error: Failed writing the state file %s\n", pTempName);
+    fclose(pFile);
+    remove(pTempName);
+    free(pTempName);
+    return 0;
+  }
+
+  fclose(pFile);
+
+  if (rename(pTempName, pFileName) != 0) {
+    printf("* Error: Unable to replace the state file %s\n", pFileName);
+    remove(pTempName);
+    free(pTempName);
+    return 0;
+  }
+
+  free(pTempName);
+
+  printf("MAIN: Saved %u of %d table entries (%lu payload bytes) to %s\n",
+         header.EntriesUsed, BigTableSize, (unsigned long)header.ArenaBytes,
+         pFileName);
+  return 1;
+}
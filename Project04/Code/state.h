@@ -0,0 +1,64 @@
+/* state.h : Checkpoint and warm-start of the redundancy table */
+
+#ifndef __STATE_H
+#define __STATE_H
+
+#include <stdint.h>
+
+#define STATE_MAGIC         "REDSTAT1"
+#define STATE_VERSION       1
+
+/* Snapshots are laid out so that the table and arena are page aligned */
+#define STATE_ALIGN         4096
+
+/* The front matter of a snapshot file
+ *
+ *  The file is the header, then BigTable as an array of PacketEntry with all
+ *  packet pointers cleared, then the payload arena that the entries reference
+ *  by ArenaOffset.  Loading maps the whole file once and uses the table in
+ *  place (copy on write) rather than rebuilding it.
+ *
+ *  The counters are cumulative over every run that fed into the snapshot,
+ *  including the hits still pending in the saved entries.
+ */
+struct StateHeader
+{
+    char        Magic[8];
+    uint32_t    Version;
+
+    /* Guards against loading a snapshot written by a different build */
+    uint32_t    EntrySize;
+
+    uint32_t    TableSize;
+    uint32_t    EntriesUsed;
+
+    uint64_t    TableOffset;
+    uint64_t    ArenaOffset;
+    uint64_t    ArenaBytes;
+
+    uint64_t    SeenCount;
+    uint64_t    SeenBytes;
+    uint64_t    HitCount;
+    uint64_t    HitBytes;
+};
+
+/* Counters carried in by a loaded snapshot (zero when cold started) */
+extern struct StateHeader gStateLoaded;
+
+/** Map a snapshot file and use it as BigTable in place of initializeProcessing
+ * @param pFileName  Path of a snapshot written by saveProcessingState
+ * @returns 1 if successful, 0 otherwise
+ */
+char loadProcessingState (const char * pFileName);
+
+/** Write BigTable and the counters out as a snapshot.  Must be called before
+ * tallyProcessing since tallying empties the table.
+ * @param pFileName  Path of the snapshot to write (replaced atomically)
+ * @returns 1 if successful, 0 otherwise
+ */
+char saveProcessingState (const char * pFileName);
+
+/* Base of the payload arena of the loaded snapshot (NULL if none) */
+uint8_t * getStateArena ();
+
+#endif
@@ -0,0 +1,349 @@
+/* stats.c : Machine-readable statistics records (-stats-format json|csv)
+ *
+ * Every consumer owns one slot of counters and is the only thread writing
+ * it.  The reader sums the slots for its interval records with relaxed
+ * atomic loads, so the hot path takes no lock: a consumer just bumps its
+ * own counters with relaxed stores.  Per-thread and per-file records are
+ * written after the threads have been joined.
+ *
+ * All records share one set of fields:
+ *   record (file, interval or thread), file, thread, time_s, packets, bytes,
+ *   hits, redundant_bytes, queue_depth, stall_s, runtime_s
+ *
+ * An interval is seen from the reader: its counts are the change since the
+ * last interval, its stall is the reader waiting on a full queue and its
+ * depth is the queue after the last push.  A thread's stall is the time it
+ * waited for a packet and for the table lock, a file sums its threads and
+ * gives the deepest the queue got.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+struct ThreadStats
+{
+    uint64_t    Packets;
+    uint64_t    Bytes;
+    uint64_t    Hits;
+    uint64_t    RedundantBytes;
+    uint64_t    StallNs;
+    uint64_t    StartNs;
+};
+
+/* Totals of a file, or of an interval from the reader's view */
+struct StatsRecord
+{
+    const char *    Kind;
+    int             Thread;
+    uint64_t        Packets;
+    uint64_t        Bytes;
+    uint64_t        Hits;
+    uint64_t        RedundantBytes;
+    int             QueueDepth;
+    uint64_t        StallNs;
+    uint64_t        RuntimeNs;
+};
+
+char gStatsFormat = STATS_NONE;
+
+static FILE *StatsOut;
+static uint64_t StatsIntervalNs;
+static uint64_t StatsStartNs;
+static const char *StatsFileName;
+
+/* One slot per consumer the run can start (-threads auto grows up to its cap) */
+static struct ThreadStats *StatsThreads = NULL;
+static int StatsSlots = 0;
+static __thread struct ThreadStats *StatsLocal = NULL;
+
+/* State of the reader (one reader at a time) */
+static uint64_t ReaderPackets, ReaderBytes, ReaderStallNs;
+static uint64_t ReaderFileStartNs, ReaderNextNs;
+static int ReaderMaxDepth;
+
+/* Totals at the last interval record, to write differences */
+static struct StatsRecord LastInterval;
+
+static uint64_t readClock() {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+uint64_t statsClock() {
+
+  return gStatsFormat != STATS_NONE ? readClock() : 0;
+}
+
+char initializeStats(const char *Format, const char *OutFile,
+                     double Interval, int Consumers) {
+
+  if (strcmp(Format, "json") == 0) {
+    gStatsFormat = STATS_JSON;
+  } else if (strcmp(Format, "csv") == 0) {
+    gStatsFormat = STATS_CSV;
+  } else {
+    printf("* Error: Unknown stats format %s (json or csv)\n", Format);
+    return 0;
+  }
+
+  StatsThreads = calloc(Consumers, sizeof(struct ThreadStats));
+
+  if (StatsThreads == NULL) {
+    printf("* Error: Unable to allocate stats for %d threads\n", Consumers);
+    gStatsFormat = STATS_NONE;
+    return 0;
+  }
+
+  StatsSlots = Consumers;
+  StatsOut = OutFile != NULL ? fopen(OutFile, "w") : stderr;
+
+  if (StatsOut == NULL) {
+    printf("* Error: Unable to open the stats file %s\n", OutFile);
+    gStatsFormat = STATS_NONE;
+    return 0;
+  }
+
+  StatsIntervalNs = (uint64_t)(Interval * 1e9);
+  StatsStartNs = readClock();
+
+  if (gStatsFormat == STATS_CSV) {
+    fprintf(StatsOut, "record,file,thread,time_s,packets,bytes,hits,"
+                      "redundant_bytes,queue_depth,stall_s,runtime_s\n");
+  }
+
+  return 1;
+}
+
+void writeCsvText(FILE *pFile, const char *pText) {
+
+  fputc('"', pFile);
+
+  for (; *pText != '\0'; pText++) {
+    if (*pText == '"') {
+      fputc('"', pFile);
+    }
+
+    fputc(*pText, pFile);
+  }
+
+  fputc('"', pFile);
+}
+
+/* Write a JSON string, escaping quotes, backslashes and control characters */
+static void writeJsonText(FILE *pFile, const char *pText) {
+
+  fputc('"', pFile);
+
+  for (; *pText != '\0'; pText++) {
+    unsigned char nChar = (unsigned char)*pText;
+
+    if (nChar == '"' || nChar == '\\') {
+      fprintf(pFile, "\\%c", nChar);
+    } else if (nChar < 0x20) {
+      fprintf(pFile, "\\u%04x", nChar);
+    } else {
+      fputc(nChar, pFile);
+    }
+  }
+
+  fputc('"', pFile);
+}
+
+static void writeRecord(struct StatsRecord *pRecord) {
+
+  double nTime = (readClock() - StatsStartNs) / 1e9;
+
+  if (gStatsFormat == STATS_JSON) {
+    fprintf(StatsOut, "{\"record\":\"%s\",\"file\":", pRecord->Kind);
+    writeJsonText(StatsOut, StatsFileName);
+    fprintf(StatsOut,
+            ",\"thread\":%d,"
+            "\"time_s\":%.6f,\"packets\":%lu,\"bytes\":%lu,\"hits\":%lu,"
+            "\"redundant_bytes\":%lu,\"queue_depth\":%d,\"stall_s\":%.6f,"
+            "\"runtime_s\":%.6f}\n",
+            pRecord->Thread, nTime,
+            (unsigned long)pRecord->Packets, (unsigned long)pRecord->Bytes,
+            (unsigned long)pRecord->Hits,
+            (unsigned long)pRecord->RedundantBytes, pRecord->QueueDepth,
+            pRecord->StallNs / 1e9, pRecord->RuntimeNs / 1e9);
+  } else {
+    fprintf(StatsOut, "%s,", pRecord->Kind);
+    writeCsvText(StatsOut, StatsFileName);
+    fprintf(StatsOut, ",%d,%.6f,%lu,%lu,%lu,%lu,%d,%.6f,%.6f\n",
+            pRecord->Thread, nTime,
+            (unsigned long)pRecord->Packets, (unsigned long)pRecord->Bytes,
+            (unsigned long)pRecord->Hits,
+            (unsigned long)pRecord->RedundantBytes, pRecord->QueueDepth,
+            pRecord->StallNs / 1e9, pRecord->RuntimeNs / 1e9);
+  }
+
+  fflush(StatsOut);
+}
+
+void beginStatsFile(const char *FileName) {
+
+  if (gStatsFormat == STATS_NONE) {
+    return;
+  }
+
+  memset(StatsThreads, 0, StatsSlots * sizeof(struct ThreadStats));
+  memset(&LastInterval, 0, sizeof(LastInterval));
+  StatsFileName = FileName;
+  ReaderPackets = 0;
+  ReaderBytes = 0;
+  ReaderStallNs = 0;
+  ReaderMaxDepth = 0;
+  ReaderFileStartNs = readClock();
+  ReaderNextNs = ReaderFileStartNs + StatsIntervalNs;
+}
+
+void attachStatsThread(int Index) {
+
+  if (gStatsFormat == STATS_NONE || Index >= StatsSlots) {
+    StatsLocal = NULL;
+    return;
+  }
+
+  StatsLocal = &StatsThreads[Index];
+  StatsLocal->StartNs = readClock();
+}
+
+/* Add to a counter of the calling thread that the reader may be loading */
+static void bumpCounter(uint64_t *pCounter, uint64_t Amount) {
+
+  __atomic_store_n(pCounter, *pCounter + Amount, __ATOMIC_RELAXED);
+}
+
+void countStatsPacket(struct Packet *pPacket) {
+
+  if (StatsLocal == NULL) {
+    return;
+  }
+
+  bumpCounter(&StatsLocal->Packets, 1);
+  bumpCounter(&StatsLocal->Bytes, pPacket->LengthIncluded);
+}
+
+void countStatsStall(uint64_t Start) {
+
+  if (StatsLocal == NULL) {
+    return;
+  }
+
+  bumpCounter(&StatsLocal->StallNs, readClock() - Start);
+}
+
+void countStatsHit(uint32_t RedundantBytes) {
+
+  if (StatsLocal == NULL) {
+    return;
+  }
+
+  bumpCounter(&StatsLocal->Hits, 1);
+  bumpCounter(&StatsLocal->RedundantBytes, RedundantBytes);
+}
+
+void tickStatsReader(uint32_t Length, int QueueDepth, uint64_t StallNs) {
+
+  struct StatsRecord record;
+  uint64_t nNow;
+
+  if (gStatsFormat == STATS_NONE) {
+    return;
+  }
+
+  ReaderPackets++;
+  ReaderBytes += Length;
+  ReaderStallNs += StallNs;
+
+  if (QueueDepth > ReaderMaxDepth) {
+    ReaderMaxDepth = QueueDepth;
+  }
+
+  if (ReaderPackets % STATS_CLOCK_EVERY != 0) {
+    return;
+  }
+
+  nNow = readClock();
+
+  if (nNow < ReaderNextNs) {
+    return;
+  }
+
+  ReaderNextNs = nNow + StatsIntervalNs;
+
+  /* The reader's view of the totals, then the change since the last one */
+  memset(&record, 0, sizeof(record));
+  record.Kind = "interval";
+  record.Thread = -1;
+  record.Packets = ReaderPackets;
+  record.Bytes = ReaderBytes;
+  record.StallNs = ReaderStallNs;
+
+  for (int j = 0; j < StatsSlots; j++) {
+    record.Hits += __atomic_load_n(&StatsThreads[j].Hits, __ATOMIC_RELAXED);
+    record.RedundantBytes +=
+        __atomic_load_n(&StatsThreads[j].RedundantBytes, __ATOMIC_RELAXED);
+  }
+
+  struct StatsRecord delta = record;
+  delta.Packets -= LastInterval.Packets;
+  delta.Bytes -= LastInterval.Bytes;
+  delta.Hits -= LastInterval.Hits;
+  delta.RedundantBytes -= LastInterval.RedundantBytes;
+  delta.StallNs -= LastInterval.StallNs;
+  delta.QueueDepth = QueueDepth;
+  delta.RuntimeNs = nNow - ReaderFileStartNs;
+
+  LastInterval = record;
+  writeRecord(&delta);
+}
+
+void endStatsFile(int Consumers) {
+
+  struct StatsRecord record, total;
+  uint64_t nNow;
+
+  if (gStatsFormat == STATS_NONE) {
+    return;
+  }
+
+  nNow = readClock();
+  memset(&total, 0, sizeof(total));
+  total.Kind = "file";
+  total.Thread = -1;
+  total.QueueDepth = ReaderMaxDepth;
+  total.RuntimeNs = nNow - ReaderFileStartNs;
+
+  for (int j = 0; j < Consumers && j < StatsSlots; j++) {
+    struct ThreadStats *pThread = &StatsThreads[j];
+
+    memset(&record, 0, sizeof(record));
+    record.Kind = "thread";
+    record.Thread = j;
+    record.Packets = pThread->Packets;
+    record.Bytes = pThread->Bytes;
+    record.Hits = pThread->Hits;
+    record.RedundantBytes = pThread->RedundantBytes;
+    record.StallNs = pThread->StallNs;
+    record.RuntimeNs = pThread->StartNs ? nNow - pThread->StartNs : 0;
+    writeRecord(&record);
+
+    total.Packets += record.Packets;
+    total.Bytes += record.Bytes;
+    total.Hits += record.Hits;
+    total.RedundantBytes += record.RedundantBytes;
+    total.StallNs += record.StallNs;
+  }
+
+  writeRecord(&total);
+}
@@ -0,0 +1,63 @@
+/* stats.h : Machine-readable statistics records (-stats-format json|csv) */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "packet.h"
+
+#define STATS_NONE          0
+#define STATS_JSON          1
+#define STATS_CSV           2
+
+/* Packets the reader pushes between looks at the interval clock */
+#define STATS_CLOCK_EVERY   256
+
+/* Which format the records are written in (STATS_NONE if not at all) */
+extern char gStatsFormat;
+
+/** Start writing records
+ * @param Format    "json" (one object per line) or "csv"
+ * @param OutFile   Where to write them, NULL for stderr
+ * @param Interval  Seconds between interval records from the reader
+ * @param Consumers Most consumer threads a file can be processed with
+ * @returns 1 if successful, 0 otherwise
+ */
+char initializeStats (const char * Format, const char * OutFile, double Interval,
+                      int Consumers);
+
+/* Reset the per-file and per-thread counters before a file is processed */
+void beginStatsFile (const char * FileName);
+
+/* Give the calling consumer thread its slot (0 to Consumers - 1) */
+void attachStatsThread (int Index);
+
+/* A monotonic timestamp in nanoseconds, zero when no records are written */
+uint64_t statsClock ();
+
+/* Count a packet the calling consumer took off the queue */
+void countStatsPacket (struct Packet * pPacket);
+
+/* Count the time since Start the calling consumer spent waiting */
+void countStatsStall (uint64_t Start);
+
+/* Count a duplicate payload found by the calling consumer */
+void countStatsHit (uint32_t RedundantBytes);
+
+/** Count a packet pushed by the reader and write an interval record when
+ * one is due.  Only the reader calls this, and never with a lock held.
+ * @param Length      Captured length of the packet that was pushed
+ * @param QueueDepth  Packets waiting in the queue after the push
+ * @param StallNs     How long the reader waited for room in the queue
+ */
+void tickStatsReader (uint32_t Length, int QueueDepth, uint64_t StallNs);
+
+/* Write the per-thread and per-file records once the threads are joined */
+void endStatsFile (int Consumers);
+
+/* Write text as a quoted CSV field, doubling any quotes inside it */
+void writeCsvText (FILE * pFile, const char * pText);
+
+#endif
@@ -0,0 +1,401 @@
+/* steal.c : Work-stealing consumer deques (-steal)
+ *
+ * With one shared queue every consumer takes the stack lock for every
+ * packet, and a consumer stuck on a jumbo payload holds up nobody but
+ * leaves the others to fight over the lock.  Here each consumer owns a
+ * Chase-Lev deque instead:
+ *
+ *  - the reader hands packets out in batches of STEAL_BATCH, round-robin,
+ *    to a small inbox per consumer (one lock per batch, not per packet);
+ *  - a consumer moves its whole inbox into its deque once the deque is
+ *    empty, oldest packet at the bottom, and takes packets from the bottom
+ *    without a lock, so it works through its share in read order;
+ *  - a consumer with nothing in its deque or inbox takes the newest packet
+ *    from the top of a peer's deque (the one the peer would get to last),
+ *    which only costs a compare-and-swap.
+ *
+ * The deques never grow: a consumer only refills an empty deque, and the
+ * inbox holds fewer packets than it has slots.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "stats.h"
+#include "steal.h"
+
+struct StealDeque
+{
+    /* Thieves take from the top, the owner pushes and pops at the bottom */
+    int64_t             Top;
+    int64_t             Bottom;
+    struct Packet *     Slots[STEAL_DEQUE_SIZE];
+};
+
+struct StealInbox
+{
+    pthread_mutex_t     Lock;
+
+    /* A batch came in (or the file is done), or the owner made room */
+    pthread_cond_t      Arrived;
+    pthread_cond_t      Drained;
+
+    struct Packet *     Packets[STEAL_INBOX_SIZE];
+    int                 Head;
+    int                 Count;
+
+    /* Non-zero once the reader will hand over nothing more */
+    char                Done;
+};
+
+struct StealConsumer
+{
+    struct StealDeque   Deque;
+    struct StealInbox   Inbox;
+
+    /* Packets taken, how many of them came from peers, and how many peers
+     * took from this one (added to by the thieves) */
+    uint64_t            Packets;
+    uint64_t            Steals;
+    uint64_t            Stolen;
+
+    /* Time spent with a packet and looking for one, and when the current
+     * packet was taken (zero if there is none) */
+    uint64_t            BusyNs;
+    uint64_t            IdleNs;
+    uint64_t            Mark;
+};
+
+char gStealOn = 0;
+
+static struct StealConsumer *StealConsumers = NULL;
+static int StealCount = 0;
+
+/* The reader's partial batch, who gets the next one, and how deep the
+ * inbox the last batch went to was (only the reader touches these) */
+static struct Packet *ReaderBatch[STEAL_BATCH];
+static int ReaderBatchSize = 0;
+static int ReaderNext = 0;
+static int ReaderDepth = 0;
+
+static uint64_t stealClock() {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Owner only: add a packet at the bottom (there is always room, see above) */
+static void pushDeque(struct StealDeque *pDeque, struct Packet *pPacket) {
+
+  int64_t b = __atomic_load_n(&pDeque->Bottom, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&pDeque->Slots[b & (STEAL_DEQUE_SIZE - 1)], pPacket,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&pDeque->Bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/* Owner only: take the packet at the bottom (the oldest, see refillDeque),
+ * NULL if a thief got the last one */
+static struct Packet *popDeque(struct StealDeque *pDeque) {
+
+  int64_t b = __atomic_load_n(&pDeque->Bottom, __ATOMIC_RELAXED) - 1;
+  int64_t t;
+  struct Packet *pPacket = NULL;
+
+  __atomic_store_n(&pDeque->Bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  t = __atomic_load_n(&pDeque->Top, __ATOMIC_RELAXED);
+
+  if (t <= b) {
+    pPacket = __atomic_load_n(&pDeque->Slots[b & (STEAL_DEQUE_SIZE - 1)],
+                              __ATOMIC_RELAXED);
+
+    // The last packet goes to whoever moves the top past it first
+    if (t == b) {
+
+      if (!__atomic_compare_exchange_n(&pDeque->Top, &t, t + 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        pPacket = NULL;
+      }
+
+      __atomic_store_n(&pDeque->Bottom, b + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&pDeque->Bottom, b + 1, __ATOMIC_RELAXED);
+  }
+
+  return pPacket;
+}
+
+/* Any thread: take the packet at the top (the newest), NULL if empty or
+ * another thief won */
+static struct Packet *stealDeque(struct StealDeque *pDeque) {
+
+  int64_t t = __atomic_load_n(&pDeque->Top, __ATOMIC_ACQUIRE);
+  int64_t b;
+  struct Packet *pPacket;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  b = __atomic_load_n(&pDeque->Bottom, __ATOMIC_ACQUIRE);
+
+  if (t >= b) {
+    return NULL;
+  }
+
+  pPacket = __atomic_load_n(&pDeque->Slots[t & (STEAL_DEQUE_SIZE - 1)],
+                            __ATOMIC_RELAXED);
+
+  if (!__atomic_compare_exchange_n(&pDeque->Top, &t, t + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+
+  return pPacket;
+}
+
+char initializeSteal(int Consumers) {
+
+  StealConsumers = (struct StealConsumer *)calloc(
+      Consumers, sizeof(struct StealConsumer));
+
+  if (StealConsumers == NULL) {
+    printf("* Error: Unable to allocate the deques for -steal\n");
+    return 0;
+  }
+
+  for (int j = 0; j < Consumers; j++) {
+    pthread_mutex_init(&StealConsumers[j].Inbox.Lock, 0);
+    pthread_cond_init(&StealConsumers[j].Inbox.Arrived, 0);
+    pthread_cond_init(&StealConsumers[j].Inbox.Drained, 0);
+  }
+
+  StealCount = Consumers;
+  gStealOn = 1;
+  return 1;
+}
+
+void beginStealFile() {
+
+  for (int j = 0; j < StealCount; j++) {
+    StealConsumers[j].Deque.Top = 0;
+    StealConsumers[j].Deque.Bottom = 0;
+    StealConsumers[j].Inbox.Head = 0;
+    StealConsumers[j].Inbox.Count = 0;
+    StealConsumers[j].Inbox.Done = 0;
+    StealConsumers[j].Mark = 0;
+  }
+
+  ReaderBatchSize = 0;
+  ReaderNext = 0;
+  ReaderDepth = 0;
+}
+
+/* Hand the reader's batch to the next consumer, waiting for room if its
+ * inbox is full */
+static uint64_t handOffBatch() {
+
+  struct StealInbox *pInbox = &StealConsumers[ReaderNext].Inbox;
+  uint64_t nStall = 0;
+
+  pthread_mutex_lock(&pInbox->Lock);
+
+  if (pInbox->Count + ReaderBatchSize > STEAL_INBOX_SIZE) {
+    nStall = statsClock();
+  }
+
+  while (pInbox->Count + ReaderBatchSize > STEAL_INBOX_SIZE) {
+    pthread_cond_wait(&pInbox->Drained, &pInbox->Lock);
+  }
+
+  if (nStall) {
+    nStall = statsClock() - nStall;
+  }
+
+  for (int j = 0; j < ReaderBatchSize; j++) {
+    pInbox->Packets[(pInbox->Head + pInbox->Count) % STEAL_INBOX_SIZE] =
+        ReaderBatch[j];
+    pInbox->Count++;
+  }
+
+  ReaderDepth = pInbox->Count;
+  pthread_cond_signal(&pInbox->Arrived);
+  pthread_mutex_unlock(&pInbox->Lock);
+
+  ReaderBatchSize = 0;
+  ReaderNext = (ReaderNext + 1) % StealCount;
+  return nStall;
+}
+
+int queueStealPacket(struct Packet *pPacket, uint64_t *pStall) {
+
+  *pStall = 0;
+  ReaderBatch[ReaderBatchSize++] = pPacket;
+
+  if (ReaderBatchSize == STEAL_BATCH) {
+    *pStall = handOffBatch();
+  }
+
+  return ReaderDepth;
+}
+
+void flushStealBatch() {
+
+  if (ReaderBatchSize > 0) {
+    handOffBatch();
+  }
+}
+
+void finishStealFile() {
+
+  for (int j = 0; j < StealCount; j++) {
+    struct StealInbox *pInbox = &StealConsumers[j].Inbox;
+
+    pthread_mutex_lock(&pInbox->Lock);
+    pInbox->Done = 1;
+    pthread_cond_broadcast(&pInbox->Arrived);
+    pthread_mutex_unlock(&pInbox->Lock);
+  }
+}
+
+/* Move the whole inbox into the (empty) deque, oldest packet at the bottom
+ * so the owner still works through its share in read order
+ * @returns How many packets were moved */
+static int refillDeque(struct StealConsumer *pSelf, char *pDone) {
+
+  struct StealInbox *pInbox = &pSelf->Inbox;
+  int nMoved;
+
+  pthread_mutex_lock(&pInbox->Lock);
+
+  nMoved = pInbox->Count;
+
+  for (int j = nMoved - 1; j >= 0; j--) {
+    pushDeque(&pSelf->Deque,
+              pInbox->Packets[(pInbox->Head + j) % STEAL_INBOX_SIZE]);
+  }
+
+  pInbox->Head = (pInbox->Head + nMoved) % STEAL_INBOX_SIZE;
+  pInbox->Count = 0;
+  *pDone = pInbox->Done;
+
+  if (nMoved > 0) {
+    pthread_cond_signal(&pInbox->Drained);
+  }
+
+  pthread_mutex_unlock(&pInbox->Lock);
+  return nMoved;
+}
+
+/* Wait a little for a batch so peers are looked at again before long */
+static void napForBatch(struct StealInbox *pInbox) {
+
+  struct timespec until;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_nsec += STEAL_NAP_US * 1000L;
+
+  if (until.tv_nsec >= 1000000000L) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&pInbox->Lock);
+
+  if (pInbox->Count == 0 && !pInbox->Done) {
+    pthread_cond_timedwait(&pInbox->Arrived, &pInbox->Lock, &until);
+  }
+
+  pthread_mutex_unlock(&pInbox->Lock);
+}
+
+struct Packet *takeStealPacket(int Index) {
+
+  struct StealConsumer *pSelf = &StealConsumers[Index];
+  struct Packet *pPacket = NULL;
+  uint64_t nStart = stealClock();
+  char bDone = 0;
+
+  // Whatever happened since the last packet was taken was work on it
+  if (pSelf->Mark) {
+    pSelf->BusyNs += nStart - pSelf->Mark;
+  }
+
+  while (1) {
+    pPacket = popDeque(&pSelf->Deque);
+
+    if (pPacket != NULL) {
+      break;
+    }
+
+    if (refillDeque(pSelf, &bDone) > 0) {
+      continue;
+    }
+
+    for (int k = 1; k < StealCount && pPacket == NULL; k++) {
+      struct StealConsumer *pPeer = &StealConsumers[(Index + k) % StealCount];
+
+      pPacket = stealDeque(&pPeer->Deque);
+
+      if (pPacket != NULL) {
+        pSelf->Steals++;
+        __atomic_fetch_add(&pPeer->Stolen, 1, __ATOMIC_RELAXED);
+      }
+    }
+
+    if (pPacket != NULL) {
+      break;
+    }
+
+    // Nothing more is coming, and what peers still hold they will finish
+    if (bDone) {
+      break;
+    }
+
+    napForBatch(&pSelf->Inbox);
+  }
+
+  pSelf->Mark = stealClock();
+  pSelf->IdleNs += pSelf->Mark - nStart;
+
+  if (pPacket == NULL) {
+    pSelf->Mark = 0;
+  } else {
+    pSelf->Packets++;
+  }
+
+  return pPacket;
+}
+
+void printSteal() {
+
+  uint64_t nSteals = 0;
+  uint64_t nPackets = 0;
+
+  printf("Work stealing (%d consumers, batches of %d):\n", StealCount,
+         STEAL_BATCH);
+
+  for (int j = 0; j < StealCount; j++) {
+    struct StealConsumer *pConsumer = &StealConsumers[j];
+    uint64_t nTotal = pConsumer->BusyNs + pConsumer->IdleNs;
+
+    printf("  Consumer %d: %10lu packets, %8lu stolen from peers, %8lu taken "
+           "by peers, %5.1f%% busy\n",
+           j, (unsigned long)pConsumer->Packets,
+           (unsigned long)pConsumer->Steals,
+           (unsigned long)__atomic_load_n(&pConsumer->Stolen, __ATOMIC_RELAXED),
+           nTotal ? 100.0 * pConsumer->BusyNs / nTotal : 0.0);
+
+    nSteals += pConsumer->Steals;
+    nPackets += pConsumer->Packets;
+  }
+
+  printf("  Steals: %lu of %lu packets (%.2f%%)\n", (unsigned long)nSteals,
+         (unsigned long)nPackets,
+         nPackets ? 100.0 * nSteals / nPackets : 0.0);
+}
@@ -0,0 +1,59 @@
+/* steal.h : Work-stealing consumer deques (-steal) */
+
+#ifndef __STEAL_H
+#define __STEAL_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/* Packets the reader hands to one consumer before moving to the next */
+#define STEAL_BATCH         16
+
+/* Packets waiting in a consumer's inbox before the reader has to wait */
+#define STEAL_INBOX_SIZE    (4 * STEAL_BATCH)
+
+/* Slots in each deque (a power of two, at least STEAL_INBOX_SIZE) */
+#define STEAL_DEQUE_SIZE    128
+
+/* How long an idle consumer sleeps before looking for work to steal again */
+#define STEAL_NAP_US        200
+
+/* Non-zero if consumers take packets from their own deques (-steal) */
+extern char gStealOn;
+
+/** Set up one deque and inbox per consumer
+ * @param Consumers  Consumer threads each file is processed with
+ * @returns 1 if successful, 0 otherwise
+ */
+char initializeSteal (int Consumers);
+
+/* Empty the deques and inboxes before the consumers of a file start */
+void beginStealFile ();
+
+/** Queue a packet for the consumers, handing a full batch to the next one
+ * round-robin.  Only the reader calls this.
+ * @param pPacket  The packet to queue
+ * @param pStall   Set to how long the reader waited for room (statsClock)
+ * @returns Packets waiting in the inbox the batch went to (0 if none was
+ *          handed over)
+ */
+int queueStealPacket (struct Packet * pPacket, uint64_t * pStall);
+
+/* Hand over the reader's partial batch at the end of a file */
+void flushStealBatch ();
+
+/* Let the consumers stop once everything queued has been taken */
+void finishStealFile ();
+
+/** Take a packet for a consumer: the oldest left in its own deque, otherwise
+ * from its inbox, otherwise the newest left in a peer's deque
+ * @param Index  The consumer (0 to Consumers - 1)
+ * @returns A packet to process, NULL once the file is done
+ */
+struct Packet * takeStealPacket (int Index);
+
+/* Print steals and how busy each consumer was across all files */
+void printSteal ();
+
+#endif
@@ -0,0 +1,116 @@
+/* tablebench.c : Lookup cost of BigTable with and without huge pages
+ *
+ * Fills a table of each size with fingerprints and then times random probes
+ * that do what processPayload does before the byte compare: index by the
+ * fingerprint, then check the fingerprint and size of the slot.  Each size
+ * is run with 4 KB pages and again with huge pages (see hugepage.h), and
+ * the bytes the kernel backed with transparent huge pages are shown since
+ * it may not grant them all.
+ *
+ * Usage: tablebench [PROBES] [ENTRIES ...]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hugepage.h"
+#include "pcap-process.h"
+
+#define BENCH_PROBES        20000000
+
+static uint64_t splitmix64(uint64_t *pState) {
+
+  uint64_t z = (*pState += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static double nowSeconds() {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/** Time the probes against one table
+ * @returns Nanoseconds per lookup, or a negative value on failure
+ */
+static double timeLookups(uint64_t Entries, uint64_t Probes,
+                          size_t *pBacked) {
+
+  size_t nLength = sizeof(struct PacketEntry) * Entries;
+  struct PacketEntry *pTable = (struct PacketEntry *)allocateLarge(nLength);
+  uint64_t nState = 1, nHits = 0;
+  double nStart;
+
+  if (pTable == NULL) {
+    return -1;
+  }
+
+  /* Every slot in use, as in a warm table */
+  for (uint64_t j = 0; j < Entries; j++) {
+    pTable[j].Fingerprint = splitmix64(&nState);
+    pTable[j].PayloadSize = 64 + (pTable[j].Fingerprint & 1023);
+  }
+
+  nState = 2;
+  nStart = nowSeconds();
+
+  for (uint64_t j = 0; j < Probes; j++) {
+    uint64_t nHash = splitmix64(&nState);
+    struct PacketEntry *pEntry = &pTable[nHash % Entries];
+
+    nHits += pEntry->Fingerprint == nHash &&
+             pEntry->PayloadSize == 64 + (nHash & 1023);
+    nHits += pEntry->PayloadSize == 0;
+  }
+
+  double nNs = (nowSeconds() - nStart) * 1e9 / Probes;
+
+  *pBacked = transparentHugeBytes();
+  freeLarge(pTable, nLength);
+
+  /* Keep the loop from being optimised away */
+  return nHits == Probes + 1 ? -1 : nNs;
+}
+
+int main(int argc, char *argv[]) {
+
+  uint64_t pDefaults[] = {40000, 400000, 4000000, 16000000};
+  uint64_t nProbes = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_PROBES;
+  int nSizes = argc > 2 ? argc - 2 : 4;
+
+  printf("entries,table_mb,ns_per_lookup_4k,ns_per_lookup_huge,speedup,"
+         "huge_backed_mb\n");
+
+  for (int s = 0; s < nSizes; s++) {
+    uint64_t nEntries =
+        argc > 2 ? strtoull(argv[s + 2], NULL, 10) : pDefaults[s];
+    double nSmall, nHuge;
+    size_t nBacked;
+
+    gHugePages = 0;
+    nSmall = timeLookups(nEntries, nProbes, &nBacked);
+    gHugePages = 1;
+    nHuge = timeLookups(nEntries, nProbes, &nBacked);
+
+    if (nSmall < 0 || nHuge < 0) {
+      printf("* Error: Unable to benchmark %lu entries\n",
+             (unsigned long)nEntries);
+      return -1;
+    }
+
+    printf("%lu,%.1f,%.2f,%.2f,%.2f,%.1f\n", (unsigned long)nEntries,
+           sizeof(struct PacketEntry) * nEntries / 1048576.0, nSmall, nHuge,
+           nSmall / nHuge, nBacked / 1048576.0);
+  }
+
+  return 0;
+}
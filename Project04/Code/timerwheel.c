@@ -0,0 +1,183 @@
+/* timerwheel.c : Hierarchical timer wheel over table entry indices
+ *
+ * Timers close to expiry sit in the root wheel, one slot per tick.  Timers
+ * further out sit in coarser wheels and are cascaded down a level each time
+ * the wheel below wraps around.  Scheduling and cancelling are O(1), and each
+ * timer is cascaded at most WHEEL_LEVELS times before it expires.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hugepage.h"
+#include "timerwheel.h"
+
+char initializeTimerWheel(struct TimerWheel *pWheel, int nEntries) {
+
+  pWheel->Nodes =
+      (struct TimerNode *)allocateLarge(sizeof(struct TimerNode) * nEntries);
+
+  if (pWheel->Nodes == NULL) {
+    printf("* Error: Unable to create the timer wheel\n");
+    return 0;
+  }
+
+  for (int j = 0; j < nEntries; j++) {
+    pWheel->Nodes[j].Next = -1;
+    pWheel->Nodes[j].Prev = -1;
+    pWheel->Nodes[j].Slot = -1;
+    pWheel->Nodes[j].Expires = 0;
+  }
+
+  for (int j = 0; j < WHEEL_SLOTS; j++) {
+    pWheel->Heads[j] = -1;
+  }
+
+  pWheel->Current = 0;
+  pWheel->Count = 0;
+  return 1;
+}
+
+/* Put a timer in the slot that matches how far out it expires */
+static void placeTimer(struct TimerWheel *pWheel, int nEntry) {
+
+  struct TimerNode *pNode = &pWheel->Nodes[nEntry];
+  uint64_t nDelta;
+  int nSlot;
+
+  // Anything already due goes in the slot processed next
+  if (pNode->Expires < pWheel->Current) {
+    pNode->Expires = pWheel->Current;
+  }
+
+  nDelta = pNode->Expires - pWheel->Current;
+
+  if (nDelta > WHEEL_MAX_DELTA) {
+    nDelta = WHEEL_MAX_DELTA;
+    pNode->Expires = pWheel->Current + nDelta;
+  }
+
+  if (nDelta < WHEEL_ROOT_SIZE) {
+    nSlot = pNode->Expires & (WHEEL_ROOT_SIZE - 1);
+  } else {
+    int nLevel = 0;
+    int nShift = WHEEL_ROOT_BITS + WHEEL_LEVEL_BITS;
+
+    while (nDelta >= (1ULL << nShift)) {
+      nLevel++;
+      nShift += WHEEL_LEVEL_BITS;
+    }
+
+    nSlot = WHEEL_ROOT_SIZE + nLevel * WHEEL_LEVEL_SIZE +
+            ((pNode->Expires >> (nShift - WHEEL_LEVEL_BITS)) &
+             (WHEEL_LEVEL_SIZE - 1));
+  }
+
+  pNode->Slot = nSlot;
+  pNode->Prev = -1;
+  pNode->Next = pWheel->Heads[nSlot];
+
+  if (pNode->Next >= 0) {
+    pWheel->Nodes[pNode->Next].Prev = nEntry;
+  }
+
+  pWheel->Heads[nSlot] = nEntry;
+}
+
+static void unlinkTimer(struct TimerWheel *pWheel, int nEntry) {
+
+  struct TimerNode *pNode = &pWheel->Nodes[nEntry];
+
+  if (pNode->Prev >= 0) {
+    pWheel->Nodes[pNode->Prev].Next = pNode->Next;
+  } else {
+    pWheel->Heads[pNode->Slot] = pNode->Next;
+  }
+
+  if (pNode->Next >= 0) {
+    pWheel->Nodes[pNode->Next].Prev = pNode->Prev;
+  }
+
+  pNode->Slot = -1;
+  pNode->Next = -1;
+  pNode->Prev = -1;
+}
+
+void scheduleTimer(struct TimerWheel *pWheel, int nEntry, uint64_t Expires) {
+
+  if (pWheel->Nodes[nEntry].Slot >= 0) {
+    unlinkTimer(pWheel, nEntry);
+  } else {
+    pWheel->Count++;
+  }
+
+  pWheel->Nodes[nEntry].Expires = Expires;
+  placeTimer(pWheel, nEntry);
+}
+
+void cancelTimer(struct TimerWheel *pWheel, int nEntry) {
+
+  if (pWheel->Nodes[nEntry].Slot >= 0) {
+    unlinkTimer(pWheel, nEntry);
+    pWheel->Count--;
+  }
+}
+
+/* Re-place every timer of a coarse slot relative to the current tick */
+static void cascadeSlot(struct TimerWheel *pWheel, int nSlot) {
+
+  int nEntry = pWheel->Heads[nSlot];
+
+  pWheel->Heads[nSlot] = -1;
+
+  while (nEntry >= 0) {
+    int nNext = pWheel->Nodes[nEntry].Next;
+    placeTimer(pWheel, nEntry);
+    nEntry = nNext;
+  }
+}
+
+void advanceTimerWheel(struct TimerWheel *pWheel, uint64_t Now,
+                       void (*pExpire)(int nEntry)) {
+
+  while (pWheel->Current <= Now) {
+
+    // Nothing scheduled, so there is nothing to walk through
+    if (pWheel->Count == 0) {
+      pWheel->Current = Now + 1;
+      return;
+    }
+
+    int nIndex = pWheel->Current & (WHEEL_ROOT_SIZE - 1);
+
+    /* The root wheel wrapped - pull the next slot of each level down */
+    if (nIndex == 0) {
+      int nShift = WHEEL_ROOT_BITS;
+
+      for (int nLevel = 0; nLevel < WHEEL_LEVELS; nLevel++) {
+        int nLevelIndex =
+            (pWheel->Current >> nShift) & (WHEEL_LEVEL_SIZE - 1);
+
+        cascadeSlot(pWheel,
+                    WHEEL_ROOT_SIZE + nLevel * WHEEL_LEVEL_SIZE + nLevelIndex);
+
+        if (nLevelIndex != 0) {
+          break;
+        }
+
+        nShift += WHEEL_LEVEL_BITS;
+      }
+    }
+
+    /* Expire everything in this tick's slot */
+    while (pWheel->Heads[nIndex] >= 0) {
+      int nEntry = pWheel->Heads[nIndex];
+
+      unlinkTimer(pWheel, nEntry);
+      pWheel->Count--;
+      pExpire(nEntry);
+    }
+
+    pWheel->Current++;
+  }
+}
@@ -0,0 +1,59 @@
+/* timerwheel.h : Hierarchical timer wheel over table entry indices */
+
+#ifndef __TIMERWHEEL_H
+#define __TIMERWHEEL_H
+
+#include <stdint.h>
+
+/* A 256 slot wheel of single ticks and four 64 slot wheels above it, which
+ * covers 2^32 ticks (49 days at one tick per millisecond) */
+#define WHEEL_ROOT_BITS     8
+#define WHEEL_LEVEL_BITS    6
+#define WHEEL_LEVELS        4
+#define WHEEL_ROOT_SIZE     (1 << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_SIZE    (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_SLOTS         (WHEEL_ROOT_SIZE + WHEEL_LEVELS * WHEEL_LEVEL_SIZE)
+#define WHEEL_MAX_DELTA     ((1ULL << (WHEEL_ROOT_BITS + WHEEL_LEVELS * WHEEL_LEVEL_BITS)) - 1)
+
+/* One timer per entry, linked by entry index (-1 ends a list) */
+struct TimerNode
+{
+    int32_t     Next;
+    int32_t     Prev;
+
+    /* Slot the timer sits in, -1 if it is not scheduled */
+    int32_t     Slot;
+
+    uint64_t    Expires;
+};
+
+struct TimerWheel
+{
+    struct TimerNode *  Nodes;
+    int32_t             Heads[WHEEL_SLOTS];
+
+    /* The next tick to be processed */
+    uint64_t            Current;
+
+    /* Number of scheduled timers */
+    uint32_t            Count;
+};
+
+/** Set up a wheel with one (unscheduled) timer for each of nEntries
+ * @returns 1 if successful, 0 otherwise
+ */
+char initializeTimerWheel (struct TimerWheel * pWheel, int nEntries);
+
+/* Schedule (or reschedule) the timer of an entry, O(1) */
+void scheduleTimer (struct TimerWheel * pWheel, int nEntry, uint64_t Expires);
+
+/* Cancel the timer of an entry if it is scheduled, O(1) */
+void cancelTimer (struct TimerWheel * pWheel, int nEntry);
+
+/** Move the wheel up to and including tick Now, calling pExpire for every
+ * timer that expires on the way.  Time never goes backwards; a Now before
+ * the current tick is a no-op.
+ */
+void advanceTimerWheel (struct TimerWheel * pWheel, uint64_t Now, void (*pExpire)(int nEntry));
+
+#endif
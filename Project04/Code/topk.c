@@ -0,0 +1,371 @@
+/* topk.c : Top-K heavy-hitter payloads by redundant bytes (Space-Saving)
+ *
+ * Each thread keeps its own Space-Saving summary of TOPK_COUNTERS counters
+ * keyed by payload fingerprint and weighted by redundant bytes, so counting
+ * a hit writes nothing shared.  When a thread finishes, its summary
+ * is merged into a global one under a lock.  With -deterministic the hits
+ * arrive one at a time in read order, so the consumers share one summary
+ * that is merged when the file is done, just as a lone consumer's would be,
+ * and the result does not depend on which thread saw what.  A counter
+ * overestimates the true redundant bytes by at most its Error, and takes
+ * over the hits of the counter it replaced along with its bytes.  A payload
+ * is only certain to be in the top K if its bytes less the error beat the
+ * estimate of the (K+1)-th; the others are flagged in the report.
+ *
+ * The counters form a min-heap on Bytes (the smallest is the one replaced)
+ * with an open addressing index from fingerprint to heap position.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcap-process.h"
+#include "topk.h"
+
+struct TopKCounter
+{
+    uint64_t    Fingerprint;
+    uint64_t    Bytes;
+    uint64_t    Error;
+    uint64_t    Hits;
+
+    /* Details of the payload as last seen */
+    uint32_t    PayloadSize;
+    uint8_t     Protocol;
+    uint16_t    SrcPort;
+    uint16_t    DstPort;
+    uint8_t     Preview[TOPK_PREVIEW];
+};
+
+struct TopKSummary
+{
+    struct TopKCounter *    Heap;
+    int32_t *               Index;
+    uint32_t                IndexMask;
+    uint32_t                Count;
+    uint32_t                Capacity;
+};
+
+int gTopK = 0;
+
+static struct TopKSummary TopKGlobal;
+static pthread_mutex_t LockTopK = PTHREAD_MUTEX_INITIALIZER;
+
+/* Summary of the calling thread, created on its first hit */
+static __thread struct TopKSummary *TopKLocal = NULL;
+
+/* Summary shared by the consumers with -deterministic (under the table
+ * lock) */
+static struct TopKSummary *TopKShared = NULL;
+
+static char createSummary(struct TopKSummary *pSummary, uint32_t Capacity) {
+
+  uint32_t nIndexSize = 1;
+
+  while (nIndexSize < Capacity * 2) {
+    nIndexSize <<= 1;
+  }
+
+  pSummary->Heap =
+      (struct TopKCounter *)malloc(sizeof(struct TopKCounter) * Capacity);
+  pSummary->Index = (int32_t *)malloc(sizeof(int32_t) * nIndexSize);
+
+  if (pSummary->Heap == NULL || pSummary->Index == NULL) {
+    printf("* Error: Unable to create a top-K summary\n");
+    free(pSummary->Heap);
+    free(pSummary->Index);
+    return 0;
+  }
+
+  memset(pSummary->Index, 0xff, sizeof(int32_t) * nIndexSize);
+  pSummary->IndexMask = nIndexSize - 1;
+  pSummary->Count = 0;
+  pSummary->Capacity = Capacity;
+  return 1;
+}
+
+char initializeTopK(int K) {
+
+  if (!createSummary(&TopKGlobal, TOPK_COUNTERS)) {
+    return 0;
+  }
+
+  gTopK = K;
+  return 1;
+}
+
+static int32_t *findSlot(struct TopKSummary *pSummary, uint64_t Fingerprint) {
+
+  uint32_t nSlot = (uint32_t)(Fingerprint >> 32) & pSummary->IndexMask;
+
+  while (pSummary->Index[nSlot] >= 0 &&
+         pSummary->Heap[pSummary->Index[nSlot]].Fingerprint != Fingerprint) {
+    nSlot = (nSlot + 1) & pSummary->IndexMask;
+  }
+
+  return &pSummary->Index[nSlot];
+}
+
+/* Linear probing removal that shifts later entries back into the hole */
+static void removeSlot(struct TopKSummary *pSummary, uint64_t Fingerprint) {
+
+  uint32_t nHole = findSlot(pSummary, Fingerprint) - pSummary->Index;
+  uint32_t nSlot = nHole;
+
+  pSummary->Index[nHole] = -1;
+
+  while (1) {
+    nSlot = (nSlot + 1) & pSummary->IndexMask;
+
+    if (pSummary->Index[nSlot] < 0) {
+      return;
+    }
+
+    uint32_t nHome =
+        (uint32_t)(pSummary->Heap[pSummary->Index[nSlot]].Fingerprint >> 32) &
+        pSummary->IndexMask;
+
+    if (((nSlot - nHome) & pSummary->IndexMask) >=
+        ((nSlot - nHole) & pSummary->IndexMask)) {
+      pSummary->Index[nHole] = pSummary->Index[nSlot];
+      pSummary->Index[nSlot] = -1;
+      nHole = nSlot;
+    }
+  }
+}
+
+static void swapCounters(struct TopKSummary *pSummary, uint32_t a,
+                         uint32_t b) {
+
+  // Find both index slots while they still point at the right counters
+  int32_t *pSlotA = findSlot(pSummary, pSummary->Heap[a].Fingerprint);
+  int32_t *pSlotB = findSlot(pSummary, pSummary->Heap[b].Fingerprint);
+  struct TopKCounter t = pSummary->Heap[a];
+
+  pSummary->Heap[a] = pSummary->Heap[b];
+  pSummary->Heap[b] = t;
+  *pSlotA = b;
+  *pSlotB = a;
+}
+
+/* A counter only ever grows, so it only ever moves down the min-heap */
+static void siftDown(struct TopKSummary *pSummary, uint32_t nPos) {
+
+  while (1) {
+    uint32_t nSmall = nPos;
+    uint32_t nLeft = 2 * nPos + 1;
+    uint32_t nRight = 2 * nPos + 2;
+
+    if (nLeft < pSummary->Count &&
+        pSummary->Heap[nLeft].Bytes < pSummary->Heap[nSmall].Bytes) {
+      nSmall = nLeft;
+    }
+
+    if (nRight < pSummary->Count &&
+        pSummary->Heap[nRight].Bytes < pSummary->Heap[nSmall].Bytes) {
+      nSmall = nRight;
+    }
+
+    if (nSmall == nPos) {
+      return;
+    }
+
+    swapCounters(pSummary, nPos, nSmall);
+    nPos = nSmall;
+  }
+}
+
+static void siftUp(struct TopKSummary *pSummary, uint32_t nPos) {
+
+  while (nPos > 0 &&
+         pSummary->Heap[(nPos - 1) / 2].Bytes > pSummary->Heap[nPos].Bytes) {
+    swapCounters(pSummary, nPos, (nPos - 1) / 2);
+    nPos = (nPos - 1) / 2;
+  }
+}
+
+/* The Space-Saving update, with a counter (Bytes, Error, Hits) as weight */
+static void updateSummary(struct TopKSummary *pSummary,
+                          struct TopKCounter *pUpdate) {
+
+  int32_t *pSlot = findSlot(pSummary, pUpdate->Fingerprint);
+  struct TopKCounter *pCounter;
+  uint32_t nPos;
+
+  if (*pSlot >= 0) {
+    nPos = *pSlot;
+    pCounter = &pSummary->Heap[nPos];
+    pCounter->Bytes += pUpdate->Bytes;
+    pCounter->Error += pUpdate->Error;
+    pCounter->Hits += pUpdate->Hits;
+  } else if (pSummary->Count < pSummary->Capacity) {
+    nPos = pSummary->Count++;
+    *pSlot = nPos;
+    pCounter = &pSummary->Heap[nPos];
+    *pCounter = *pUpdate;
+    siftUp(pSummary, nPos);
+    return;
+  } else {
+    /* Take over the smallest counter, whose bytes become our error */
+    nPos = 0;
+    pCounter = &pSummary->Heap[0];
+    removeSlot(pSummary, pCounter->Fingerprint);
+
+    uint64_t nFloor = pCounter->Bytes;
+    uint64_t nFloorHits = pCounter->Hits;
+
+    *pCounter = *pUpdate;
+    pCounter->Bytes += nFloor;
+    pCounter->Error += nFloor;
+    pCounter->Hits += nFloorHits;
+    *findSlot(pSummary, pCounter->Fingerprint) = 0;
+  }
+
+  // Keep the most recent details of the payload
+  pCounter->PayloadSize = pUpdate->PayloadSize;
+  pCounter->Protocol = pUpdate->Protocol;
+  pCounter->SrcPort = pUpdate->SrcPort;
+  pCounter->DstPort = pUpdate->DstPort;
+  memcpy(pCounter->Preview, pUpdate->Preview, TOPK_PREVIEW);
+
+  siftDown(pSummary, nPos);
+}
+
+void countTopK(uint64_t Fingerprint, struct Packet *pPacket) {
+
+  struct TopKSummary **ppSummary = gDeterministic ? &TopKShared : &TopKLocal;
+  struct TopKCounter update;
+  uint32_t nPreview = pPacket->PayloadSize;
+
+  if (*ppSummary == NULL) {
+    *ppSummary = (struct TopKSummary *)malloc(sizeof(struct TopKSummary));
+
+    if (*ppSummary == NULL ||
+        !createSummary(*ppSummary, TOPK_COUNTERS)) {
+      free(*ppSummary);
+      *ppSummary = NULL;
+      return;
+    }
+  }
+
+  if (nPreview > TOPK_PREVIEW) {
+    nPreview = TOPK_PREVIEW;
+  }
+
+  memset(&update, 0, sizeof(update));
+  update.Fingerprint = Fingerprint;
+  update.Bytes = pPacket->PayloadSize;
+  update.Hits = 1;
+  update.PayloadSize = pPacket->PayloadSize;
+  update.Protocol = pPacket->Protocol;
+  update.SrcPort = pPacket->SrcPort;
+  update.DstPort = pPacket->DstPort;
+  memcpy(update.Preview, pPacket->Data + pPacket->PayloadOffset, nPreview);
+
+  updateSummary(*ppSummary, &update);
+}
+
+void detachTopK() {
+
+  struct TopKSummary **ppSummary = gDeterministic ? &TopKShared : &TopKLocal;
+
+  if (*ppSummary == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&LockTopK);
+
+  for (uint32_t j = 0; j < (*ppSummary)->Count; j++) {
+    updateSummary(&TopKGlobal, &(*ppSummary)->Heap[j]);
+  }
+
+  pthread_mutex_unlock(&LockTopK);
+
+  free((*ppSummary)->Heap);
+  free((*ppSummary)->Index);
+  free(*ppSummary);
+  *ppSummary = NULL;
+}
+
+static int compareCounters(const void *a, const void *b) {
+
+  const struct TopKCounter *pA = (const struct TopKCounter *)a;
+  const struct TopKCounter *pB = (const struct TopKCounter *)b;
+
+  if (pA->Bytes != pB->Bytes) {
+    return pA->Bytes < pB->Bytes ? 1 : -1;
+  }
+
+  return 0;
+}
+
+void printTopK() {
+
+  struct TopKCounter *pSorted;
+  uint32_t nShow;
+  uint64_t nBeyond;
+  char bUnsure = 0;
+
+  detachTopK();
+
+  pSorted = (struct TopKCounter *)malloc(sizeof(struct TopKCounter) *
+                                         (TopKGlobal.Count + 1));
+
+  if (pSorted == NULL) {
+    return;
+  }
+
+  memcpy(pSorted, TopKGlobal.Heap, sizeof(struct TopKCounter) * TopKGlobal.Count);
+  qsort(pSorted, TopKGlobal.Count, sizeof(struct TopKCounter), compareCounters);
+
+  nShow = TopKGlobal.Count < (uint32_t)gTopK ? TopKGlobal.Count : gTopK;
+
+  // The estimate a payload outside the top K could have at most
+  nBeyond = TopKGlobal.Count > nShow ? pSorted[nShow].Bytes : 0;
+
+  printf("Top %d payloads by redundant bytes\n", gTopK);
+  printf("  #   Redundant (+/- err)     Hits   Size Proto  SrcPort  DstPort  "
+         "Preview\n");
+
+  for (uint32_t j = 0; j < nShow; j++) {
+    struct TopKCounter *pCounter = &pSorted[j];
+    uint32_t nPreview = pCounter->PayloadSize < TOPK_PREVIEW
+                            ? pCounter->PayloadSize
+                            : TOPK_PREVIEW;
+
+    char bSure = pCounter->Bytes - pCounter->Error > nBeyond;
+
+    bUnsure |= !bSure;
+
+    printf("  %-2u%c %10lu (%8lu) %8lu %6u %5s %8u %8u  ", j + 1,
+           bSure ? ' ' : '?',
+           (unsigned long)pCounter->Bytes, (unsigned long)pCounter->Error,
+           (unsigned long)pCounter->Hits, pCounter->PayloadSize,
+           pCounter->Protocol == 6 ? "TCP"
+                                   : (pCounter->Protocol == 17 ? "UDP" : "?"),
+           pCounter->SrcPort, pCounter->DstPort);
+
+    for (uint32_t k = 0; k < nPreview; k++) {
+      printf("%02x", pCounter->Preview[k]);
+    }
+
+    printf(" |");
+
+    for (uint32_t k = 0; k < nPreview; k++) {
+      char c = pCounter->Preview[k];
+      printf("%c", (c >= 32 && c < 127) ? c : '.');
+    }
+
+    printf("|\n");
+  }
+
+  if (bUnsure) {
+    printf("  ? Not certain to be in the top %d (its bytes less the error do "
+           "not beat %lu)\n",
+           gTopK, (unsigned long)nBeyond);
+  }
+
+  free(pSorted);
+}
@@ -0,0 +1,41 @@
+/* topk.h : Top-K heavy-hitter payloads by redundant bytes (Space-Saving) */
+
+#ifndef __TOPK_H
+#define __TOPK_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/* Largest K that can be asked for */
+#define TOPK_MAX            64
+
+/* Counters in each summary whatever K is; with only a few per K the tail
+ * churns and the reported counters are mostly error */
+#define TOPK_COUNTERS       4096
+
+/* Bytes of payload kept for the hex preview */
+#define TOPK_PREVIEW        16
+
+/* How many payloads to report, zero if not tracking (-topk) */
+extern int gTopK;
+
+/** Set up the global summary that the per-thread summaries merge into
+ * @param K  Number of payloads to report (1 to TOPK_MAX)
+ * @returns 1 if successful, 0 otherwise
+ */
+char initializeTopK (int K);
+
+/* Count a hit of pPacket's payload against the calling thread's summary.
+ * No shared state is written, so it can be called without any lock. */
+void countTopK (uint64_t Fingerprint, struct Packet * pPacket);
+
+/* Merge the calling thread's summary into the global one and release it
+ * (call when a consumer thread finishes, or with -deterministic once the
+ * consumers of a file are joined) */
+void detachTopK ();
+
+/* Print the top payloads, merging in the calling thread's summary first */
+void printTopK ();
+
+#endif